@@ -39,15 +39,78 @@
 #include <vlc_access.h>
 #include <vlc_dialog.h>
 #include <vlc_interface.h>
+#include <vlc_configuration.h>
+#include <vlc_fs.h>
+#include <vlc_rand.h>
+#include <vlc_atomic.h>
 
 #include <vlc_network.h>
 #include <vlc_services_discovery.h>
 #include <vlc_url.h>
 
 #include <time.h>
+#include <ctype.h>
+#ifdef WIN32
+# include <mstcpip.h>
+# include <io.h>
+#else
+# include <netinet/tcp.h>
+# include <sys/file.h>
+# include <sys/mman.h>
+#endif
+
+#include "myth_proto.h"
 
 #define IPPORT_MYTH 6543u
 
+/* initial size of each REQUEST_BLOCK, adapted to the link while playing */
+#ifdef WIN32
+# define MYTH_REQUEST_LEN 65536
+#else
+# define MYTH_REQUEST_LEN 131072
+#endif
+
+/* size of the prefetch ring buffer filled from the data socket */
+#define MYTH_RING_SIZE (32 * MYTH_REQUEST_LEN)
+
+/* bounds of the adaptive REQUEST_BLOCK size */
+#define MYTH_REQUEST_MIN 32768
+#define MYTH_REQUEST_MAX (MYTH_RING_SIZE / 4)
+
+/* read time over which throughput is sampled */
+#define MYTH_BANDWIDTH_WINDOW (CLOCK_FREQ / 4)
+
+/* how often the size of a recording in progress is refreshed, backing off
+ * to the longest interval while it does not change, and how long past its
+ * scheduled end it may still grow, in seconds */
+#define MYTH_SIZE_INTERVAL     CLOCK_FREQ
+#define MYTH_SIZE_INTERVAL_MAX (16 * CLOCK_FREQ)
+#define MYTH_SIZE_GRACE        300
+
+/* how often a transfer the reader is not draining, when paused, is checked
+ * so neither the backend nor a firewall drops it */
+#define MYTH_KEEPALIVE_INTERVAL (30 * CLOCK_FREQ)
+
+/* TCP keepalive on every connection: idle time before the first probe and
+ * between probes, in seconds, and how many go unanswered before it drops */
+#define MYTH_TCP_KEEPIDLE  60
+#define MYTH_TCP_KEEPINTVL 10
+#define MYTH_TCP_KEEPCNT   6
+
+/* most FileTransfer sessions fetching in parallel, and the piece of the
+ * file each of them fetches at a time */
+#define MYTH_STRIPE_MAX   8
+#define MYTH_STRIPE_CHUNK MYTH_REQUEST_MAX
+
+/* receive buffer asked for on data sockets, the kernel may grant less */
+#define MYTH_DATA_RCVBUF (2 * 1024 * 1024)
+
+/* how often the round-trip time to the backend is measured again */
+#define MYTH_RTT_INTERVAL (5 * CLOCK_FREQ)
+
+/* how often the transfer statistics in the info panel are refreshed */
+#define MYTH_STATS_INTERVAL CLOCK_FREQ
+
 
 /*****************************************************************************
  * Module descriptor
@@ -65,6 +128,37 @@ static void SDClose( vlc_object_t * );
 #define SERVER_URL_TEXT N_("MythTV Backend Server URL")
 #define SERVER_URL_LONGTEXT N_("Enter the URL of myth backend starting with eg. myth://localhost/")
 
+#define VERSION_CACHE_TEXT N_("Remember backend protocol versions")
+#define VERSION_CACHE_LONGTEXT N_( \
+    "Save the protocol version negotiated with each backend so later " \
+    "connections do not have to be rejected first, even after a restart." )
+
+#define INDEX_CACHE_TEXT N_("Cache seek indexes and cut lists")
+#define INDEX_CACHE_LONGTEXT N_( \
+    "Keep the keyframe index and commercial breaks of finished recordings " \
+    "on disk, so opening them again needs no extra backend queries." )
+
+#define DISK_CACHE_TEXT N_("Keep played recordings on disk")
+#define DISK_CACHE_LONGTEXT N_( \
+    "Store the parts of recordings already fetched in the cache directory, " \
+    "so rewinding and watching again read them locally." )
+
+#define DISK_CACHE_SIZE_TEXT N_("Disk cache size (MB)")
+#define DISK_CACHE_SIZE_LONGTEXT N_( \
+    "Most space kept recordings may use, the least recently played are " \
+    "removed first." )
+
+#define STRIPES_TEXT N_("Parallel connections")
+#define STRIPES_LONGTEXT N_( \
+    "Number of connections fetching different parts of a recording at " \
+    "once. More than one helps on links with a long round-trip time." )
+
+#define TRACE_TEXT N_("Record protocol sessions to")
+#define TRACE_LONGTEXT N_( \
+    "Append every command, reply and data read size exchanged with the " \
+    "backend, with timestamps, to this file. It can be replayed with " \
+    "mythfake -r from the tools directory. Leave empty to disable." )
+
 #define SERVER_VERSION_TEXT N_("MythTV Backend Server Version")
 #define SERVER_VERSION_LONGTEXT N_("Suggested version of the backend server")
 
@@ -78,6 +172,18 @@ vlc_module_begin()
     set_subcategory( SUBCAT_INPUT_ACCESS )
     add_integer( "myth-caching", 2 * DEFAULT_PTS_DELAY / 1000, 
                  CACHING_TEXT, CACHING_LONGTEXT, true )
+    add_bool( "myth-version-cache", true,
+              VERSION_CACHE_TEXT, VERSION_CACHE_LONGTEXT, true )
+    add_bool( "myth-index-cache", true,
+              INDEX_CACHE_TEXT, INDEX_CACHE_LONGTEXT, true )
+    add_bool( "myth-disk-cache", false,
+              DISK_CACHE_TEXT, DISK_CACHE_LONGTEXT, true )
+    add_integer( "myth-disk-cache-size", 4096,
+                 DISK_CACHE_SIZE_TEXT, DISK_CACHE_SIZE_LONGTEXT, true )
+    add_integer_with_range( "myth-stripes", 1, 1, MYTH_STRIPE_MAX,
+                            STRIPES_TEXT, STRIPES_LONGTEXT, true )
+    add_savefile( "myth-trace", NULL,
+                  TRACE_TEXT, TRACE_LONGTEXT, true )
     add_shortcut( "myth" )
     set_callbacks( InOpen, InClose )
 
@@ -105,22 +211,17 @@ static int Seek( access_t *, uint64_t );
 static int Control( access_t *, int, va_list );
 
 static void *SDRun( void *data );
+static void SDDeleteRecording( void *, void * );
+static void *PrefetchThread( void *data );
 
-static void GetCutList( access_t *, access_sys_t *, char*, char* );
 
 #define MAKEINT64(lo, hi) ( ((int64_t)hi) << 32 | ((int64_t)(uint32_t)lo) )
 
-typedef struct _myth_version_t
-{
-    const char *psz_version;
-    const int i_version;
-    const char *psz_token;
-} myth_version_t;
-
 typedef struct _myth_sys_t
 {
     myth_version_t *version;
     char       file_transfer_id[10];
+    int        i_data_window;   /* most bytes granted and unread on the data socket */
 
     bool       b_supports_sql_query;
 
@@ -128,11 +229,52 @@ typedef struct _myth_sys_t
     char       sz_local_ip[NI_MAXNUMERICHOST];
 } myth_sys_t;
 
+/* a command connection, handed from one user to the next through the
+ * process-wide pool */
+typedef struct _myth_conn_t
+{
+    char       *psz_host;
+    int         i_port;
+    int         fd;
+    myth_socket_t sock;
+    myth_sys_t  myth;
+
+    vlc_mutex_t lock;       /* serializes commands on fd */
+    bool        b_broken;
+    mtime_t     i_idle_since;
+
+    struct _myth_conn_t *p_next;    /* while idle in the pool */
+} myth_conn_t;
+
+/* the recordings of a backend, see myth_CatalogAcquire() */
+typedef struct _myth_catalog_t
+{
+    char           *psz_host;
+    int             i_port;
+    int             i_refs;         /* services discovery instances feeding it */
+    vlc_dictionary_t recordings;    /* basename -> myth_recording_t * */
+
+    struct _myth_catalog_t *p_next;
+} myth_catalog_t;
+
+/* a recording shown by services discovery */
+typedef struct _sd_recording_t
+{
+    input_item_t *p_item;
+    struct _myth_recording_t *p_recording;  /* what p_item was built from */
+    int           i_generation;             /* last refresh that saw it */
+} sd_recording_t;
+
 struct services_discovery_sys_t
 {
     myth_sys_t myth;
     vlc_url_t  backend_url;
-    vlc_array_t* items;
+
+    /* what we show, by basename and by "chanid starttime" slot, owned
+     * by SDRun */
+    vlc_dictionary_t items;
+    vlc_dictionary_t slots;
+    int        i_generation;
 
     vlc_thread_t thread;
     vlc_mutex_t lock;
@@ -141,67 +283,182 @@ struct services_discovery_sys_t
     char **ppsz_urls;
     int i_urls;
 
-    int fd_cmd;
+    int fd_cmd;             /* event connection */
+    myth_socket_t sock;
+    myth_conn_t *p_cmd;     /* queries */
+    myth_catalog_t *p_catalog;
 
     bool b_update;
 };
 
+/* bytes of a recording kept on disk, see DiskCacheOpen() */
+typedef struct _myth_disk_cache_t
+{
+    int         fd;
+    char       *psz_map;
+
+    vlc_mutex_t lock;           /* serializes fd and the extents */
+    uint64_t   *pi_extents;     /* sorted disjoint [start, end) pairs */
+    int         i_extents;
+    uint64_t    i_total;
+} myth_disk_cache_t;
+
+/* latencies by bucket, the last one holds everything from 2 s up */
+#define MYTH_HISTOGRAM_BUCKETS 12
+
+typedef struct _myth_histogram_t
+{
+    int64_t     i_count;
+    mtime_t     i_total;
+    mtime_t     i_max;
+    int64_t     pi_bucket[MYTH_HISTOGRAM_BUCKETS];
+} myth_histogram_t;
+
+/* transfer counters of one playback, shown with the recording info, see
+ * StatsPublish() */
+typedef struct _myth_counters_t
+{
+    int64_t     i_bytes;        /* from the backend */
+    int64_t     i_cache_bytes;  /* from the disk cache */
+
+    myth_histogram_t rtt;       /* IS_OPEN round-trips */
+
+    myth_histogram_t request;   /* REQUEST_BLOCK until its reply, which follows the data */
+    int64_t     i_requested;
+    int64_t     i_granted;
+
+    int64_t     i_read_waits;   /* Read() found the ring empty */
+    mtime_t     i_read_waited;
+
+    myth_histogram_t seek;      /* seeks that restarted the transfer */
+    int64_t     i_skips;        /* seeks ahead within the ring */
+    int         i_reconnects;
+
+    myth_histogram_t size_poll;
+    int64_t     i_size_poll_bytes;
+} myth_counters_t;
+
+typedef struct _myth_stats_t
+{
+    vlc_mutex_t lock;           /* updated from every thread of the access */
+    mtime_t     i_published;    /* owned by Read() */
+    myth_counters_t counters;
+} myth_stats_t;
+
+/* one of the FileTransfer sessions of a striped playback, see StripeThread() */
+typedef struct _myth_stripe_t
+{
+    access_t   *p_access;
+    myth_conn_t *p_conn;        /* private, REQUEST_BLOCK holds it until the data is sent */
+    myth_sys_t  myth;
+    int         fd_data;
+    int         i_data_to_be_read;
+    myth_reply_t reply;
+
+    vlc_thread_t thread;
+    uint8_t    *p_chunk;
+    int64_t     i_chunk;        /* chunk being fetched, counted from i_stripe_base */
+    bool        b_lost;         /* transfer failed, opened again by _Seek() */
+} myth_stripe_t;
+
+/* keyframe position map of a recording, sorted by frame */
+typedef struct _myth_seek_index_t
+{
+    int64_t    *pi_frame;
+    int64_t    *pi_offset;
+    int         i_count;
+    int         i_fps_1000;     /* video rate, 0 when unknown */
+    void       *p_map;          /* the arrays point into it when mapped */
+    size_t      i_map;
+} myth_seek_index_t;
+
+#define MYTH_SEEK_INDEX_INIT { NULL, NULL, 0, 0, NULL, 0 }
+
 struct access_sys_t
 {
     myth_sys_t myth;
     vlc_url_t  url;
 
-    int        fd_cmd;
+    myth_conn_t *p_cmd;
+    myth_reply_t reply;     /* reused by the prefetch thread and seeks */
     int        fd_data;
     int        i_data_to_be_read;
-    mtime_t    i_filesize_last_updated;
     char      *psz_basename;
+    bool       b_info_loaded;
     bool       b_eofing;
 
-    int        i_titles;
-    input_title_t **titles;
-};
-
-typedef struct _myth_recording_t
-{
-    char *psz_title;
-    char *psz_subtitle;
-    char *psz_description;
-    char *psz_genre;
-    char *psz_urlBase;
-    char *psz_url;
-
-    char *psz_season;
-    char *psz_episode;
-    char *psz_category;
-    char *psz_chanNum;
-    char *psz_channelCallSign;
-    char *psz_channelName;
-    int64_t i_fileSize;
-
-    time_t scheduledStartTime;
-    time_t startTime;
-    time_t endTime;
-    int64_t duration;
-} myth_recording_t;
+    myth_stats_t stats;
 
-static myth_version_t myth_version_24 = { "0.24", 63, "3875641D" };
-static myth_version_t myth_version_25 = { "0.25", 72, "D78EFD6F" };
-static myth_version_t myth_version_26 = { "0.26", 75, "SweetRock" };
-static myth_version_t myth_version_27 = { "0.27", 77, "WindMark" };
-static myth_version_t *myth_versions[] = {
-    &myth_version_24, &myth_version_25, &myth_version_26, &myth_version_27 };
+    /* adaptive REQUEST_BLOCK sizing, owned by the prefetch thread */
+    int        i_request_len;
+    int        i_request_threshold;
+    mtime_t    i_rtt;
+    mtime_t    i_rtt_next;
+    int64_t    i_bandwidth;
+    mtime_t    i_bw_time;
+    int64_t    i_bw_bytes;
 
+    /* prefetch thread, owns p_cmd and fd_data while running */
+    vlc_thread_t thread;
+    vlc_mutex_t  lock;
+    vlc_cond_t   wait;
+    bool         b_prefetching;
+
+    /* ring buffer, protected by lock */
+    uint8_t   *p_ring;
+    size_t     i_ring_start;
+    size_t     i_ring_fill;
+    bool       b_ring_eof;
+    bool       b_ring_error;
+    bool       b_ring_stale;    /* transfer lost, Read() carries on after the ring on a new one */
+    uint64_t   i_size_update;
+
+    /* striped fetching, used instead of fd_data, which is closed, when
+     * i_stripes is set. The stripes take turns appending their chunks to
+     * the ring, i_stripe_next is protected by lock */
+    myth_stripe_t *p_stripes;
+    int        i_stripes;
+    uint64_t   i_stripe_base;
+    int64_t    i_stripe_next;
+
+    /* disk cache, written by the prefetch thread at i_fetch_pos. After a
+     * seek Read() takes [i_pos, i_cache_until) from it while the network
+     * is already fetching from i_cache_until on. The prefetch thread takes
+     * the ranges it meets later from it too, and the transfer, at
+     * i_transfer_pos, is moved past them */
+    myth_disk_cache_t *p_cache;
+    uint64_t   i_fetch_pos;
+    uint64_t   i_transfer_pos;
+    uint64_t   i_cache_until;
+
+    /* file size tracking of a recording in progress */
+    vlc_thread_t size_thread;
+    bool         b_size_tracking;
+    time_t       i_rec_end;         /* protected by lock */
+
+    /* commercial breaks, loaded in the background and handed to Read() */
+    vlc_thread_t cut_thread;
+    bool         b_cut_loading;
+    int          i_chanid;
+    time_t       i_rec_start;
+    input_title_t *p_cut_title;     /* protected by lock */
+    uint64_t     i_cut_size;        /* file size the breaks belong to */
+    bool         b_cut_final;       /* recording finished, breaks can be cached */
+    myth_seek_index_t index;        /* protected by lock, empty until loaded */
+    myth_conn_t *p_cut_conn;        /* protected by lock, while querying */
 
+    int        i_titles;
+    input_title_t **titles;
+};
 
-static int myth_WriteCommand( vlc_object_t *p_access, int fd, char* psz_cmd );
-static int myth_ReadCommand( vlc_object_t *p_access, int fd, int *pi_len, char **ppsz_answer );
-static int myth_Send( vlc_object_t *p_access, int fd, int *pi_len, char **ppsz_answer, const char *psz_fmt, ... );
-static char* myth_token( char *psz_params, int i_len, int i_index );
-static int myth_count_tokens( char *psz_params, int i_len );
-static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* url, bool b_fd_data );
+static int myth_WriteCommand( vlc_object_t *p_access, myth_socket_t *p_sock );
+static int myth_ReadCommand( vlc_object_t *p_access, myth_socket_t *p_sock, myth_reply_t *p_reply );
+static int myth_Send( vlc_object_t *p_access, myth_socket_t *p_sock, myth_reply_t *p_reply, const char *psz_fmt, ... );
+static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* url, bool b_fd_data, bool b_events, myth_socket_t *p_sock );
+static FILE *CacheFileCreate( const char *psz_path, char **ppsz_tmp );
+static int CacheFileCommit( FILE *p_file, char *psz_tmp, const char *psz_path, bool b_error );
 
-int ( *myth_BackendMessage_t )( vlc_object_t *p_object, char *psz_params, int i_len );
+int ( *myth_BackendMessage_t )( vlc_object_t *p_object, myth_reply_t *p_reply );
 
 /*
 static int mysql_query( vlc_object_t *p_access, access_sys_t *p_sys, int fd, 
@@ -244,140 +501,183 @@ static int mysql_query( vlc_object_t *p_access, access_sys_t *p_sys, int fd,
 }
 */
 
-static int myth_WriteCommand( vlc_object_t *p_access, int fd, char* psz_cmd )
+/*****************************************************************************
+ * Session recorder: with myth-trace set, the frames of every command
+ * connection and the size of every data socket read are appended to a
+ * trace, see MYTH_TRACE_MAGIC. Shared by all instances of the process.
+ *****************************************************************************/
+static vlc_mutex_t myth_trace_lock = VLC_STATIC_MUTEX;
+static FILE *myth_trace = NULL;
+static int myth_trace_refs = 0;
+static mtime_t myth_trace_last;
+/* whether myth_trace is open, read without the lock on every data read */
+static atomic_bool myth_tracing = ATOMIC_VAR_INIT(false);
+
+/* with myth_trace_lock held */
+static void myth_TraceAppend( int i_kind, int fd, const void *p_data, uint64_t i_len )
 {
-    int len = strlen( psz_cmd );
-
-    char lenstr[9];
-    snprintf(lenstr, sizeof(lenstr), "%d", len);
-    memset(lenstr+strlen(lenstr), ' ', 8-strlen(lenstr));
-    lenstr[8] = '\0';
+    uint8_t p_head[MYTH_TRACE_HEAD_MAX];
+    mtime_t i_now = mdate();
 
-    //msg_Info( p_access, "myth_WriteCommand:\"%s%s\"", lenstr, psz_cmd);
+    size_t i_head = myth_TraceHeader( p_head, i_kind, i_now - myth_trace_last, fd, i_len );
+    myth_trace_last = i_now;
 
-    if( net_Printf( VLC_OBJECT(p_access), fd, NULL, "%s%s",
-                    lenstr, psz_cmd ) < 0 )
+    if ( fwrite( p_head, 1, i_head, myth_trace ) != i_head
+      || ( p_data && fwrite( p_data, 1, i_len, myth_trace ) != i_len ) )
     {
-        msg_Err( p_access, "failed to send command" );
-        return VLC_EGENERIC;
+        /* a partial record would make the rest unreadable */
+        fclose( myth_trace );
+        myth_trace = NULL;
+        atomic_store( &myth_tracing, false );
     }
-
-    return VLC_SUCCESS;
 }
 
-static int myth_ReadCommand( vlc_object_t *p_access, int fd, int *pi_len, char **ppsz_answer )
+/* every instance takes a reference, the first one with myth-trace set
+ * opens the file and the last one to go closes it */
+static void myth_TraceOpen( vlc_object_t *p_obj )
 {
-    /* read length */
-    char lenstr[9];
-    memset(lenstr, '\0', sizeof(lenstr));
-    int i_Read = 0;
-    int i_TotalRead = 0;
-    char *psz_line = NULL;
-
-    assert( fd != -1 );
+    char *psz_path = var_InheritString( p_obj, "myth-trace" );
 
-    while( i_TotalRead < 8 )
+    vlc_mutex_lock( &myth_trace_lock );
+    myth_trace_refs++;
+    if ( !myth_trace && psz_path && *psz_path )
     {
-        if( ( i_Read = net_Read( p_access, fd, NULL, lenstr + i_TotalRead, 8 - i_TotalRead, false ) ) <= 0 )
-            goto exit_error;
-        i_TotalRead += i_Read;
+        myth_trace = vlc_fopen( psz_path, "ab" );
+        if ( !myth_trace )
+            msg_Warn( p_obj, "unable to record the session to %s", psz_path );
+        else
+        {
+            uint8_t p_clock[10];
+            size_t i_clock = myth_TraceVarint( p_clock, (uint64_t) time( NULL ) * 1000000 );
+
+            msg_Dbg( p_obj, "recording the session to %s", psz_path );
+            if ( ftell( myth_trace ) == 0 )
+                fwrite( MYTH_TRACE_MAGIC, 1, 8, myth_trace );
+            myth_trace_last = mdate();
+            atomic_store( &myth_tracing, true );
+            myth_TraceAppend( MYTH_TRACE_START, 0, p_clock, i_clock );
+        }
     }
+    vlc_mutex_unlock( &myth_trace_lock );
 
-    int len = atoi( lenstr );
-    //msg_Info( p_access, "myth_ReadCommand-len:\"%d\"", len);
-
-    psz_line = malloc( len+1 );
-    if( !psz_line )
-        return VLC_ENOMEM;
-    psz_line[len] = '\0';
+    free( psz_path );
+}
 
-    i_TotalRead = 0;
-    while( i_TotalRead < len )
+static void myth_TraceClose( void )
+{
+    vlc_mutex_lock( &myth_trace_lock );
+    if ( --myth_trace_refs == 0 && myth_trace )
     {
-        if ((i_Read = net_Read( p_access, fd, NULL, psz_line + i_TotalRead, len - i_TotalRead, false )) <= 0)
-            goto exit_error;
-        i_TotalRead += i_Read;
+        atomic_store( &myth_tracing, false );
+        fclose( myth_trace );
+        myth_trace = NULL;
     }
+    vlc_mutex_unlock( &myth_trace_lock );
+}
+
+static void myth_TraceWrite( int i_kind, int fd, const void *p_data, uint64_t i_len )
+{
+    if ( !atomic_load( &myth_tracing ) )
+        return;
+
+    vlc_mutex_lock( &myth_trace_lock );
+    if ( myth_trace )
+        myth_TraceAppend( i_kind, fd, p_data, i_len );
+    vlc_mutex_unlock( &myth_trace_lock );
+}
 
-    //msg_Info( p_access, "myth_ReadCommand:\"%s%s\"", lenstr, psz_line);
+/* the reply as it came off the wire, myth_ReadFrame() cut it into tokens */
+static void myth_TraceReply( int fd, const myth_reply_t *p_reply )
+{
+    if ( !atomic_load( &myth_tracing ) )
+        return;
 
-    /* post process the final string and add \0 to the end of each token sp []:[] becomes \0]:[] */
-    char *cend = psz_line + len;
-    for( char *c = psz_line; c < cend; c++ )
+    vlc_mutex_lock( &myth_trace_lock );
+    if ( myth_trace )
     {
-        if (*c == '['
-            && c+1 < cend && c[1] == ']'
-            && c+2 < cend && c[2] == ':'
-            && c+3 < cend && c[3] == '['
-            && c+4 < cend && c[4] == ']')
+        char *psz_frame = malloc( p_reply->i_len + 1 );
+        if ( psz_frame )
         {
-            *c = '\0';
+            memcpy( psz_frame, p_reply->psz_data, p_reply->i_len );
+            for ( int i = 1; i < p_reply->i_tokens; i++ )
+                psz_frame[p_reply->pi_tokens[i] - 5] = '[';
+            myth_TraceAppend( MYTH_TRACE_RECV, fd, psz_frame, p_reply->i_len );
+            free( psz_frame );
         }
     }
+    vlc_mutex_unlock( &myth_trace_lock );
+}
 
-    if( pi_len )
-    {
-        *pi_len = len;
-    }
+/* net_Read() on a data socket */
+static int myth_DataRead( vlc_object_t *p_access, int fd, void *p_buf, size_t i_len )
+{
+    int i_read = net_Read( p_access, fd, NULL, p_buf, i_len, false );
 
-    if( ppsz_answer )
-    {
-        *ppsz_answer = psz_line;
-    }
-    else
-    {
-        free( psz_line );
-        psz_line = NULL;
-    }
+    myth_TraceWrite( MYTH_TRACE_DATA, fd, NULL, __MAX( i_read, 0 ) );
 
-    return VLC_SUCCESS;
-exit_error:
-    if( psz_line )
-    {
-        free( psz_line );
-        psz_line = NULL;
-    }
+    return i_read;
+}
 
-    if( pi_len )
+/* fill in the length header and send the built command in one write */
+static int myth_WriteCommand( vlc_object_t *p_access, myth_socket_t *p_sock )
+{
+    int len = p_sock->i_cmd - 8;
+    char lenstr[9];
+
+    if ( p_sock->b_cmd_error )
+        return VLC_ENOMEM;
+
+    snprintf(lenstr, sizeof(lenstr), "%-8d", len);
+    memcpy( p_sock->p_cmd, lenstr, 8 );
+
+    //msg_Info( p_access, "myth_WriteCommand:\"%.*s\"", p_sock->i_cmd, p_sock->p_cmd);
+
+    if( net_Write( p_access, p_sock->fd, NULL, p_sock->p_cmd, p_sock->i_cmd ) != p_sock->i_cmd )
     {
-        *pi_len = 0;
+        msg_Err( p_access, "failed to send command" );
+        return VLC_EGENERIC;
     }
 
-    return VLC_EGENERIC;
+    myth_TraceWrite( MYTH_TRACE_SEND, p_sock->fd, p_sock->p_cmd + 8, p_sock->i_cmd - 8 );
+
+    return VLC_SUCCESS;
 }
 
-static int myth_Send( vlc_object_t *p_access, int fd, int *pi_len, char **ppsz_answer, const char *psz_fmt, ... )
+static int myth_NetRead( void *p_opaque, int fd, void *p_buf, int i_len )
 {
-    va_list      args;
-    char         *psz_cmd;
+    return net_Read( (vlc_object_t *) p_opaque, fd, NULL, p_buf, i_len, false );
+}
 
-    va_start( args, psz_fmt );
-    if( vasprintf( &psz_cmd, psz_fmt, args ) == -1 )
-        return VLC_EGENERIC;
-    
-    va_end( args );
+static int myth_ReadCommand( vlc_object_t *p_access, myth_socket_t *p_sock, myth_reply_t *p_reply )
+{
+    int i_ret = myth_ReadFrame( p_sock, p_reply, myth_NetRead, p_access );
+
+    if ( !i_ret )
+        myth_TraceReply( p_sock->fd, p_reply );
+
+    return i_ret;
+}
 
-    if( myth_WriteCommand( p_access, fd, psz_cmd ) )
+/* send the command built on p_sock and wait for its reply */
+static int myth_Exchange( vlc_object_t *p_access, myth_socket_t *p_sock, myth_reply_t *p_reply )
+{
+    if( myth_WriteCommand( p_access, p_sock ) )
     {
-        free( psz_cmd );
         return VLC_EGENERIC;
     }
-    
-    free( psz_cmd );
 
-    if ( pi_len != NULL && ppsz_answer != NULL )
+    if ( p_reply != NULL )
     {
         while (true)
         {
-            if ( myth_ReadCommand( p_access, fd, pi_len, ppsz_answer ) )
+            if ( myth_ReadCommand( p_access, p_sock, p_reply ) )
             {
                 return VLC_EGENERIC;
             }
 
-            if ( !strcmp("BACKEND_MESSAGE", myth_token( *ppsz_answer, *pi_len, 0 ) ) )
+            if ( !strcmp("BACKEND_MESSAGE", myth_token( p_reply, 0 ) ) )
             {
-                msg_Info( p_access, "BACKEND -> %s ; %s ; %s ; %s", myth_token( *ppsz_answer, *pi_len, 1 ), myth_token( *ppsz_answer, *pi_len, 2 ), myth_token( *ppsz_answer, *pi_len, 3 ), myth_token( *ppsz_answer, *pi_len, 4 ) );
-                free( *ppsz_answer );
+                msg_Info( p_access, "BACKEND -> %s ; %s ; %s ; %s", myth_token( p_reply, 1 ), myth_token( p_reply, 2 ), myth_token( p_reply, 3 ), myth_token( p_reply, 4 ) );
             }
             else
             {
@@ -389,46 +689,246 @@ static int myth_Send( vlc_object_t *p_access, int fd, int *pi_len, char **ppsz_a
     return VLC_SUCCESS;
 }
 
-static char* myth_token( char *psz_params, int i_len, int i_index )
+static int myth_vSend( vlc_object_t *p_access, myth_socket_t *p_sock, myth_reply_t *p_reply, const char *psz_fmt, va_list args )
+{
+    myth_CmdReset( p_sock );
+    myth_CmdVPrintf( p_sock, psz_fmt, args );
+
+    return myth_Exchange( p_access, p_sock, p_reply );
+}
+
+static int myth_Send( vlc_object_t *p_access, myth_socket_t *p_sock, myth_reply_t *p_reply, const char *psz_fmt, ... )
+{
+    va_list      args;
+    int          i_ret;
+
+    va_start( args, psz_fmt );
+    i_ret = myth_vSend( p_access, p_sock, p_reply, psz_fmt, args );
+    va_end( args );
+
+    return i_ret;
+}
+
+/*****************************************************************************
+ * Protocol version cache: the version each backend accepted, so connecting
+ * to an older backend does not pay for a REJECT and a second connection
+ *****************************************************************************/
+typedef struct _myth_version_cache_t
+{
+    char           *psz_host;
+    int             i_port;
+    myth_version_t *version;
+} myth_version_cache_t;
+
+static vlc_mutex_t myth_version_lock = VLC_STATIC_MUTEX;
+static myth_version_cache_t **myth_version_cache = NULL;
+static int myth_version_cache_count = 0;
+static bool myth_version_cache_loaded = false;
+
+static char *myth_VersionCachePath( void )
+{
+    char *psz_dir = config_GetUserDir( VLC_CACHE_DIR );
+    char *psz_path;
+
+    if ( !psz_dir )
+        return NULL;
+
+    if ( asprintf( &psz_path, "%s"DIR_SEP"myth-versions", psz_dir ) == -1 )
+        psz_path = NULL;
+    free( psz_dir );
+
+    return psz_path;
+}
+
+static myth_version_t *myth_VersionFind( int i_version )
 {
-    char *cend = psz_params + i_len;
-    char *c = psz_params;
-    for (; c < cend && i_index > 0; c++)
+    int i_myth_versions = sizeof( myth_versions ) / sizeof( myth_version_t* );
+    for ( int j = 0; j < i_myth_versions; j++ )
     {
-        if (*c == '\0')
-        {
-            i_index--;
-            c += 4;
-        }
+        if( myth_versions[j]->i_version == i_version )
+            return myth_versions[j];
     }
 
-    if (i_index != 0)
-        return NULL;
+    return NULL;
+}
+
+static myth_version_cache_t *myth_VersionCacheGet( const char *psz_host, int i_port )
+{
+    for ( int i = 0; i < myth_version_cache_count; i++ )
+    {
+        myth_version_cache_t *p_entry = myth_version_cache[i];
+        if ( p_entry->i_port == i_port && !strcmp( p_entry->psz_host, psz_host ) )
+            return p_entry;
+    }
 
-    return c;
+    return NULL;
 }
 
-static int myth_count_tokens( char *psz_params, int i_len )
+static void myth_VersionCacheSet( const char *psz_host, int i_port, myth_version_t *version )
 {
-    int i_result = 1;
-    char *cend = psz_params + i_len;
-    char *c = psz_params;
-    for (; c < cend; c++)
+    myth_version_cache_t *p_entry = myth_VersionCacheGet( psz_host, i_port );
+
+    if ( !p_entry )
     {
-        if (*c == '\0')
+        p_entry = malloc( sizeof( *p_entry ) );
+        if ( !p_entry )
+            return;
+
+        p_entry->psz_host = strdup( psz_host );
+        if ( !p_entry->psz_host )
         {
-            i_result++;
+            free( p_entry );
+            return;
         }
+        p_entry->i_port = i_port;
+        TAB_APPEND( myth_version_cache_count, myth_version_cache, p_entry );
+    }
+
+    p_entry->version = version;
+}
+
+/* must be called with myth_version_lock held */
+static void myth_VersionCacheLoad( vlc_object_t *p_obj )
+{
+    if ( myth_version_cache_loaded )
+        return;
+    myth_version_cache_loaded = true;
+
+    if ( !var_InheritBool( p_obj, "myth-version-cache" ) )
+        return;
+
+    char *psz_path = myth_VersionCachePath();
+    if ( !psz_path )
+        return;
+
+    FILE *p_file = vlc_fopen( psz_path, "r" );
+    free( psz_path );
+    if ( !p_file )
+        return;
+
+    char psz_host[256];
+    int i_port, i_version;
+    while ( fscanf( p_file, "%255s %d %d", psz_host, &i_port, &i_version ) == 3 )
+    {
+        myth_version_t *version = myth_VersionFind( i_version );
+        if ( version )
+            myth_VersionCacheSet( psz_host, i_port, version );
+    }
+
+    fclose( p_file );
+}
+
+/* must be called with myth_version_lock held. Written aside and renamed
+ * over the old file, another process only ever reads a whole one */
+static void myth_VersionCacheSave( vlc_object_t *p_obj )
+{
+    bool b_error = false;
+    char *psz_tmp;
+
+    if ( !var_InheritBool( p_obj, "myth-version-cache" ) )
+        return;
+
+    char *psz_path = myth_VersionCachePath();
+    if ( !psz_path )
+        return;
+
+    FILE *p_file = CacheFileCreate( psz_path, &psz_tmp );
+    if ( !p_file )
+    {
+        msg_Warn( p_obj, "Unable to save protocol versions to %s", psz_path );
+        free( psz_path );
+        return;
+    }
+
+    for ( int i = 0; i < myth_version_cache_count; i++ )
+    {
+        myth_version_cache_t *p_entry = myth_version_cache[i];
+        b_error |= fprintf( p_file, "%s %d %d\n", p_entry->psz_host, p_entry->i_port, p_entry->version->i_version ) < 0;
+    }
+
+    if ( CacheFileCommit( p_file, psz_tmp, psz_path, b_error ) )
+        msg_Warn( p_obj, "Unable to save protocol versions to %s", psz_path );
+    free( psz_path );
+}
+
+static myth_version_t *myth_VersionLookup( vlc_object_t *p_obj, vlc_url_t *url )
+{
+    myth_version_t *version = &myth_version_27;
+
+    vlc_mutex_lock( &myth_version_lock );
+    myth_VersionCacheLoad( p_obj );
+
+    myth_version_cache_t *p_entry = myth_VersionCacheGet( url->psz_host, url->i_port );
+    if ( p_entry )
+        version = p_entry->version;
+    vlc_mutex_unlock( &myth_version_lock );
+
+    return version;
+}
+
+static void myth_VersionRemember( vlc_object_t *p_obj, vlc_url_t *url, myth_version_t *version )
+{
+    vlc_mutex_lock( &myth_version_lock );
+
+    myth_version_cache_t *p_entry = myth_VersionCacheGet( url->psz_host, url->i_port );
+    if ( !p_entry || p_entry->version != version )
+    {
+        myth_VersionCacheSet( url->psz_host, url->i_port, version );
+        myth_VersionCacheSave( p_obj );
     }
 
-    return i_result;
+    vlc_mutex_unlock( &myth_version_lock );
+}
+
+/* probe idle connections well before the system default of two hours, so
+ * a dead backend or a firewall dropping them is noticed */
+static void myth_KeepAlive( int fd )
+{
+    setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, (void *) &(int){ 1 }, sizeof( int ) );
+#ifdef WIN32
+    struct tcp_keepalive ka = { 1, MYTH_TCP_KEEPIDLE * 1000, MYTH_TCP_KEEPINTVL * 1000 };
+    DWORD i_ret;
+    WSAIoctl( fd, SIO_KEEPALIVE_VALS, &ka, sizeof( ka ), NULL, 0, &i_ret, NULL, NULL );
+#else
+# if defined( TCP_KEEPIDLE )
+    setsockopt( fd, IPPROTO_TCP, TCP_KEEPIDLE, &(int){ MYTH_TCP_KEEPIDLE }, sizeof( int ) );
+# elif defined( TCP_KEEPALIVE )
+    setsockopt( fd, IPPROTO_TCP, TCP_KEEPALIVE, &(int){ MYTH_TCP_KEEPIDLE }, sizeof( int ) );
+# endif
+# ifdef TCP_KEEPINTVL
+    setsockopt( fd, IPPROTO_TCP, TCP_KEEPINTVL, &(int){ MYTH_TCP_KEEPINTVL }, sizeof( int ) );
+# endif
+# ifdef TCP_KEEPCNT
+    setsockopt( fd, IPPROTO_TCP, TCP_KEEPCNT, &(int){ MYTH_TCP_KEEPCNT }, sizeof( int ) );
+# endif
+#endif
+}
+
+/* A backend writes a whole REQUEST_BLOCK to the data socket before it
+ * replies, so everything granted and not read yet must fit in the socket
+ * buffers or both ends wait on each other. Returns how much may be granted
+ * ahead: a quarter of our receive buffer, Linux reports twice what it holds
+ * for data and the backend side is unknown */
+static int myth_DataWindow( int fd )
+{
+    int i_size = MYTH_DATA_RCVBUF;
+    socklen_t i_len = sizeof( i_size );
+
+    setsockopt( fd, SOL_SOCKET, SO_RCVBUF, (void *) &i_size, sizeof( i_size ) );
+    if ( getsockopt( fd, SOL_SOCKET, SO_RCVBUF, (void *) &i_size, &i_len ) )
+        i_size = 0;
+
+    return VLC_CLIP( i_size / 4, MYTH_REQUEST_MIN, MYTH_REQUEST_MAX );
 }
 
-static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* url, bool b_fd_data )
+/* connect, negotiate the protocol version and announce ourselves. The
+ * reader used for the handshake is handed to the caller through p_sock,
+ * or must be empty when p_sock is NULL (data connections) */
+static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* url, bool b_fd_data, bool b_events, myth_socket_t *p_sock )
 {
-    char *psz_params;
-    int i_len;
-    myth_version_t* version = &myth_version_27;
+    myth_socket_t sock;
+    myth_reply_t reply = MYTH_REPLY_INIT;
+    myth_version_t* version = myth_VersionLookup( p_access, url );
 
     for ( int i = 0; i < 2; i++ )
     {
@@ -445,50 +945,50 @@ static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* u
 
         msg_Dbg( p_access, "Connected" );
 
+        /* playback sockets can sit idle for a long pause */
+        myth_KeepAlive( fd );
+
+        if ( b_fd_data )
+            p_sys->i_data_window = myth_DataWindow( fd );
+
         if( net_GetPeerAddress( fd, p_sys->sz_remote_ip, NULL ) || 
-            net_GetSockAddress( fd, p_sys->sz_local_ip, NULL ) )
+            net_GetSockAddress( fd, p_sys->sz_local_ip, NULL ) ||
+            myth_SocketInit( &sock, fd ) )
         {
             net_Close( fd );
             return 0;
         }
 
-        if( myth_Send( p_access, fd, &i_len, &psz_params, "MYTH_PROTO_VERSION %d %s", version->i_version, version->psz_token ) )
+        if( myth_Send( p_access, &sock, &reply, "MYTH_PROTO_VERSION %d %s", version->i_version, version->psz_token ) )
         {
+            myth_ReplyClean( &reply );
             msg_Err( p_access, "Failed to introduce ourselves." );
-            net_Close( fd );
-            return 0;
+            goto error;
         }
     
-        char *acceptreject = myth_token(psz_params, i_len, 0);
+        char *acceptreject = myth_token( &reply, 0);
 
         if ( !strncmp( acceptreject, "ACCEPT", 6 ) )
         {
-            int i_protocol_version = atoi( myth_token( psz_params, i_len, 1 ) );
+            int i_protocol_version = atoi( myth_token( &reply, 1 ) );
             p_sys->version = version;
             msg_Info( p_access, "MythBackend is protocol version %d", i_protocol_version);
+            myth_VersionRemember( p_access, url, version );
 
-            free( psz_params );
+            myth_ReplyClean( &reply );
         }
         else
         {
-            msg_Err( p_access, "MythBackend protocol mismatch, server is %s, we are expecting %d", myth_token(psz_params, i_len, 1), version->i_version );
+            msg_Err( p_access, "MythBackend protocol mismatch, server is %s, we are expecting %d", myth_token( &reply, 1), version->i_version );
             
-            int i_server_version = atoi( myth_token( psz_params, i_len, 1 ) );
+            int i_server_version = atoi( myth_token( &reply, 1 ) );
+            myth_SocketClean( &sock );
             net_Close( fd );
-            free( psz_params );
+            myth_ReplyClean( &reply );
             
-            int j = 0;
-            int i_myth_versions = sizeof( myth_versions ) / sizeof( myth_version_t* );
-            for ( ; j < i_myth_versions; j++ )
-            {
-                if( myth_versions[j]->i_version == i_server_version )
-                {
-                    version = myth_versions[j];
-                    break;
-                }
-            }
+            version = myth_VersionFind( i_server_version );
 
-            if ( j == i_myth_versions )
+            if ( !version )
             {
                 msg_Err( p_access, "MythBackend protocol %d is not supported.", i_server_version );
                 break;
@@ -501,21 +1001,22 @@ static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* u
 
         if ( b_fd_data )
         {
-            if ( myth_Send( p_access, fd, &i_len, &psz_params, "ANN FileTransfer VLC_%s 0[]:[]myth://%s:%d/%s[]:[]Default", p_sys->sz_local_ip, url->psz_host, url->i_port, url->psz_path ) )
+            if ( myth_Send( p_access, &sock, &reply, "ANN FileTransfer VLC_%s 0[]:[]myth://%s:%d/%s[]:[]Default", p_sys->sz_local_ip, url->psz_host, url->i_port, url->psz_path ) )
             {
-                return 0;
+                myth_ReplyClean( &reply );
+                goto error;
             }
 
-            acceptreject = myth_token(psz_params, i_len, 0);
+            acceptreject = myth_token( &reply, 0);
             if ( !strncmp( acceptreject, "OK", 2) )
             {
                 if ( p_sys->version == &myth_version_24 )
                 {
-                    ((access_t*)p_access)->info.i_size = MAKEINT64( atoi( myth_token(psz_params, i_len, 3)), atoi( myth_token(psz_params, i_len, 2) ) );
+                    ((access_t*)p_access)->info.i_size = MAKEINT64( atoi( myth_token( &reply, 3)), atoi( myth_token( &reply, 2) ) );
                 }
                 else
                 {
-                    ((access_t*)p_access)->info.i_size = atoll( myth_token(psz_params, i_len, 2) );
+                    ((access_t*)p_access)->info.i_size = atoll( myth_token( &reply, 2) );
                 }
                 
                 msg_Info( p_access, "Stream starting %"PRId64" B", ((access_t*)p_access)->info.i_size );
@@ -523,228 +1024,2701 @@ static int myth_Connect( vlc_object_t *p_access, myth_sys_t *p_sys, vlc_url_t* u
             else
             {
                 msg_Err( p_access, "Some error occured while trying to stream" );
-                net_Close( fd );
-                free( psz_params );
-                return 0;
+                myth_ReplyClean( &reply );
+                goto error;
             }
 
-            strncpy(p_sys->file_transfer_id, myth_token(psz_params, i_len, 1), sizeof(p_sys->file_transfer_id)-1);
+            strncpy(p_sys->file_transfer_id, myth_token( &reply, 1), sizeof(p_sys->file_transfer_id)-1);
             p_sys->file_transfer_id[sizeof(p_sys->file_transfer_id)-1] = '\0';
-            free( psz_params );
+            myth_ReplyClean( &reply );
         }
         else
         {
             
-            if ( myth_Send( p_access, fd, &i_len, &psz_params, "ANN Playback VLC_%s 1", p_sys->sz_local_ip) )
+            if ( myth_Send( p_access, &sock, &reply, "ANN Playback VLC_%s %d", p_sys->sz_local_ip, b_events ? 1 : 0 ) )
             {
+                myth_ReplyClean( &reply );
                 msg_Err( p_access, "Some error occured while sending announce." );
-                return 0;
+                goto error;
             }
 
-            acceptreject = myth_token(psz_params, i_len, 0);
+            acceptreject = myth_token( &reply, 0);
             if ( strncmp( acceptreject, "OK", 2 ) )
             {
                 msg_Err( p_access, "Reply to announce is NOT OK." );
-                net_Close( fd );
-                free( psz_params );
-                return 0;
+                myth_ReplyClean( &reply );
+                goto error;
             }
 
-            free( psz_params );
+            myth_ReplyClean( &reply );
+        }
+
+        if ( p_sock )
+        {
+            *p_sock = sock;
+        }
+        else
+        {
+            /* nothing may follow the announce reply before we ask for data */
+            if ( sock.i_end != sock.i_start )
+            {
+                msg_Err( p_access, "Unexpected data after announce." );
+                goto error;
+            }
+            myth_SocketClean( &sock );
         }
 
         return fd;
+
+error:
+        myth_SocketClean( &sock );
+        net_Close( fd );
+        return 0;
     }
 
     return 0;
 }
 
 
-static myth_recording_t ParseRecording( myth_version_t* version, char* psz_params, int i_len, int i_offset )
-{
-    myth_recording_t recording;
-    if ( version == &myth_version_24 )
-    {
-        recording.psz_title = myth_token( psz_params, i_len, i_offset + 0 );
-        recording.psz_subtitle = myth_token( psz_params, i_len, i_offset + 1 );
-        recording.psz_description = myth_token( psz_params, i_len, i_offset + 2 );
-        recording.psz_genre = myth_token( psz_params, i_len, i_offset + 3 );
-        recording.psz_channelName = myth_token( psz_params, i_len, i_offset + 7 );
-        recording.startTime = atoll( myth_token( psz_params, i_len, i_offset + 23 ) );
-        recording.endTime = atoll( myth_token( psz_params, i_len, i_offset + 24 ) );
-        recording.i_fileSize = atoll( myth_token( psz_params, i_len, i_offset + 9 ) );
-        recording.psz_urlBase = myth_token( psz_params, i_len, i_offset + 8 );
-    }
-    else if ( version == &myth_version_25 || version == &myth_version_26 )
-    {
-        recording.psz_title = myth_token( psz_params, i_len, i_offset + 0 );
-        recording.psz_subtitle = myth_token( psz_params, i_len, i_offset + 1 );
-        recording.psz_description = myth_token( psz_params, i_len, i_offset + 2 );
-        recording.psz_genre = myth_token( psz_params, i_len, i_offset + 5 );
-        recording.psz_channelName = myth_token( psz_params, i_len, i_offset + 9 );
-        recording.startTime = atoll( myth_token( psz_params, i_len, i_offset + 25 ) );
-        recording.endTime = atoll( myth_token( psz_params, i_len, i_offset + 26 ) );
-        recording.i_fileSize = atoll( myth_token( psz_params, i_len, i_offset + 11 ) );
-        recording.psz_urlBase = myth_token( psz_params, i_len, i_offset + 10 );
-    }
-    else
-    {
-        recording.psz_title = myth_token( psz_params, i_len, i_offset + 0 );
-        recording.psz_subtitle = myth_token( psz_params, i_len, i_offset + 1 );
-        recording.psz_description = myth_token( psz_params, i_len, i_offset + 2 );
-        recording.psz_genre = myth_token( psz_params, i_len, i_offset + 6 );
-        recording.psz_channelName = myth_token( psz_params, i_len, i_offset + 10 );
-        recording.startTime = atoll( myth_token( psz_params, i_len, i_offset + 26 ) );
-        recording.endTime = atoll( myth_token( psz_params, i_len, i_offset + 27 ) );
-        recording.i_fileSize = atoll( myth_token( psz_params, i_len, i_offset + 12 ) );
-        recording.psz_urlBase = myth_token( psz_params, i_len, i_offset + 11 );
-    }
+/*****************************************************************************
+ * Connection pool: negotiated and announced command connections that are
+ * not in use, for the next access or services discovery instance of the
+ * process. A connection has one user at a time, so a large reply on one
+ * never holds up another's REQUEST_BLOCK
+ *****************************************************************************/
+#define MYTH_POOL_IDLE_TIMEOUT (60 * CLOCK_FREQ)
 
-    recording.duration = recording.endTime - recording.startTime;
+static vlc_mutex_t myth_pool_lock = VLC_STATIC_MUTEX;
+static myth_conn_t *myth_pool = NULL;      /* idle connections */
+static int myth_pool_busy = 0;             /* connections checked out */
 
-    return recording;
+static void myth_ConnDelete( myth_conn_t *p_conn )
+{
+    myth_SocketClean( &p_conn->sock );
+    net_Close( p_conn->fd );
+    vlc_mutex_destroy( &p_conn->lock );
+    free( p_conn->psz_host );
+    free( p_conn );
 }
 
-
-static int InitialiseCommandConnection( vlc_object_t *p_access, access_sys_t *p_sys )
+/* an idle command connection must have nothing to read, anything else means
+ * the backend closed it or the stream is out of sync */
+static bool myth_ConnIsHealthy( myth_conn_t *p_conn )
 {
-    char *psz_params;
-    int   i_len;
+    struct pollfd ufd = { .fd = p_conn->fd, .events = POLLIN };
 
-    int fd = myth_Connect( p_access, &p_sys->myth, &p_sys->url, false );
+    if ( p_conn->b_broken )
+        return false;
 
-    if ( !fd )
-    {
-        return VLC_EGENERIC;
+    vlc_mutex_lock( &p_conn->lock );
+    int i_ret = poll( &ufd, 1, 0 );
+    bool b_pending = p_conn->sock.i_end != p_conn->sock.i_start;
+    vlc_mutex_unlock( &p_conn->lock );
+
+    return i_ret == 0 && !b_pending;
+}
+
+/* a new command connection, not in the pool */
+static myth_conn_t *myth_ConnNew( vlc_object_t *p_obj, vlc_url_t *url )
+{
+    myth_conn_t *p_conn = calloc( 1, sizeof( *p_conn ) );
+    if ( !p_conn )
+        return NULL;
+
+    p_conn->fd = myth_Connect( p_obj, &p_conn->myth, url, false, false, &p_conn->sock );
+    p_conn->psz_host = strdup( url->psz_host );
+    if ( !p_conn->fd || !p_conn->psz_host )
+    {
+        if ( p_conn->fd )
+        {
+            myth_SocketClean( &p_conn->sock );
+            net_Close( p_conn->fd );
+        }
+        free( p_conn->psz_host );
+        free( p_conn );
+        return NULL;
+    }
+
+    p_conn->i_port = url->i_port;
+    vlc_mutex_init( &p_conn->lock );
+
+    return p_conn;
+}
+
+/* an idle connection to the backend taken out of the pool, or a new one */
+static myth_conn_t *myth_PoolAcquire( vlc_object_t *p_obj, vlc_url_t *url )
+{
+    myth_conn_t *p_conn, **pp_conn;
+
+    vlc_mutex_lock( &myth_pool_lock );
+
+    for ( pp_conn = &myth_pool; ( p_conn = *pp_conn ) != NULL; )
+    {
+        /* drop connections that died or sat unused for too long */
+        if ( !myth_ConnIsHealthy( p_conn )
+          || mdate() - p_conn->i_idle_since > MYTH_POOL_IDLE_TIMEOUT )
+        {
+            *pp_conn = p_conn->p_next;
+            msg_Dbg( p_obj, "Dropping pooled connection to %s:%d", p_conn->psz_host, p_conn->i_port );
+            myth_ConnDelete( p_conn );
+            continue;
+        }
+
+        if ( p_conn->i_port == url->i_port && !strcmp( p_conn->psz_host, url->psz_host ) )
+        {
+            *pp_conn = p_conn->p_next;
+            break;
+        }
+        pp_conn = &p_conn->p_next;
+    }
+
+    myth_pool_busy++;
+
+    vlc_mutex_unlock( &myth_pool_lock );
+
+    if ( p_conn )
+        return p_conn;
+
+    /* connecting takes round-trips, other instances must not wait on them */
+    p_conn = myth_ConnNew( p_obj, url );
+    if ( !p_conn )
+    {
+        vlc_mutex_lock( &myth_pool_lock );
+        myth_pool_busy--;
+        vlc_mutex_unlock( &myth_pool_lock );
+    }
+
+    return p_conn;
+}
+
+/* give a connection back for the next user. Once nothing is checked out
+ * the idle ones are closed too, nobody is left to reuse them */
+static void myth_PoolRelease( myth_conn_t *p_conn )
+{
+    myth_conn_t *p_idle = NULL;
+
+    if ( !p_conn )
+        return;
+
+    vlc_mutex_lock( &myth_pool_lock );
+
+    if ( !p_conn->b_broken )
+    {
+        p_conn->i_idle_since = mdate();
+        p_conn->p_next = myth_pool;
+        myth_pool = p_conn;
+        p_conn = NULL;
+    }
+
+    if ( --myth_pool_busy == 0 )
+    {
+        p_idle = myth_pool;
+        myth_pool = NULL;
+    }
+
+    vlc_mutex_unlock( &myth_pool_lock );
+
+    if ( p_conn )
+        myth_ConnDelete( p_conn );
+
+    while ( p_idle )
+    {
+        p_conn = p_idle;
+        p_idle = p_conn->p_next;
+        myth_ConnDelete( p_conn );
+    }
+}
+
+/* start building a command on a pooled connection, the connection stays
+ * locked until myth_ConnExchange() */
+static myth_socket_t *myth_ConnBegin( myth_conn_t *p_conn )
+{
+    vlc_mutex_lock( &p_conn->lock );
+    myth_CmdReset( &p_conn->sock );
+
+    return &p_conn->sock;
+}
+
+static int myth_ConnExchange( vlc_object_t *p_access, myth_conn_t *p_conn, myth_reply_t *p_reply )
+{
+    int i_ret = myth_Exchange( p_access, &p_conn->sock, p_reply );
+    if ( i_ret )
+        p_conn->b_broken = true;
+    vlc_mutex_unlock( &p_conn->lock );
+
+    return i_ret;
+}
+
+/* send a command on a pooled connection and wait for its reply */
+static int myth_ConnSend( vlc_object_t *p_access, myth_conn_t *p_conn, myth_reply_t *p_reply, const char *psz_fmt, ... )
+{
+    va_list      args;
+    int          i_ret;
+
+    vlc_mutex_lock( &p_conn->lock );
+    va_start( args, psz_fmt );
+    i_ret = myth_vSend( p_access, &p_conn->sock, p_reply, psz_fmt, args );
+    va_end( args );
+    if ( i_ret )
+        p_conn->b_broken = true;
+    vlc_mutex_unlock( &p_conn->lock );
+
+    return i_ret;
+}
+
+
+/*****************************************************************************
+ * Recordings catalog: the recordings of a backend, keyed by basename. It is
+ * filled and kept current by services discovery, and lets access opens find
+ * their metadata without asking the backend again.
+ *****************************************************************************/
+static vlc_mutex_t myth_catalog_lock = VLC_STATIC_MUTEX;
+static myth_catalog_t *myth_catalogs = NULL;
+
+static const char *myth_Basename( const char *psz_path )
+{
+    const char *psz = strrchr( psz_path, '/' );
+    return psz ? psz + 1 : psz_path;
+}
+
+static void myth_RecordingDelete( myth_recording_t *p_recording )
+{
+    free( p_recording->psz_title );
+    free( p_recording->psz_subtitle );
+    free( p_recording->psz_description );
+    free( p_recording->psz_genre );
+    free( p_recording->psz_channelName );
+    free( p_recording->psz_urlBase );
+    free( p_recording );
+}
+
+/* copy the decoded fields of a recording parsed in place from a reply */
+static myth_recording_t *myth_RecordingDup( const myth_recording_t *p_src )
+{
+    myth_recording_t *p_recording = calloc( 1, sizeof( *p_recording ) );
+    if ( !p_recording )
+        return NULL;
+
+    p_recording->psz_title = strdup( p_src->psz_title );
+    p_recording->psz_subtitle = strdup( p_src->psz_subtitle );
+    p_recording->psz_description = strdup( p_src->psz_description );
+    p_recording->psz_genre = strdup( p_src->psz_genre );
+    p_recording->psz_channelName = strdup( p_src->psz_channelName );
+    p_recording->psz_urlBase = strdup( p_src->psz_urlBase );
+    p_recording->i_chanId = p_src->i_chanId;
+    p_recording->i_fileSize = p_src->i_fileSize;
+    p_recording->startTime = p_src->startTime;
+    p_recording->endTime = p_src->endTime;
+    p_recording->duration = p_src->duration;
+
+    if ( !p_recording->psz_title || !p_recording->psz_subtitle
+      || !p_recording->psz_description || !p_recording->psz_genre
+      || !p_recording->psz_channelName || !p_recording->psz_urlBase )
+    {
+        myth_RecordingDelete( p_recording );
+        return NULL;
+    }
+
+    return p_recording;
+}
+
+static void myth_CatalogFreeRecording( void *p_data, void *p_obj )
+{
+    VLC_UNUSED( p_obj );
+    myth_RecordingDelete( p_data );
+}
+
+static myth_catalog_t *myth_CatalogAcquire( vlc_url_t *url )
+{
+    myth_catalog_t *p_catalog;
+
+    vlc_mutex_lock( &myth_catalog_lock );
+
+    for ( p_catalog = myth_catalogs; p_catalog; p_catalog = p_catalog->p_next )
+    {
+        if ( p_catalog->i_port == url->i_port && !strcmp( p_catalog->psz_host, url->psz_host ) )
+            break;
+    }
+
+    if ( !p_catalog )
+    {
+        p_catalog = malloc( sizeof( *p_catalog ) );
+        if ( p_catalog )
+            p_catalog->psz_host = strdup( url->psz_host );
+        if ( !p_catalog || !p_catalog->psz_host )
+        {
+            free( p_catalog );
+            vlc_mutex_unlock( &myth_catalog_lock );
+            return NULL;
+        }
+
+        p_catalog->i_port = url->i_port;
+        p_catalog->i_refs = 0;
+        vlc_dictionary_init( &p_catalog->recordings, 0 );
+        p_catalog->p_next = myth_catalogs;
+        myth_catalogs = p_catalog;
+    }
+
+    p_catalog->i_refs++;
+
+    vlc_mutex_unlock( &myth_catalog_lock );
+
+    return p_catalog;
+}
+
+/* a catalog nobody keeps current is dropped, it would only go stale */
+static void myth_CatalogRelease( myth_catalog_t *p_catalog )
+{
+    if ( !p_catalog )
+        return;
+
+    vlc_mutex_lock( &myth_catalog_lock );
+
+    if ( --p_catalog->i_refs == 0 )
+    {
+        myth_catalog_t **pp = &myth_catalogs;
+        while ( *pp != p_catalog )
+            pp = &(*pp)->p_next;
+        *pp = p_catalog->p_next;
+
+        vlc_dictionary_clear( &p_catalog->recordings, myth_CatalogFreeRecording, NULL );
+        free( p_catalog->psz_host );
+        free( p_catalog );
+    }
+
+    vlc_mutex_unlock( &myth_catalog_lock );
+}
+
+/* myth_catalog_lock must be held */
+static void myth_CatalogRemove( myth_catalog_t *p_catalog, const char *psz_basename )
+{
+    vlc_dictionary_remove_value_for_key( &p_catalog->recordings, psz_basename, myth_CatalogFreeRecording, NULL );
+}
+
+/* myth_catalog_lock must be held */
+static void myth_CatalogInsert( myth_catalog_t *p_catalog, const myth_recording_t *p_recording )
+{
+    const char *psz_key = myth_Basename( p_recording->psz_urlBase );
+    myth_recording_t *p_copy;
+
+    if ( !*psz_key )
+        return;
+
+    p_copy = myth_RecordingDup( p_recording );
+    if ( !p_copy )
+        return;
+
+    vlc_dictionary_remove_value_for_key( &p_catalog->recordings, psz_key, myth_CatalogFreeRecording, NULL );
+    vlc_dictionary_insert( &p_catalog->recordings, psz_key, p_copy );
+}
+
+/* returns a copy of the catalogued recording, or NULL when no running
+ * services discovery knows it */
+static myth_recording_t *myth_CatalogLookup( vlc_url_t *url, const char *psz_basename )
+{
+    myth_recording_t *p_recording = NULL;
+
+    vlc_mutex_lock( &myth_catalog_lock );
+
+    for ( myth_catalog_t *p_catalog = myth_catalogs; p_catalog; p_catalog = p_catalog->p_next )
+    {
+        if ( p_catalog->i_port != url->i_port || strcmp( p_catalog->psz_host, url->psz_host ) )
+            continue;
+
+        myth_recording_t *p_entry = vlc_dictionary_value_for_key( &p_catalog->recordings, psz_basename );
+        if ( p_entry != kVLCDictionaryNotFound )
+            p_recording = myth_RecordingDup( p_entry );
+        break;
+    }
+
+    vlc_mutex_unlock( &myth_catalog_lock );
+
+    return p_recording;
+}
+
+
+static void SetRecordingInfo( vlc_object_t *p_access, access_sys_t *p_sys, input_thread_t *p_input, myth_recording_t *p_recording )
+{
+    char psz_datebuf[1000];
+    input_item_t *p_item = NULL;
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("MythTV Backend Version"), "%s", p_sys->myth.version->psz_version );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Myth Protocol"), "%d", p_sys->myth.version->i_version );
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Title"), "%s", p_recording->psz_title );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Sub title"), "%s", p_recording->psz_subtitle );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Description"), "%s", p_recording->psz_description );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Category"), "%s", p_recording->psz_genre );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Channel"), "%s", p_recording->psz_channelName );
+
+    strftime( psz_datebuf, sizeof( psz_datebuf ), "%Y-%m-%d %I:%M%p", localtime( &p_recording->startTime ) );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Recording start"), "%s", psz_datebuf );
+
+    strftime( psz_datebuf, sizeof( psz_datebuf ), "%Y-%m-%d %I:%M%p", localtime( &p_recording->endTime ) );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Recording end"), "%s", psz_datebuf );
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("File size"), "%"PRId64" MB", p_recording->i_fileSize / 1000000 );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Base name"), "%s", p_recording->psz_urlBase );
+
+    free( p_sys->psz_basename );
+    p_sys->psz_basename = strdup( p_recording->psz_urlBase );
+    p_sys->i_rec_end = p_recording->endTime;
+
+    p_item = input_GetItem( p_input );
+    //input_item_SetDate( p_item, "test" );
+
+    char* psz_ctitle;
+    if ( asprintf( &psz_ctitle, "%s: %s", p_recording->psz_title, p_recording->psz_subtitle ) != -1 )
+    {
+        input_Control( p_input, INPUT_SET_NAME, psz_ctitle );
+        free( psz_ctitle );
+    }
+
+    input_item_SetDescription( p_item, strdup( p_recording->psz_description ) );
+
+    /* for the commercial breaks, see CutListStart() */
+    p_sys->i_chanid = p_recording->i_chanId;
+    p_sys->i_rec_start = p_recording->startTime;
+
+    VLC_UNUSED( p_access );
+}
+
+/* take our recording from the catalog when the media browser already has
+ * it, else look it up with QUERY_RECORDING BASENAME, and only fall back to
+ * scanning the whole QUERY_RECORDINGS list when the backend can't */
+static int LoadRecordingInfo( vlc_object_t *p_access, access_sys_t *p_sys, input_thread_t *p_input )
+{
+    myth_reply_t reply = MYTH_REPLY_INIT;
+    const char *psz_basename = myth_Basename( p_sys->url.psz_path );
+
+    myth_recording_t *p_recording = myth_CatalogLookup( &p_sys->url, psz_basename );
+    if ( p_recording )
+    {
+        msg_Dbg( p_access, "Found %s in the recordings catalog", psz_basename );
+        SetRecordingInfo( p_access, p_sys, p_input, p_recording );
+        myth_RecordingDelete( p_recording );
+        return VLC_SUCCESS;
+    }
+
+    if ( myth_ConnSend( p_access, p_sys->p_cmd, &reply, "QUERY_RECORDING BASENAME %s", psz_basename ) )
+    {
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
+    }
+
+    if ( strncmp( myth_token( &reply, 0 ), "ERROR", 6 ) )
+    {
+        myth_recording_t recording = ParseRecording( p_sys->myth.version, &reply, 1 );
+        SetRecordingInfo( p_access, p_sys, p_input, &recording );
+        myth_ReplyClean( &reply );
+        return VLC_SUCCESS;
+    }
+
+    msg_Dbg( p_access, "QUERY_RECORDING BASENAME %s failed, searching all recordings", psz_basename );
+
+    if ( myth_ConnSend( p_access, p_sys->p_cmd, &reply, "QUERY_RECORDINGS Play" ) )
+    {
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
+    }
+
+    /* Set meta data */
+    int i_tokens = myth_count_tokens( &reply );
+    int i_rows = atoi( myth_token( &reply, 0) );
+    int i_fields = i_rows > 0 ? (i_tokens-1) / i_rows : 0;
+    for ( int i = 0; i < i_rows; i++ )
+    {
+        int i_offset = 1 + i * i_fields;
+        myth_recording_t row;
+
+        myth_DecodeRecording( p_sys->myth.version, &reply, i_offset, MYTH_FIELD( URL ), &row );
+
+        if (strstr(row.psz_urlBase, p_sys->url.psz_path))
+        {
+            /* found our program in all the recordings */
+            myth_recording_t recording = ParseRecording( p_sys->myth.version, &reply, i_offset );
+            SetRecordingInfo( p_access, p_sys, p_input, &recording );
+            break;
+        }
+    }
+
+    myth_ReplyClean( &reply );
+
+    return VLC_SUCCESS;
+}
+
+static int InitialiseCommandConnection( vlc_object_t *p_access, access_sys_t *p_sys )
+{
+    myth_reply_t reply = MYTH_REPLY_INIT;
+
+    p_sys->p_cmd = myth_PoolAcquire( p_access, &p_sys->url );
+
+    if ( !p_sys->p_cmd )
+    {
+        return VLC_EGENERIC;
     }
 
-    p_sys->fd_cmd = fd;
+    p_sys->myth.version = p_sys->p_cmd->myth.version;
 
     // check file exists
-    if ( myth_Send( p_access, p_sys->fd_cmd, &i_len, &psz_params, "QUERY_FILE_EXISTS[]:[]%s[]:[]Default", p_sys->url.psz_path ) )
+    if ( myth_ConnSend( p_access, p_sys->p_cmd, &reply, "QUERY_FILE_EXISTS[]:[]%s[]:[]Default", p_sys->url.psz_path ) )
     {
+        myth_ReplyClean( &reply );
         return VLC_EGENERIC;
     }
 
-    if ( i_len > 0 && psz_params[0] == '0' )
+    if ( reply.i_len > 0 && reply.psz_data[0] == '0' )
     {
         msg_Err( p_access, "File %s does not exist.", p_sys->url.psz_path );
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
+    }
+
+    myth_ReplyClean( &reply );
+
+    /* recording info is fetched once per playback, not on every reconnect */
+    if ( p_sys->b_info_loaded )
+        return VLC_SUCCESS;
+
+    input_thread_t *p_input = access_GetParentInput( (access_t *) p_access );
+    if( !p_input )
+    {
+        msg_Dbg( p_access, "Unable to find parent input thread. Access may not be from video." );
+        //pl_Release( p_access );
+        return VLC_SUCCESS;
+    }
+
+    int i_ret = LoadRecordingInfo( p_access, p_sys, p_input );
+    if ( !i_ret )
+        p_sys->b_info_loaded = true;
+
+    vlc_object_release( p_input );
+
+    return i_ret;
+}
+
+
+
+
+static int parseURL( vlc_url_t *url, const char *path )
+{
+    if( path == NULL )
+        return VLC_EGENERIC;
+
+    /* *** Parse URL and get server addr/port and path *** */
+    while( *path == '/' )
+        path++;
+
+    vlc_UrlParse( url, path, 0 );
+
+    if( url->psz_host == NULL || *url->psz_host == '\0' )
         return VLC_EGENERIC;
+
+    if( url->i_port <= 0 )
+        url->i_port = IPPORT_MYTH; /* default port */
+
+    if( url->psz_path != NULL && url->psz_path[0] == '/' )
+        url->psz_path++;
+
+    return VLC_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * Statistics: what the transfer did so far, to tell a slow network from a
+ * slow backend disk. Refreshed in the "MythTV transfer" info category.
+ *****************************************************************************/
+
+/* upper bounds of the histogram buckets, in ms */
+static const int pi_histogram_bounds[MYTH_HISTOGRAM_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000
+};
+
+static void HistogramAdd( myth_histogram_t *p_histogram, mtime_t i_duration )
+{
+    int i = 0;
+
+    while ( i < MYTH_HISTOGRAM_BUCKETS - 1 && i_duration >= pi_histogram_bounds[i] * ( CLOCK_FREQ / 1000 ) )
+        i++;
+
+    p_histogram->pi_bucket[i]++;
+    p_histogram->i_count++;
+    p_histogram->i_total += i_duration;
+    p_histogram->i_max = __MAX( p_histogram->i_max, i_duration );
+}
+
+/* upper bound of the bucket holding the given percentile, -1 past 2 s */
+static int HistogramPercentile( const myth_histogram_t *p_histogram, int i_percent )
+{
+    int64_t i_rank = ( p_histogram->i_count * i_percent + 99 ) / 100;
+    int64_t i_seen = 0;
+
+    for ( int i = 0; i < MYTH_HISTOGRAM_BUCKETS - 1; i++ )
+    {
+        i_seen += p_histogram->pi_bucket[i];
+        if ( i_seen >= i_rank )
+            return pi_histogram_bounds[i];
     }
 
-    free( psz_params );
+    return -1;
+}
+
+static void HistogramInfo( input_thread_t *p_input, const char *psz_name, const myth_histogram_t *p_histogram )
+{
+    char psz_buckets[MYTH_HISTOGRAM_BUCKETS * 24];
+    size_t i_len = 0;
+
+    if ( p_histogram->i_count == 0 )
+    {
+        input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), psz_name, "-" );
+        return;
+    }
+
+    /* the non empty buckets, as "<5ms:12" */
+    psz_buckets[0] = '\0';
+    for ( int i = 0; i < MYTH_HISTOGRAM_BUCKETS; i++ )
+    {
+        if ( !p_histogram->pi_bucket[i] || i_len >= sizeof( psz_buckets ) )
+            continue;
+
+        if ( i < MYTH_HISTOGRAM_BUCKETS - 1 )
+            i_len += snprintf( psz_buckets + i_len, sizeof( psz_buckets ) - i_len, " <%dms:%"PRId64,
+                               pi_histogram_bounds[i], p_histogram->pi_bucket[i] );
+        else
+            i_len += snprintf( psz_buckets + i_len, sizeof( psz_buckets ) - i_len, " >%dms:%"PRId64,
+                               pi_histogram_bounds[i - 1], p_histogram->pi_bucket[i] );
+    }
+
+    int i_p50 = HistogramPercentile( p_histogram, 50 );
+    int i_p99 = HistogramPercentile( p_histogram, 99 );
+    char psz_p50[16], psz_p99[16];
+    snprintf( psz_p50, sizeof( psz_p50 ), i_p50 < 0 ? ">2000" : "<%d", i_p50 );
+    snprintf( psz_p99, sizeof( psz_p99 ), i_p99 < 0 ? ">2000" : "<%d", i_p99 );
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), psz_name,
+                   "%"PRId64", avg %"PRId64" ms, p50 %s ms, p99 %s ms, max %"PRId64" ms,%s",
+                   p_histogram->i_count, p_histogram->i_total / p_histogram->i_count / 1000,
+                   psz_p50, psz_p99, p_histogram->i_max / 1000, psz_buckets );
+}
+
+static void StatsInit( myth_stats_t *p_stats )
+{
+    memset( p_stats, 0, sizeof( *p_stats ) );
+    vlc_mutex_init( &p_stats->lock );
+}
+
+static void StatsClean( vlc_object_t *p_access, myth_stats_t *p_stats )
+{
+    const myth_counters_t *c = &p_stats->counters;
+
+    msg_Dbg( p_access, "received %"PRId64" B, %"PRId64" B from the disk cache, %"PRId64" block requests, "
+             "%"PRId64" waits for data, %"PRId64" seeks, %"PRId64" skips, %d reconnects, %"PRId64" size polls",
+             c->i_bytes, c->i_cache_bytes, c->request.i_count, c->i_read_waits,
+             c->seek.i_count, c->i_skips, c->i_reconnects, c->size_poll.i_count );
+
+    vlc_mutex_destroy( &p_stats->lock );
+}
+
+static void StatsAddBytes( myth_stats_t *p_stats, int64_t i_bytes )
+{
+    vlc_mutex_lock( &p_stats->lock );
+    p_stats->counters.i_bytes += i_bytes;
+    vlc_mutex_unlock( &p_stats->lock );
+}
+
+static void StatsAddRequest( myth_stats_t *p_stats, int i_requested, int i_granted, mtime_t i_duration )
+{
+    vlc_mutex_lock( &p_stats->lock );
+    HistogramAdd( &p_stats->counters.request, i_duration );
+    p_stats->counters.i_requested += i_requested;
+    p_stats->counters.i_granted += __MAX( i_granted, 0 );
+    vlc_mutex_unlock( &p_stats->lock );
+}
+
+static void StatsAddLatency( myth_stats_t *p_stats, myth_histogram_t *p_histogram, mtime_t i_duration )
+{
+    vlc_mutex_lock( &p_stats->lock );
+    HistogramAdd( p_histogram, i_duration );
+    vlc_mutex_unlock( &p_stats->lock );
+}
+
+/* refresh the info panel, at most every MYTH_STATS_INTERVAL, from Read() */
+static void StatsPublish( access_t *p_access, myth_stats_t *p_stats )
+{
+    mtime_t i_now = mdate();
+
+    if ( i_now < p_stats->i_published + MYTH_STATS_INTERVAL )
+        return;
+    p_stats->i_published = i_now;
+
+    input_thread_t *p_input = access_GetParentInput( p_access );
+    if ( !p_input )
+        return;
+
+    /* formatted from a copy, the counters keep moving meanwhile */
+    myth_counters_t c;
+    vlc_mutex_lock( &p_stats->lock );
+    c = p_stats->counters;
+    vlc_mutex_unlock( &p_stats->lock );
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), _("Received"),
+                   "%"PRId64" KiB from the backend, %"PRId64" KiB from the disk cache",
+                   c.i_bytes / 1024, c.i_cache_bytes / 1024 );
+
+    HistogramInfo( p_input, _("Round-trips"), &c.rtt );
+
+    /* the backend sends a block before it replies, this includes the transfer */
+    HistogramInfo( p_input, _("Block deliveries"), &c.request );
+    if ( c.request.i_count > 0 )
+        input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), _("Block size"),
+                       "%"PRId64" B requested, %"PRId64" B granted on average",
+                       c.i_requested / c.request.i_count, c.i_granted / c.request.i_count );
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), _("Waits for data"),
+                   "%"PRId64", %"PRId64" ms in total", c.i_read_waits, c.i_read_waited / 1000 );
+
+    HistogramInfo( p_input, _("Seeks"), &c.seek );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), _("Skips"),
+                   "%"PRId64" within the buffer", c.i_skips );
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), _("Reconnects"), "%d", c.i_reconnects );
+
+    input_Control( p_input, INPUT_ADD_INFO, _("MythTV transfer"), _("Size polls"),
+                   "%"PRId64", %"PRId64" ms and %"PRId64" KiB in total", c.size_poll.i_count,
+                   c.size_poll.i_total / 1000, c.i_size_poll_bytes / 1024 );
+
+    vlc_object_release( p_input );
+}
+
+
+/*****************************************************************************
+ * Prefetch: keep REQUEST_BLOCKs in flight and fill the ring buffer
+ *****************************************************************************/
+
+/* Size the next REQUEST_BLOCK from the measured bandwidth-delay product, the
+ * way TCP autotunes its window: blocks of twice the BDP, and the next one is
+ * requested while at least one round-trip worth of data is still in flight.
+ * What is in flight never exceeds the data socket window */
+static void PrefetchAdaptRequest( access_t *p_access, access_sys_t *p_sys )
+{
+    if ( p_sys->i_rtt <= 0 || p_sys->i_bandwidth <= 0 )
+        return;
+
+    int i_max = __MIN( p_sys->myth.i_data_window, MYTH_REQUEST_MAX );
+    int64_t i_bdp = p_sys->i_bandwidth * p_sys->i_rtt / CLOCK_FREQ;
+    int64_t i_target = VLC_CLIP( 2 * i_bdp, MYTH_REQUEST_MIN, i_max );
+
+    /* move half way to the target so a single odd sample does not swing it */
+    int i_len = ( p_sys->i_request_len + i_target ) / 2;
+    i_len = VLC_CLIP( i_len & ~4095, MYTH_REQUEST_MIN, i_max );
+
+    if ( i_len != p_sys->i_request_len )
+        msg_Dbg( p_access, "REQUEST_BLOCK size %d (rtt %"PRId64" us, %"PRId64" B/s)", i_len, p_sys->i_rtt, p_sys->i_bandwidth );
+
+    p_sys->i_request_len = i_len;
+    p_sys->i_request_threshold = __MAX( i_len / 2, (int) __MIN( i_bdp, MYTH_RING_SIZE / 2 ) );
+    p_sys->i_request_threshold = __MIN( p_sys->i_request_threshold, p_sys->myth.i_data_window - i_len );
+}
+
+static void PrefetchMeasureRead( access_t *p_access, access_sys_t *p_sys, int i_read, mtime_t i_elapsed )
+{
+    p_sys->i_bw_bytes += i_read;
+    p_sys->i_bw_time += i_elapsed;
+
+    if ( p_sys->i_bw_time < MYTH_BANDWIDTH_WINDOW )
+        return;
+
+    int64_t i_sample = p_sys->i_bw_bytes * CLOCK_FREQ / p_sys->i_bw_time;
+    if ( p_sys->i_bandwidth <= 0 )
+        p_sys->i_bandwidth = i_sample;
+    else
+        p_sys->i_bandwidth = ( 7 * p_sys->i_bandwidth + i_sample ) / 8;
+
+    p_sys->i_bw_bytes = 0;
+    p_sys->i_bw_time = 0;
+
+    PrefetchAdaptRequest( p_access, p_sys );
+}
+
+/*****************************************************************************
+ * Cache files live in <cache dir>/myth, named after the recording
+ *****************************************************************************/
+static char *CacheDir( bool b_create )
+{
+    char *psz_dir = config_GetUserDir( VLC_CACHE_DIR );
+    char *psz_path;
+
+    if ( !psz_dir )
+        return NULL;
+
+    if ( asprintf( &psz_path, "%s"DIR_SEP"myth", psz_dir ) == -1 )
+        psz_path = NULL;
+    else if ( b_create )
+    {
+        vlc_mkdir( psz_dir, 0700 );
+        vlc_mkdir( psz_path, 0700 );
+    }
+    free( psz_dir );
+
+    return psz_path;
+}
+
+static char *CachePath( access_sys_t *p_sys, const char *psz_ext, bool b_create )
+{
+    char *psz_dir = CacheDir( b_create );
+    char *psz_name, *psz_path = NULL;
+
+    if ( !psz_dir )
+        return NULL;
+
+    psz_name = strdup( myth_Basename( p_sys->psz_basename ) );
+    if ( psz_name )
+    {
+        for ( char *p = psz_name; *p; p++ )
+        {
+            if ( !isalnum( (unsigned char) *p ) && *p != '.' && *p != '-' )
+                *p = '_';
+        }
+
+        if ( asprintf( &psz_path, "%s"DIR_SEP"%s.%s", psz_dir, psz_name, psz_ext ) == -1 )
+            psz_path = NULL;
+        free( psz_name );
+    }
+    free( psz_dir );
+
+    return psz_path;
+}
+
+/* cache files are written next to their final name and renamed over it, so
+ * other instances never read a partial one */
+static FILE *CacheFileCreate( const char *psz_path, char **ppsz_tmp )
+{
+    if ( asprintf( ppsz_tmp, "%s.%08lx.tmp", psz_path, vlc_mrand48() & 0xffffffff ) == -1 )
+    {
+        *ppsz_tmp = NULL;
+        return NULL;
+    }
+
+    int fd = vlc_open( *ppsz_tmp, O_WRONLY | O_CREAT | O_EXCL, 0600 );
+    FILE *p_file = fd != -1 ? fdopen( fd, "wb" ) : NULL;
+    if ( !p_file )
+    {
+        if ( fd != -1 )
+        {
+            close( fd );
+            vlc_unlink( *ppsz_tmp );
+        }
+        free( *ppsz_tmp );
+        *ppsz_tmp = NULL;
+    }
+
+    return p_file;
+}
+
+/* close p_file from CacheFileCreate(), and put it in place of psz_path
+ * unless writing it failed */
+static int CacheFileCommit( FILE *p_file, char *psz_tmp, const char *psz_path, bool b_error )
+{
+    b_error |= fclose( p_file ) != 0;
+
+#ifdef WIN32
+    /* rename() does not replace an existing file there */
+    if ( !b_error )
+        vlc_unlink( psz_path );
+#endif
+    if ( !b_error && vlc_rename( psz_tmp, psz_path ) )
+        b_error = true;
+
+    if ( b_error )
+        vlc_unlink( psz_tmp );
+    free( psz_tmp );
+
+    return b_error ? VLC_EGENERIC : VLC_SUCCESS;
+}
+
+/* a cache file mapped read-only as a whole. It is only ever replaced by a
+ * rename, so the mapping stays valid */
+static void *CacheFileMap( int fd, size_t *pi_size )
+{
+    struct stat st;
+    void *p_map;
+
+    if ( fstat( fd, &st ) || st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX )
+        return NULL;
+
+#ifdef WIN32
+    HANDLE h = CreateFileMapping( (HANDLE) _get_osfhandle( fd ), NULL, PAGE_READONLY, 0, 0, NULL );
+    if ( !h )
+        return NULL;
+    p_map = MapViewOfFile( h, FILE_MAP_READ, 0, 0, 0 );
+    CloseHandle( h );
+    if ( !p_map )
+        return NULL;
+#else
+    p_map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( p_map == MAP_FAILED )
+        return NULL;
+#endif
+
+    *pi_size = st.st_size;
+    return p_map;
+}
+
+static void CacheFileUnmap( void *p_map, size_t i_size )
+{
+#ifdef WIN32
+    VLC_UNUSED( i_size );
+    UnmapViewOfFile( p_map );
+#else
+    munmap( p_map, i_size );
+#endif
+}
+
+/*****************************************************************************
+ * Disk cache: what was fetched of a recording is kept in a sparse .data file,
+ * with the ranges it holds in a .map file merged into on close. Rewinding and
+ * watching again read it locally, only the gaps come from the backend. All
+ * recordings share a size cap and the least recently played are removed
+ * first.
+ *****************************************************************************/
+#define MYTH_MAP_MAGIC   "MYTHMAP"
+#define MYTH_MAP_VERSION 1
+
+/* how long closing waits for another instance saving the same map, and
+ * when its lock file is taken as left behind by a crash, in seconds */
+#define MYTH_MAP_LOCK_TRIES 100
+#define MYTH_MAP_LOCK_WAIT  (CLOCK_FREQ / 50)
+#define MYTH_MAP_LOCK_STALE 10
+
+typedef struct
+{
+    char        psz_magic[8];
+    uint32_t    i_version;
+    uint32_t    i_extents;
+    uint64_t    i_total;        /* bytes held */
+} myth_map_header_t;
+
+/* add [i_start, i_end), merged with the extents it touches */
+static int DiskCacheAddExtent( myth_disk_cache_t *p_cache, uint64_t i_start, uint64_t i_end )
+{
+    uint64_t *p = p_cache->pi_extents;
+    int i_first, i_last;
+
+    for ( i_first = 0; i_first < p_cache->i_extents && p[2 * i_first + 1] < i_start; i_first++ )
+        ;
+    for ( i_last = i_first; i_last < p_cache->i_extents && p[2 * i_last] <= i_end; i_last++ )
+    {
+        i_start = __MIN( i_start, p[2 * i_last] );
+        i_end = __MAX( i_end, p[2 * i_last + 1] );
+        p_cache->i_total -= p[2 * i_last + 1] - p[2 * i_last];
+    }
+
+    if ( i_last == i_first )
+    {
+        p = realloc( p_cache->pi_extents, 2 * ( p_cache->i_extents + 1 ) * sizeof( *p ) );
+        if ( !p )
+            return VLC_ENOMEM;
+        p_cache->pi_extents = p;
+        memmove( &p[2 * i_first + 2], &p[2 * i_first], 2 * ( p_cache->i_extents - i_first ) * sizeof( *p ) );
+        p_cache->i_extents++;
+    }
+    else if ( i_last > i_first + 1 )
+    {
+        memmove( &p[2 * i_first + 2], &p[2 * i_last], 2 * ( p_cache->i_extents - i_last ) * sizeof( *p ) );
+        p_cache->i_extents -= i_last - i_first - 1;
+    }
+
+    p[2 * i_first] = i_start;
+    p[2 * i_first + 1] = i_end;
+    p_cache->i_total += i_end - i_start;
+
+    return VLC_SUCCESS;
+}
+
+static bool DiskCacheLoadMap( myth_disk_cache_t *p_cache )
+{
+    myth_map_header_t header;
+    bool b_ok = false;
+
+    FILE *p_file = vlc_fopen( p_cache->psz_map, "rb" );
+    if ( !p_file )
+        return false;
+
+    if ( fread( &header, sizeof( header ), 1, p_file ) == 1
+      && !memcmp( header.psz_magic, MYTH_MAP_MAGIC, sizeof( header.psz_magic ) )
+      && header.i_version == MYTH_MAP_VERSION )
+    {
+        b_ok = true;
+        for ( uint32_t i = 0; b_ok && i < header.i_extents; i++ )
+        {
+            uint64_t pi_extent[2];
+
+            b_ok = fread( pi_extent, sizeof( pi_extent ), 1, p_file ) == 1
+                && pi_extent[0] < pi_extent[1]
+                && !DiskCacheAddExtent( p_cache, pi_extent[0], pi_extent[1] );
+        }
+    }
+
+    fclose( p_file );
+
+    return b_ok;
+}
+
+static bool DiskCacheLockMap( const char *psz_lock )
+{
+    for ( int i = 0; i < MYTH_MAP_LOCK_TRIES; i++ )
+    {
+        struct stat st;
+
+        int fd = vlc_open( psz_lock, O_WRONLY | O_CREAT | O_EXCL, 0600 );
+        if ( fd != -1 )
+        {
+            close( fd );
+            return true;
+        }
+
+        if ( !vlc_stat( psz_lock, &st ) && time( NULL ) - st.st_mtime > MYTH_MAP_LOCK_STALE )
+            vlc_unlink( psz_lock );
+        else
+            msleep( MYTH_MAP_LOCK_WAIT );
+    }
+
+    return false;
+}
+
+/* another instance may have fetched other parts of the recording into the
+ * same files meanwhile, its ranges are merged with ours */
+static void DiskCacheSaveMap( vlc_object_t *p_obj, myth_disk_cache_t *p_cache )
+{
+    myth_map_header_t header;
+    bool b_error = false;
+    char *psz_lock, *psz_tmp;
+
+    if ( asprintf( &psz_lock, "%s.lock", p_cache->psz_map ) == -1 )
+        return;
+
+    /* saved anyway when the lock cannot be had, at worst ranges are lost */
+    bool b_locked = DiskCacheLockMap( psz_lock );
+    if ( !b_locked )
+        msg_Warn( p_obj, "Unable to lock the disk cache map %s", p_cache->psz_map );
+
+    DiskCacheLoadMap( p_cache );
+
+    FILE *p_file = CacheFileCreate( p_cache->psz_map, &psz_tmp );
+    if ( !p_file )
+    {
+        msg_Warn( p_obj, "Unable to save the disk cache map %s", p_cache->psz_map );
+        goto exit;
+    }
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.psz_magic, MYTH_MAP_MAGIC, sizeof( header.psz_magic ) );
+    header.i_version = MYTH_MAP_VERSION;
+    header.i_extents = p_cache->i_extents;
+    header.i_total = p_cache->i_total;
+
+    b_error |= fwrite( &header, sizeof( header ), 1, p_file ) != 1;
+    if ( p_cache->i_extents > 0 )
+        b_error |= fwrite( p_cache->pi_extents, 2 * sizeof( uint64_t ), p_cache->i_extents, p_file ) != (size_t) p_cache->i_extents;
+
+    /* the previous map stays when this one cannot replace it */
+    if ( CacheFileCommit( p_file, psz_tmp, p_cache->psz_map, b_error ) )
+        msg_Warn( p_obj, "Unable to save the disk cache map %s", p_cache->psz_map );
+
+exit:
+    if ( b_locked )
+        vlc_unlink( psz_lock );
+    free( psz_lock );
+}
+
+/* every instance using the files of a recording holds a shared lock on its
+ * .data, emptying or removing them takes an exclusive one. Never waits */
+static bool DiskCacheLock( int fd, bool b_exclusive )
+{
+#ifdef WIN32
+    /* on a byte past any data, a locked range cannot be read or written */
+    HANDLE h = (HANDLE) _get_osfhandle( fd );
+    OVERLAPPED ov = { .Offset = MAXDWORD, .OffsetHigh = MAXDWORD >> 1 };
+
+    UnlockFileEx( h, 0, 1, 0, &ov );
+    return LockFileEx( h, LOCKFILE_FAIL_IMMEDIATELY | ( b_exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0 ),
+                       0, 1, 0, &ov );
+#else
+    return !flock( fd, ( b_exclusive ? LOCK_EX : LOCK_SH ) | LOCK_NB );
+#endif
+}
+
+static myth_disk_cache_t *DiskCacheOpen( access_t *p_access, access_sys_t *p_sys )
+{
+    if ( !p_sys->psz_basename || !var_InheritBool( p_access, "myth-disk-cache" ) )
+        return NULL;
+
+    myth_disk_cache_t *p_cache = calloc( 1, sizeof( *p_cache ) );
+    if ( !p_cache )
+        return NULL;
+
+    char *psz_data = CachePath( p_sys, "data", true );
+    p_cache->psz_map = CachePath( p_sys, "map", true );
+    if ( !psz_data || !p_cache->psz_map )
+    {
+        free( psz_data );
+        free( p_cache->psz_map );
+        free( p_cache );
+        return NULL;
+    }
+
+    /* data without a valid map cannot be trusted */
+    bool b_map = DiskCacheLoadMap( p_cache );
+    if ( !b_map )
+    {
+        free( p_cache->pi_extents );
+        p_cache->pi_extents = NULL;
+        p_cache->i_extents = 0;
+        p_cache->i_total = 0;
+    }
+
+    p_cache->fd = vlc_open( psz_data, O_RDWR | O_CREAT, 0600 );
+    if ( p_cache->fd == -1 )
+    {
+        msg_Warn( p_access, "Unable to open the disk cache %s", psz_data );
+        goto error;
+    }
+
+    /* it is emptied only when no other instance has it open, one that does
+     * is still filling it and saves its map on close */
+    if ( !b_map && DiskCacheLock( p_cache->fd, true ) && ftruncate( p_cache->fd, 0 ) )
+        msg_Warn( p_access, "Unable to empty the disk cache %s", psz_data );
+
+    if ( !DiskCacheLock( p_cache->fd, false ) )
+    {
+        msg_Dbg( p_access, "disk cache %s is being removed, not using it", psz_data );
+        goto error;
+    }
+
+#ifndef WIN32
+    /* removed by DiskCacheTrim() between the open and the lock */
+    struct stat st_fd, st_path;
+    if ( fstat( p_cache->fd, &st_fd ) || vlc_stat( psz_data, &st_path )
+      || st_fd.st_ino != st_path.st_ino || st_fd.st_dev != st_path.st_dev )
+    {
+        msg_Dbg( p_access, "disk cache %s was removed, not using it", psz_data );
+        goto error;
+    }
+#endif
+
+    msg_Dbg( p_access, "disk cache %s holds %"PRIu64" B in %d ranges", psz_data, p_cache->i_total, p_cache->i_extents );
+    free( psz_data );
+
+    vlc_mutex_init( &p_cache->lock );
+
+    return p_cache;
+
+error:
+    if ( p_cache->fd != -1 )
+        close( p_cache->fd );
+    free( psz_data );
+    free( p_cache->pi_extents );
+    free( p_cache->psz_map );
+    free( p_cache );
+    return NULL;
+}
+
+typedef struct
+{
+    char       *psz_name;       /* without the extension */
+    time_t      i_used;
+    uint64_t    i_size;
+} myth_cache_entry_t;
+
+static int DiskCacheEntryCmp( const void *a, const void *b )
+{
+    const myth_cache_entry_t *p_a = a, *p_b = b;
+    return ( p_a->i_used > p_b->i_used ) - ( p_a->i_used < p_b->i_used );
+}
+
+/* drop the least recently played recordings until all fit in the cap,
+ * those being played stay */
+static void DiskCacheTrim( vlc_object_t *p_obj )
+{
+    uint64_t i_max = (uint64_t) var_InheritInteger( p_obj, "myth-disk-cache-size" ) * 1024 * 1024;
+    myth_cache_entry_t *p_entries = NULL;
+    int i_entries = 0;
+    uint64_t i_total = 0;
+    char *psz_name;
+
+    char *psz_dir = CacheDir( false );
+    if ( !psz_dir )
+        return;
+
+    DIR *p_dir = vlc_opendir( psz_dir );
+    if ( !p_dir )
+    {
+        free( psz_dir );
+        return;
+    }
+
+    while ( ( psz_name = vlc_readdir( p_dir ) ) != NULL )
+    {
+        size_t i_len = strlen( psz_name );
+        myth_map_header_t header;
+        struct stat st;
+        char *psz_path;
+
+        if ( i_len <= 4 || strcmp( psz_name + i_len - 4, ".map" )
+          || asprintf( &psz_path, "%s"DIR_SEP"%s", psz_dir, psz_name ) == -1 )
+        {
+            free( psz_name );
+            continue;
+        }
+
+        FILE *p_file = vlc_fopen( psz_path, "rb" );
+        bool b_ok = p_file && fread( &header, sizeof( header ), 1, p_file ) == 1
+                 && !vlc_stat( psz_path, &st );
+        if ( p_file )
+            fclose( p_file );
+        free( psz_path );
+
+        myth_cache_entry_t *p_new = b_ok ? realloc( p_entries, ( i_entries + 1 ) * sizeof( *p_entries ) ) : NULL;
+        if ( !p_new )
+        {
+            free( psz_name );
+            continue;
+        }
+        p_entries = p_new;
+
+        psz_name[i_len - 4] = '\0';
+        p_entries[i_entries].psz_name = psz_name;
+        p_entries[i_entries].i_used = st.st_mtime;
+        p_entries[i_entries].i_size = header.i_total;
+        i_total += header.i_total;
+        i_entries++;
+    }
+    closedir( p_dir );
+
+    qsort( p_entries, i_entries, sizeof( *p_entries ), DiskCacheEntryCmp );
+
+    for ( int i = 0; i < i_entries; i++ )
+    {
+        char *psz_data, *psz_map;
+
+        if ( i_total > i_max
+          && asprintf( &psz_data, "%s"DIR_SEP"%s.data", psz_dir, p_entries[i].psz_name ) != -1 )
+        {
+            int fd = vlc_open( psz_data, O_RDWR );
+            if ( fd != -1 && !DiskCacheLock( fd, true ) )
+            {
+                msg_Dbg( p_obj, "keeping %s in the disk cache, it is in use", p_entries[i].psz_name );
+                close( fd );
+                free( psz_data );
+                free( p_entries[i].psz_name );
+                continue;
+            }
+
+            msg_Dbg( p_obj, "removing %s from the disk cache", p_entries[i].psz_name );
+#ifdef WIN32
+            /* open files cannot be removed there */
+            if ( fd != -1 )
+                close( fd );
+            fd = -1;
+#endif
+            if ( asprintf( &psz_map, "%s"DIR_SEP"%s.map", psz_dir, p_entries[i].psz_name ) != -1 )
+            {
+                vlc_unlink( psz_map );
+                free( psz_map );
+            }
+            vlc_unlink( psz_data );
+            free( psz_data );
+            if ( fd != -1 )
+                close( fd );
+            i_total -= p_entries[i].i_size;
+        }
+        free( p_entries[i].psz_name );
+    }
+
+    free( p_entries );
+    free( psz_dir );
+}
+
+static void DiskCacheClose( vlc_object_t *p_obj, myth_disk_cache_t *p_cache )
+{
+    if ( !p_cache )
+        return;
+
+    DiskCacheSaveMap( p_obj, p_cache );
+    close( p_cache->fd );
+    vlc_mutex_destroy( &p_cache->lock );
+    free( p_cache->pi_extents );
+    free( p_cache->psz_map );
+    free( p_cache );
+
+    DiskCacheTrim( p_obj );
+}
+
+static void DiskCacheWrite( myth_disk_cache_t *p_cache, uint64_t i_pos, const uint8_t *p_data, size_t i_len )
+{
+    if ( !p_cache )
+        return;
+
+    vlc_mutex_lock( &p_cache->lock );
+    if ( lseek( p_cache->fd, i_pos, SEEK_SET ) == (off_t) i_pos
+      && write( p_cache->fd, p_data, i_len ) == (ssize_t) i_len )
+        DiskCacheAddExtent( p_cache, i_pos, i_pos + i_len );
+    vlc_mutex_unlock( &p_cache->lock );
+}
+
+static ssize_t DiskCacheRead( myth_disk_cache_t *p_cache, uint64_t i_pos, uint8_t *p_data, size_t i_len )
+{
+    ssize_t i_read = -1;
+
+    vlc_mutex_lock( &p_cache->lock );
+    if ( lseek( p_cache->fd, i_pos, SEEK_SET ) == (off_t) i_pos )
+        i_read = read( p_cache->fd, p_data, i_len );
+    vlc_mutex_unlock( &p_cache->lock );
+
+    return i_read;
+}
+
+/* end of the cached range holding i_pos, i_pos itself when there is none */
+static uint64_t DiskCacheExtent( myth_disk_cache_t *p_cache, uint64_t i_pos )
+{
+    uint64_t i_end = i_pos;
+
+    if ( !p_cache )
+        return i_pos;
+
+    vlc_mutex_lock( &p_cache->lock );
+    for ( int i = 0; i < p_cache->i_extents; i++ )
+    {
+        if ( p_cache->pi_extents[2 * i] <= i_pos && i_pos < p_cache->pi_extents[2 * i + 1] )
+        {
+            i_end = p_cache->pi_extents[2 * i + 1];
+            break;
+        }
+    }
+    vlc_mutex_unlock( &p_cache->lock );
+
+    return i_end;
+}
+
+/* bytes from i_pos to the next cached range, 0 within one */
+static uint64_t DiskCacheGap( myth_disk_cache_t *p_cache, uint64_t i_pos )
+{
+    uint64_t i_gap = UINT64_MAX;
+
+    if ( !p_cache )
+        return i_gap;
+
+    vlc_mutex_lock( &p_cache->lock );
+    for ( int i = 0; i < p_cache->i_extents; i++ )
+    {
+        if ( p_cache->pi_extents[2 * i + 1] > i_pos )
+        {
+            i_gap = p_cache->pi_extents[2 * i] > i_pos ? p_cache->pi_extents[2 * i] - i_pos : 0;
+            break;
+        }
+    }
+    vlc_mutex_unlock( &p_cache->lock );
+
+    return i_gap;
+}
+
+/* start a QUERY_FILETRANSFER command for the transfer of p_myth on p_conn */
+static myth_socket_t *FileTransferBegin( myth_conn_t *p_conn, myth_sys_t *p_myth, const char *psz_verb )
+{
+    myth_socket_t *p_sock = myth_ConnBegin( p_conn );
+
+    myth_CmdString( p_sock, "QUERY_FILETRANSFER " );
+    myth_CmdString( p_sock, p_myth->file_transfer_id );
+    myth_CmdSep( p_sock );
+    myth_CmdString( p_sock, psz_verb );
+
+    return p_sock;
+}
+
+/* ask for up to i_len more bytes on the data socket, returns how many the
+ * backend will send, 0 at the end of the file */
+static int FileTransferRequest( vlc_object_t *p_access, myth_conn_t *p_conn, myth_sys_t *p_myth, myth_reply_t *p_reply, int i_len )
+{
+    myth_socket_t *p_sock = FileTransferBegin( p_conn, p_myth, "REQUEST_BLOCK" );
+    myth_CmdSep( p_sock );
+    myth_CmdInt( p_sock, i_len );
+    if( myth_ConnExchange( p_access, p_conn, p_reply ) )
+        return -1;
+
+    return __MAX( atoi( myth_token( p_reply, 0 ) ), 0 );
+}
+
+static int SeekFileTransfer( vlc_object_t *p_access, myth_conn_t *p_conn, myth_sys_t *p_myth, myth_reply_t *p_reply, int64_t i_pos )
+{
+    myth_socket_t *p_sock = FileTransferBegin( p_conn, p_myth, "SEEK" );
+    int64_t i_newpos;
+
+    /* SEEK position whence currentpos, 0.24 splits 64 bit values in two */
+    myth_CmdSep( p_sock );
+    if ( p_myth->version == &myth_version_24 )
+    {
+        myth_CmdInt( p_sock, (int32_t)(i_pos >> 32) );
+        myth_CmdSep( p_sock );
+        myth_CmdInt( p_sock, (int32_t)(i_pos) );
+        myth_CmdString( p_sock, "[]:[]0[]:[]0[]:[]0" );
+    }
+    else
+    {
+        myth_CmdInt( p_sock, i_pos );
+        myth_CmdString( p_sock, "[]:[]0[]:[]0" );
+    }
+
+    if ( myth_ConnExchange( p_access, p_conn, p_reply ) )
+    {
+        return VLC_EGENERIC;
+    }
+
+    if ( p_myth->version == &myth_version_24 )
+        i_newpos = MAKEINT64( atoi( myth_token( p_reply, 1 ) ), atoi( myth_token( p_reply, 0 ) ) );
+    else
+        i_newpos = atoll( myth_token( p_reply, 0 ) );
+
+    if ( i_newpos < 0 )
+    {
+        msg_Err( p_access, "FileTransfer refused to seek to %"PRId64, i_pos );
+        return VLC_EGENERIC;
+    }
+
+    return VLC_SUCCESS;
+}
+
+/* discard the blocks already granted by REQUEST_BLOCK but not read yet */
+static int DrainDataConnection( vlc_object_t *p_access, int fd_data, int *pi_data_to_be_read,
+                                uint8_t *p_scratch, size_t i_scratch )
+{
+    while ( *pi_data_to_be_read > 0 )
+    {
+        int i_read = myth_DataRead( p_access, fd_data, p_scratch,
+                                    __MIN( (size_t) *pi_data_to_be_read, i_scratch ) );
+        if ( i_read <= 0 )
+            return VLC_EGENERIC;
+
+        *pi_data_to_be_read -= i_read;
+    }
+
+    return VLC_SUCCESS;
+}
+
+/* a cheap round-trip on an idle transfer, fails if it is gone */
+static int FileTransferKeepAlive( vlc_object_t *p_access, myth_conn_t *p_conn, myth_sys_t *p_myth, myth_reply_t *p_reply )
+{
+    FileTransferBegin( p_conn, p_myth, "IS_OPEN" );
+    if ( myth_ConnExchange( p_access, p_conn, p_reply ) )
+        return VLC_EGENERIC;
+
+    if ( atoi( myth_token( p_reply, 0 ) ) != 1 )
+    {
+        msg_Warn( p_access, "FileTransfer %s was closed by the backend", p_myth->file_transfer_id );
+        return VLC_EGENERIC;
+    }
+
+    return VLC_SUCCESS;
+}
+
+/* time an IS_OPEN on the command connection. REQUEST_BLOCK is no use for
+ * this, its reply only comes once the whole block has been sent */
+static int PrefetchMeasureRtt( access_t *p_access, access_sys_t *p_sys )
+{
+    if ( mdate() < p_sys->i_rtt_next )
+        return VLC_SUCCESS;
+
+    mtime_t i_sent = mdate();
+    if ( FileTransferKeepAlive( VLC_OBJECT( p_access ), p_sys->p_cmd, &p_sys->myth, &p_sys->reply ) )
+        return VLC_EGENERIC;
+
+    mtime_t i_rtt = mdate() - i_sent;
+    StatsAddLatency( &p_sys->stats, &p_sys->stats.counters.rtt, i_rtt );
+    if ( p_sys->i_rtt <= 0 )
+        p_sys->i_rtt = i_rtt;
+    else
+        p_sys->i_rtt = ( 7 * p_sys->i_rtt + i_rtt ) / 8;
+
+    p_sys->i_rtt_next = mdate() + MYTH_RTT_INTERVAL;
+    PrefetchAdaptRequest( p_access, p_sys );
+
+    return VLC_SUCCESS;
+}
+
+/* blocks are not requested into what p_cache holds, the transfer is moved
+ * past it once the prefetch thread took it from there */
+static int PrefetchRequestBlock( access_t *p_access, access_sys_t *p_sys, myth_disk_cache_t *p_cache )
+{
+    /* pipeline reading, request new data before what is in flight runs out */
+    if ( p_sys->b_eofing || p_sys->i_data_to_be_read > p_sys->i_request_threshold )
+        return VLC_SUCCESS;
+
+    if ( p_sys->i_data_to_be_read == 0 && p_sys->i_transfer_pos != p_sys->i_fetch_pos )
+    {
+        if ( SeekFileTransfer( VLC_OBJECT( p_access ), p_sys->p_cmd, &p_sys->myth, &p_sys->reply, p_sys->i_fetch_pos ) )
+            return VLC_EGENERIC;
+        p_sys->i_transfer_pos = p_sys->i_fetch_pos;
+    }
+
+    uint64_t i_gap = DiskCacheGap( p_cache, p_sys->i_transfer_pos );
+    if ( i_gap == 0 )
+        return VLC_SUCCESS;
+
+    /* the backend blocks on a full socket before it replies, see myth_DataWindow() */
+    int i_len = __MIN( p_sys->i_request_len, p_sys->myth.i_data_window - p_sys->i_data_to_be_read );
+    if ( i_len < MYTH_REQUEST_MIN && p_sys->i_data_to_be_read > 0 )
+        return VLC_SUCCESS;
+    i_len = __MAX( i_len, MYTH_REQUEST_MIN );
+    i_len = __MIN( (uint64_t) i_len, i_gap );
+
+    //msg_Dbg( p_access, "REQUEST_BLOCK %d", i_len );
+    mtime_t i_sent = mdate();
+    int i_will_receive = FileTransferRequest( VLC_OBJECT( p_access ), p_sys->p_cmd, &p_sys->myth, &p_sys->reply, i_len );
+    if ( i_will_receive < 0 )
+        return VLC_EGENERIC;
+
+    StatsAddRequest( &p_sys->stats, i_len, i_will_receive, mdate() - i_sent );
+
+    //msg_Dbg( p_access, "i_will_receive %d", i_will_receive );
+    if ( i_will_receive == 0 )
+    {
+        msg_Dbg( p_access, "SET EOFing" );
+        p_sys->b_eofing = true;
+    }
+    else
+    {
+        p_sys->i_data_to_be_read += i_will_receive;
+        p_sys->i_transfer_pos += i_will_receive;
+    }
+
+    return VLC_SUCCESS;
+}
+
+static void *PrefetchThread( void *data )
+{
+    access_t *p_access = data;
+    access_sys_t *p_sys = p_access->p_sys;
+    myth_disk_cache_t *p_cache = p_sys->p_cache;   /* dropped if it fails */
+
+    for( ;; )
+    {
+        size_t i_write, i_room;
+        int i_read;
+
+        /* wait for room in the ring buffer. No REQUEST_BLOCK goes out while
+         * it is full, so a paused reader holds the backend back, and the
+         * transfer is kept alive meanwhile */
+        bool b_stale = false;
+        mtime_t i_keepalive = mdate() + MYTH_KEEPALIVE_INTERVAL;
+
+        vlc_mutex_lock( &p_sys->lock );
+        mutex_cleanup_push( &p_sys->lock );
+        while( p_sys->i_ring_fill == MYTH_RING_SIZE && !b_stale )
+        {
+            if ( !vlc_cond_timedwait( &p_sys->wait, &p_sys->lock, i_keepalive ) )
+                continue;
+
+            vlc_mutex_unlock( &p_sys->lock );
+            int canc = vlc_savecancel();
+            b_stale = FileTransferKeepAlive( VLC_OBJECT( p_access ), p_sys->p_cmd, &p_sys->myth, &p_sys->reply ) != 0;
+            vlc_restorecancel( canc );
+            vlc_mutex_lock( &p_sys->lock );
+
+            i_keepalive = mdate() + MYTH_KEEPALIVE_INTERVAL;
+        }
+        p_sys->b_ring_stale = b_stale;
+
+        i_write = ( p_sys->i_ring_start + p_sys->i_ring_fill ) % MYTH_RING_SIZE;
+        i_room = __MIN( MYTH_RING_SIZE - p_sys->i_ring_fill, MYTH_RING_SIZE - i_write );
+        vlc_cleanup_pop();
+        vlc_mutex_unlock( &p_sys->lock );
+
+        if ( b_stale )
+            break;
+
+        /* what the disk cache holds is taken from there once everything
+         * granted before it has been read */
+        if ( p_cache && p_sys->i_data_to_be_read == 0 )
+        {
+            uint64_t i_end = DiskCacheExtent( p_cache, p_sys->i_fetch_pos );
+            if ( i_end > p_sys->i_fetch_pos )
+            {
+                int canc = vlc_savecancel();
+                i_read = DiskCacheRead( p_cache, p_sys->i_fetch_pos, p_sys->p_ring + i_write,
+                                        __MIN( i_room, i_end - p_sys->i_fetch_pos ) );
+                vlc_restorecancel( canc );
+
+                if ( i_read > 0 )
+                {
+                    vlc_mutex_lock( &p_sys->stats.lock );
+                    p_sys->stats.counters.i_cache_bytes += i_read;
+                    vlc_mutex_unlock( &p_sys->stats.lock );
+
+                    p_sys->i_fetch_pos += i_read;
+
+                    vlc_mutex_lock( &p_sys->lock );
+                    p_sys->i_ring_fill += i_read;
+                    vlc_cond_broadcast( &p_sys->wait );
+                    vlc_mutex_unlock( &p_sys->lock );
+                    continue;
+                }
+
+                msg_Warn( p_access, "disk cache read failed, fetching from the backend" );
+                p_cache = NULL;
+            }
+        }
+
+        /* time not spent waiting for the reader counts towards throughput */
+        mtime_t i_start = mdate();
+
+        /* a command round-trip must not be cut in half, or p_cmd gets out of sync */
+        int canc = vlc_savecancel();
+        int i_ret = PrefetchMeasureRtt( p_access, p_sys );
+        if ( !i_ret )
+            i_ret = PrefetchRequestBlock( p_access, p_sys, p_cache );
+        vlc_restorecancel( canc );
+
+        if ( i_ret )
+        {
+            vlc_mutex_lock( &p_sys->lock );
+            p_sys->b_ring_error = true;
+            vlc_cond_broadcast( &p_sys->wait );
+            vlc_mutex_unlock( &p_sys->lock );
+            break;
+        }
+
+        /* check if last block now read */
+        if ( p_sys->b_eofing && p_sys->i_data_to_be_read == 0 )
+        {
+            msg_Dbg( p_access, "SET EOF from eofing" );
+            vlc_mutex_lock( &p_sys->lock );
+            p_sys->b_ring_eof = true;
+            vlc_cond_broadcast( &p_sys->wait );
+            vlc_mutex_unlock( &p_sys->lock );
+            break;
+        }
+
+        i_room = __MIN( i_room, (size_t) p_sys->i_data_to_be_read );
+        i_read = myth_DataRead( VLC_OBJECT( p_access ), p_sys->fd_data, p_sys->p_ring + i_write, i_room );
+
+        if ( i_read > 0 )
+        {
+            PrefetchMeasureRead( p_access, p_sys, i_read, mdate() - i_start );
+            StatsAddBytes( &p_sys->stats, i_read );
+
+            /* not in the ring yet, Read() cannot touch it */
+            canc = vlc_savecancel();
+            DiskCacheWrite( p_sys->p_cache, p_sys->i_fetch_pos, p_sys->p_ring + i_write, i_read );
+            vlc_restorecancel( canc );
+            p_sys->i_fetch_pos += i_read;
+        }
+
+        //msg_Dbg( p_access, "i_read %d", i_read );
+
+        vlc_mutex_lock( &p_sys->lock );
+        if( i_read <= 0 )
+        {
+            msg_Dbg( p_access, "SET EOF because i_read nothing" );
+            p_sys->b_ring_eof = true;
+        }
+        else
+        {
+            p_sys->i_ring_fill += i_read;
+            p_sys->i_data_to_be_read -= i_read;
+            //msg_Dbg( p_access, "i_data_to_be_read %d", p_sys->i_data_to_be_read );
+        }
+        vlc_cond_broadcast( &p_sys->wait );
+        vlc_mutex_unlock( &p_sys->lock );
+
+        if( i_read <= 0 )
+            break;
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************
+ * Striping: a single TCP stream cannot fill a link with a long round-trip,
+ * so several FileTransfer sessions each fetch every i_stripes-th chunk ahead
+ * of the reader and append them to the ring in file order
+ *****************************************************************************/
+static void StripeClose( myth_stripe_t *p_stripe )
+{
+    if ( p_stripe->fd_data > 0 )
+        net_Close( p_stripe->fd_data );
+    if ( p_stripe->p_conn )
+        myth_ConnDelete( p_stripe->p_conn );
+    myth_ReplyClean( &p_stripe->reply );
+    free( p_stripe->p_chunk );
+
+    p_stripe->fd_data = 0;
+    p_stripe->p_conn = NULL;
+    p_stripe->p_chunk = NULL;
+    p_stripe->i_data_to_be_read = 0;
+}
+
+static int StripeOpen( access_t *p_access, access_sys_t *p_sys, myth_stripe_t *p_stripe )
+{
+    p_stripe->p_access = p_access;
+    p_stripe->reply = (myth_reply_t) MYTH_REPLY_INIT;
+    p_stripe->p_chunk = malloc( MYTH_STRIPE_CHUNK );
+    if ( !p_stripe->p_chunk )
+        return VLC_ENOMEM;
+
+    p_stripe->p_conn = myth_ConnNew( VLC_OBJECT( p_access ), &p_sys->url );
+    if ( !p_stripe->p_conn )
+        return VLC_EGENERIC;
+
+    p_stripe->fd_data = myth_Connect( VLC_OBJECT( p_access ), &p_stripe->myth, &p_sys->url, true, false, NULL );
+    if ( !p_stripe->fd_data )
+        return VLC_EGENERIC;
+
+    return VLC_SUCCESS;
+}
+
+static void StripesClose( access_sys_t *p_sys )
+{
+    for ( int i = 0; i < p_sys->i_stripes; i++ )
+        StripeClose( &p_sys->p_stripes[i] );
+    free( p_sys->p_stripes );
+
+    p_sys->p_stripes = NULL;
+    p_sys->i_stripes = 0;
+}
+
+/* open the sessions asked for, playback stays on fd_data when it fails */
+static void StripesOpen( access_t *p_access, access_sys_t *p_sys )
+{
+    int i_stripes = var_InheritInteger( p_access, "myth-stripes" );
+
+    if ( i_stripes <= 1 )
+        return;
+
+    i_stripes = __MIN( i_stripes, MYTH_STRIPE_MAX );
+    p_sys->p_stripes = calloc( i_stripes, sizeof( *p_sys->p_stripes ) );
+    if ( !p_sys->p_stripes )
+        return;
+
+    for ( p_sys->i_stripes = 0; p_sys->i_stripes < i_stripes; p_sys->i_stripes++ )
+    {
+        myth_stripe_t *p_stripe = &p_sys->p_stripes[p_sys->i_stripes];
+
+        if ( StripeOpen( p_access, p_sys, p_stripe ) )
+        {
+            msg_Warn( p_access, "Unable to open %d connections, using a single one", i_stripes );
+            StripeClose( p_stripe );
+            StripesClose( p_sys );
+            return;
+        }
+    }
+
+    /* the stripes fetch everything, the first transfer would only sit idle */
+    net_Close( p_sys->fd_data );
+    p_sys->fd_data = -1;
+
+    msg_Dbg( p_access, "fetching over %d connections", p_sys->i_stripes );
+}
+
+/* fetch the chunk at i_pos into p_chunk, returns its length, short at the
+ * end of the file, or -1 on error */
+static int StripeFetch( access_t *p_access, myth_stripe_t *p_stripe, uint64_t i_pos )
+{
+    myth_stats_t *p_stats = &p_access->p_sys->stats;
+    int i_len = 0;
+    int i_ret;
+
+    /* what was granted before a seek interrupted us */
+    if ( DrainDataConnection( VLC_OBJECT( p_access ), p_stripe->fd_data, &p_stripe->i_data_to_be_read,
+                              p_stripe->p_chunk, MYTH_STRIPE_CHUNK ) )
+        return -1;
+
+    /* a command round-trip must not be cut in half, or p_conn gets out of sync */
+    int canc = vlc_savecancel();
+    i_ret = SeekFileTransfer( VLC_OBJECT( p_access ), p_stripe->p_conn, &p_stripe->myth, &p_stripe->reply, i_pos );
+    vlc_restorecancel( canc );
+    if ( i_ret )
+        return -1;
+
+    while ( i_len < MYTH_STRIPE_CHUNK )
+    {
+        /* the backend writes a block before it replies, each must fit in
+         * the socket buffers, see myth_DataWindow() */
+        if ( p_stripe->i_data_to_be_read == 0 )
+        {
+            int i_want = __MIN( MYTH_STRIPE_CHUNK - i_len, p_stripe->myth.i_data_window );
+            mtime_t i_sent = mdate();
+            canc = vlc_savecancel();
+            i_ret = FileTransferRequest( VLC_OBJECT( p_access ), p_stripe->p_conn, &p_stripe->myth,
+                                         &p_stripe->reply, i_want );
+            vlc_restorecancel( canc );
+            StatsAddRequest( p_stats, i_want, i_ret, mdate() - i_sent );
+            if ( i_ret < 0 )
+                return -1;
+            if ( i_ret == 0 )
+                break;
+
+            p_stripe->i_data_to_be_read = i_ret;
+        }
+
+        /* anything granted past the chunk is drained before the next one */
+        int i_read = myth_DataRead( VLC_OBJECT( p_access ), p_stripe->fd_data, p_stripe->p_chunk + i_len,
+                                    __MIN( p_stripe->i_data_to_be_read, MYTH_STRIPE_CHUNK - i_len ) );
+        if ( i_read <= 0 )
+            return -1;
+
+        StatsAddBytes( p_stats, i_read );
+        i_len += i_read;
+        p_stripe->i_data_to_be_read -= i_read;
+    }
+
+    return i_len;
+}
+
+/* wait on p_sys->wait with lock held, the transfer of the stripe is checked
+ * every MYTH_KEEPALIVE_INTERVAL meanwhile. Losing it makes the ring stale */
+static void StripeWait( access_t *p_access, myth_stripe_t *p_stripe, mtime_t *pi_keepalive )
+{
+    access_sys_t *p_sys = p_access->p_sys;
+
+    if ( !vlc_cond_timedwait( &p_sys->wait, &p_sys->lock, *pi_keepalive ) )
+        return;
+
+    vlc_mutex_unlock( &p_sys->lock );
+    int canc = vlc_savecancel();
+    int i_ret = FileTransferKeepAlive( VLC_OBJECT( p_access ), p_stripe->p_conn, &p_stripe->myth, &p_stripe->reply );
+    vlc_restorecancel( canc );
+    vlc_mutex_lock( &p_sys->lock );
+
+    if ( i_ret )
+    {
+        p_stripe->b_lost = true;
+        p_sys->b_ring_stale = true;
+        vlc_cond_broadcast( &p_sys->wait );
+    }
+    *pi_keepalive = mdate() + MYTH_KEEPALIVE_INTERVAL;
+}
+
+static void *StripeThread( void *data )
+{
+    myth_stripe_t *p_stripe = data;
+    access_t *p_access = p_stripe->p_access;
+    access_sys_t *p_sys = p_access->p_sys;
+    bool b_done;
+
+    do
+    {
+        uint64_t i_pos = p_sys->i_stripe_base + (uint64_t) p_stripe->i_chunk * MYTH_STRIPE_CHUNK;
+        int i_len = -1;
+
+        /* a chunk the disk cache holds whole is read from there */
+        if ( DiskCacheExtent( p_sys->p_cache, i_pos ) >= i_pos + MYTH_STRIPE_CHUNK )
+        {
+            int canc = vlc_savecancel();
+            if ( DiskCacheRead( p_sys->p_cache, i_pos, p_stripe->p_chunk, MYTH_STRIPE_CHUNK ) == MYTH_STRIPE_CHUNK )
+                i_len = MYTH_STRIPE_CHUNK;
+            vlc_restorecancel( canc );
+        }
+
+        if ( i_len > 0 )
+        {
+            vlc_mutex_lock( &p_sys->stats.lock );
+            p_sys->stats.counters.i_cache_bytes += i_len;
+            vlc_mutex_unlock( &p_sys->stats.lock );
+        }
+        else
+        {
+            i_len = StripeFetch( p_access, p_stripe, i_pos );
+            if ( i_len > 0 )
+            {
+                int canc = vlc_savecancel();
+                DiskCacheWrite( p_sys->p_cache, i_pos, p_stripe->p_chunk, i_len );
+                vlc_restorecancel( canc );
+            }
+        }
+
+        /* wait for our turn, then hand the chunk over as the ring frees up */
+        mtime_t i_keepalive = mdate() + MYTH_KEEPALIVE_INTERVAL;
+
+        vlc_mutex_lock( &p_sys->lock );
+        mutex_cleanup_push( &p_sys->lock );
+        while ( p_sys->i_stripe_next != p_stripe->i_chunk
+             && !p_sys->b_ring_eof && !p_sys->b_ring_error && !p_sys->b_ring_stale )
+            StripeWait( p_access, p_stripe, &i_keepalive );
+
+        /* once a stripe is lost the ring ends before its chunk */
+        bool b_turn = p_sys->i_stripe_next == p_stripe->i_chunk && !p_sys->b_ring_stale;
+
+        if ( b_turn && i_len < 0 )
+        {
+            /* carried on from here on new transfers, see _Seek() */
+            p_stripe->b_lost = true;
+            p_sys->b_ring_stale = true;
+        }
+        else if ( b_turn )
+        {
+            for ( int i_done = 0; i_done < i_len && !p_sys->b_ring_stale; )
+            {
+                while ( p_sys->i_ring_fill == MYTH_RING_SIZE && !p_sys->b_ring_stale )
+                    StripeWait( p_access, p_stripe, &i_keepalive );
+                if ( p_sys->b_ring_stale )
+                    break;
+
+                size_t i_write = ( p_sys->i_ring_start + p_sys->i_ring_fill ) % MYTH_RING_SIZE;
+                size_t i_copy = __MIN( MYTH_RING_SIZE - p_sys->i_ring_fill, MYTH_RING_SIZE - i_write );
+                i_copy = __MIN( i_copy, (size_t) ( i_len - i_done ) );
+
+                memcpy( p_sys->p_ring + i_write, p_stripe->p_chunk + i_done, i_copy );
+                p_sys->i_ring_fill += i_copy;
+                i_done += i_copy;
+                vlc_cond_broadcast( &p_sys->wait );
+            }
+
+            if ( !p_sys->b_ring_stale && i_len < MYTH_STRIPE_CHUNK )
+            {
+                msg_Dbg( p_access, "SET EOF from stripe" );
+                p_sys->b_ring_eof = true;
+            }
+            p_sys->i_stripe_next++;
+        }
+
+        b_done = p_sys->b_ring_eof || p_sys->b_ring_error || p_sys->b_ring_stale;
+        vlc_cond_broadcast( &p_sys->wait );
+        vlc_cleanup_pop();
+        vlc_mutex_unlock( &p_sys->lock );
+
+        p_stripe->i_chunk += p_sys->i_stripes;
+    }
+    while ( !b_done );
+
+    return NULL;
+}
+
+static int PrefetchStart( access_t *p_access, access_sys_t *p_sys )
+{
+    assert( !p_sys->b_prefetching );
+
+    p_sys->i_ring_start = 0;
+    p_sys->i_ring_fill = 0;
+    p_sys->b_ring_eof = false;
+    p_sys->b_ring_error = false;
+    p_sys->b_ring_stale = false;
+
+    if ( p_sys->i_stripes > 0 )
+    {
+        p_sys->i_stripe_base = p_sys->i_fetch_pos;
+        p_sys->i_stripe_next = 0;
+
+        for ( int i = 0; i < p_sys->i_stripes; i++ )
+        {
+            p_sys->p_stripes[i].i_chunk = i;
+            if( vlc_clone( &p_sys->p_stripes[i].thread, StripeThread, &p_sys->p_stripes[i], VLC_THREAD_PRIORITY_INPUT ) )
+            {
+                msg_Err( p_access, "Unable to start prefetch thread" );
+                while ( i-- > 0 )
+                {
+                    vlc_cancel( p_sys->p_stripes[i].thread );
+                    vlc_join( p_sys->p_stripes[i].thread, NULL );
+                }
+                return VLC_EGENERIC;
+            }
+        }
+    }
+    else if( vlc_clone( &p_sys->thread, PrefetchThread, p_access, VLC_THREAD_PRIORITY_INPUT ) )
+    {
+        msg_Err( p_access, "Unable to start prefetch thread" );
+        return VLC_EGENERIC;
+    }
+
+    p_sys->b_prefetching = true;
+
+    return VLC_SUCCESS;
+}
+
+static void PrefetchStop( access_sys_t *p_sys )
+{
+    if ( !p_sys->b_prefetching )
+        return;
+
+    if ( p_sys->i_stripes > 0 )
+    {
+        for ( int i = 0; i < p_sys->i_stripes; i++ )
+            vlc_cancel( p_sys->p_stripes[i].thread );
+        for ( int i = 0; i < p_sys->i_stripes; i++ )
+            vlc_join( p_sys->p_stripes[i].thread, NULL );
+    }
+    else
+    {
+        vlc_cancel( p_sys->thread );
+        vlc_join( p_sys->thread, NULL );
+    }
+
+    p_sys->b_prefetching = false;
+}
+
+/*****************************************************************************
+ * Size tracking: a recording in progress keeps growing, its size is polled
+ * on a low priority thread so the prefetch loop only ever moves data
+ *****************************************************************************/
+static int SizeTrackerQuery( access_t *p_access, access_sys_t *p_sys, myth_conn_t *p_conn, int64_t *pi_size )
+{
+    myth_reply_t reply = MYTH_REPLY_INIT;
+
+    *pi_size = -1;
+
+    mtime_t i_sent = mdate();
+    if ( myth_ConnSend( VLC_OBJECT( p_access ), p_conn, &reply, "QUERY_RECORDING BASENAME %s", p_sys->psz_basename ) )
+    {
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
+    }
+
+    vlc_mutex_lock( &p_sys->stats.lock );
+    HistogramAdd( &p_sys->stats.counters.size_poll, mdate() - i_sent );
+    p_sys->stats.counters.i_size_poll_bytes += reply.i_len;
+    vlc_mutex_unlock( &p_sys->stats.lock );
+
+    if ( strncmp( myth_token( &reply, 0 ), "ERROR", 6 ) )
+    {
+        myth_recording_t row;
+
+        myth_DecodeRecording( p_sys->myth.version, &reply, 1, MYTH_FIELD( FILESIZE ) | MYTH_FIELD( END ), &row );
+
+        *pi_size = row.i_fileSize;
+        vlc_mutex_lock( &p_sys->lock );
+        p_sys->i_rec_end = row.endTime;
+        vlc_mutex_unlock( &p_sys->lock );
+    }
+
+    myth_ReplyClean( &reply );
+
+    return VLC_SUCCESS;
+}
+
+/* polls while the recording grows: until its end, and after it until the
+ * size has not changed for the longest interval. A connection is only
+ * taken from the pool for each query */
+static void *SizeTrackerThread( void *data )
+{
+    access_t *p_access = data;
+    access_sys_t *p_sys = p_access->p_sys;
+    mtime_t i_interval = MYTH_SIZE_INTERVAL;
+    mtime_t i_changed = mdate();
+    int64_t i_last = -1;
+
+    for( ;; )
+    {
+        int64_t i_size;
+        int i_ret = VLC_EGENERIC;
+
+        /* p_cmd belongs to the prefetch thread */
+        int canc = vlc_savecancel();
+        myth_conn_t *p_conn = myth_PoolAcquire( VLC_OBJECT( p_access ), &p_sys->url );
+        if ( p_conn )
+        {
+            i_ret = SizeTrackerQuery( p_access, p_sys, p_conn, &i_size );
+            myth_PoolRelease( p_conn );
+        }
+        vlc_restorecancel( canc );
+
+        if ( !i_ret && i_size > 0 )
+        {
+            vlc_mutex_lock( &p_sys->lock );
+            bool b_ended = time( NULL ) > p_sys->i_rec_end;
+            /* handed over to Read(), which owns p_access->info */
+            if ( i_size != i_last )
+                p_sys->i_size_update = i_size;
+            vlc_mutex_unlock( &p_sys->lock );
+
+            if ( i_size == i_last )
+            {
+                if ( b_ended && mdate() - i_changed >= MYTH_SIZE_INTERVAL_MAX )
+                {
+                    msg_Dbg( p_access, "recording finished at %"PRId64" B", i_size );
+                    break;
+                }
+                i_interval = __MIN( 2 * i_interval, MYTH_SIZE_INTERVAL_MAX );
+            }
+            else
+            {
+                i_interval = MYTH_SIZE_INTERVAL;
+                i_changed = mdate();
+            }
+            i_last = i_size;
+        }
+
+        msleep( i_interval );
+    }
+
+    return NULL;
+}
+
+static void SizeTrackerStart( access_t *p_access, access_sys_t *p_sys )
+{
+    /* without the recording's basename there is nothing to ask about */
+    if ( !p_sys->psz_basename )
+        return;
+
+    /* long finished, the size the transfer was opened with is final */
+    vlc_mutex_lock( &p_sys->lock );
+    bool b_final = time( NULL ) > p_sys->i_rec_end + MYTH_SIZE_GRACE;
+    vlc_mutex_unlock( &p_sys->lock );
+    if ( b_final )
+        return;
+
+    if( vlc_clone( &p_sys->size_thread, SizeTrackerThread, p_access, VLC_THREAD_PRIORITY_LOW ) )
+    {
+        msg_Warn( p_access, "Unable to start size tracking thread" );
+        return;
+    }
+
+    p_sys->b_size_tracking = true;
+}
+
+static void SizeTrackerStop( access_sys_t *p_sys )
+{
+    if ( !p_sys->b_size_tracking )
+        return;
+
+    vlc_cancel( p_sys->size_thread );
+    vlc_join( p_sys->size_thread, NULL );
+
+    p_sys->b_size_tracking = false;
+}
+
+/*****************************************************************************
+ * Seek index: the keyframe position map of the recording from recordedseek,
+ * with the video rate from recordedmarkup, fetched in one query
+ *****************************************************************************/
+#define MYTH_MARK_GOP_START   6
+#define MYTH_MARK_GOP_BYFRAME 9
+#define MYTH_MARK_VIDEO_RATE  32
+
+static void SeekIndexClean( myth_seek_index_t *p_index )
+{
+    if ( p_index->p_map )
+        CacheFileUnmap( p_index->p_map, p_index->i_map );
+    else
+    {
+        free( p_index->pi_frame );
+        free( p_index->pi_offset );
+    }
+    p_index->p_map = NULL;
+    p_index->i_map = 0;
+    p_index->pi_frame = NULL;
+    p_index->pi_offset = NULL;
+    p_index->i_count = 0;
+    p_index->i_fps_1000 = 0;
+}
+
+static int SeekIndexLoad( access_t *p_access, access_sys_t *p_sys, myth_conn_t *p_conn, myth_seek_index_t *p_index )
+{
+    myth_reply_t reply = MYTH_REPLY_INIT;
+
+    /* the video rate comes first as frame -1 */
+    if ( myth_ConnSend( VLC_OBJECT( p_access ), p_conn, &reply,
+            "SQL_QUERY[]:[]SELECT mark, offset FROM recordedseek WHERE chanid=%d AND UNIX_TIMESTAMP(starttime)=%"PRId64
+            " AND type IN (%d,%d)"
+            " UNION ALL SELECT -1, data FROM recordedmarkup WHERE chanid=%d AND UNIX_TIMESTAMP(starttime)=%"PRId64" AND type=%d"
+            " ORDER BY 1",
+            p_sys->i_chanid, (int64_t) p_sys->i_rec_start, MYTH_MARK_GOP_START, MYTH_MARK_GOP_BYFRAME,
+            p_sys->i_chanid, (int64_t) p_sys->i_rec_start, MYTH_MARK_VIDEO_RATE ) )
+    {
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
+    }
+
+    int i_rows = atoi( myth_token( &reply, 0 ) );
+    if ( i_rows <= 0 || myth_count_tokens( &reply ) < 1 + 2 * i_rows )
+    {
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
+    }
+
+    p_index->pi_frame = malloc( i_rows * sizeof( int64_t ) );
+    p_index->pi_offset = malloc( i_rows * sizeof( int64_t ) );
+    if ( !p_index->pi_frame || !p_index->pi_offset )
+    {
+        SeekIndexClean( p_index );
+        myth_ReplyClean( &reply );
+        return VLC_ENOMEM;
+    }
+
+    for ( int i = 0; i < i_rows; i++ )
+    {
+        int64_t i_frame = atoll( myth_token( &reply, 1 + 2 * i ) );
+        int64_t i_value = atoll( myth_token( &reply, 2 + 2 * i ) );
+
+        if ( i_frame < 0 )
+        {
+            p_index->i_fps_1000 = i_value;
+            continue;
+        }
+
+        p_index->pi_frame[p_index->i_count] = i_frame;
+        p_index->pi_offset[p_index->i_count] = i_value;
+        p_index->i_count++;
+    }
+
+    myth_ReplyClean( &reply );
+
+    msg_Dbg( p_access, "seek index of %d keyframes at %d.%03d fps", p_index->i_count,
+             p_index->i_fps_1000 / 1000, p_index->i_fps_1000 % 1000 );
+
+    return VLC_SUCCESS;
+}
+
+/* entry of the last keyframe at or before i_frame, -1 when there is none */
+static int SeekIndexFind( const myth_seek_index_t *p_index, int64_t i_frame )
+{
+    int i_lo = 0, i_hi = p_index->i_count - 1;
+
+    if ( i_hi < 0 || p_index->pi_frame[0] > i_frame )
+        return -1;
+
+    while ( i_lo < i_hi )
+    {
+        int i_mid = i_lo + ( i_hi - i_lo + 1 ) / 2;
+        if ( p_index->pi_frame[i_mid] <= i_frame )
+            i_lo = i_mid;
+        else
+            i_hi = i_mid - 1;
+    }
+
+    return i_lo;
+}
+
+/* offset into the recording of a frame, 0 when the rate is unknown */
+static int64_t SeekIndexTime( const myth_seek_index_t *p_index, int64_t i_frame )
+{
+    if ( p_index->i_fps_1000 <= 0 )
+        return 0;
+
+    return i_frame * 1000 * CLOCK_FREQ / p_index->i_fps_1000;
+}
+
+/* offset of the last keyframe at or before a time into the recording, -1
+ * when the index does not cover it */
+static int64_t SeekIndexOffset( const myth_seek_index_t *p_index, mtime_t i_time )
+{
+    if ( p_index->i_fps_1000 <= 0 )
+        return -1;
+
+    int i_key = SeekIndexFind( p_index, i_time * p_index->i_fps_1000 / ( 1000 * CLOCK_FREQ ) );
+    if ( i_key < 0 )
+        return -1;
+
+    return p_index->pi_offset[i_key];
+}
+
+/*****************************************************************************
+ * GetCutList: the commercial breaks as a title of chapters. Break frames
+ * are resolved through the seek index, or else all at once by one query
+ * against recordedseek.
+ *****************************************************************************/
+static input_title_t *CutTitleNew( void )
+{
+    input_title_t *t;
+    seekpoint_t *s;
+
+    /* Menu */
+    t = vlc_input_title_New();
+    if ( !t )
+        return NULL;
+    t->b_menu = true;
+    t->psz_name = strdup( "Cuts" );
+
+    s = vlc_seekpoint_New();
+    s->i_byte_offset = 0;
+    s->psz_name = strdup( "Start" );
+    TAB_APPEND( t->i_seekpoint, t->seekpoint, s );
+
+    return t;
+}
+
+static void CutTitleAdd( input_title_t *t, int64_t i_byte, int64_t i_time, bool b_commercial )
+{
+    /* Add the seek points */
+    seekpoint_t *s = vlc_seekpoint_New();
+    s->i_byte_offset = i_byte;
+    s->i_time_offset = i_time;
+    s->psz_name = strdup( b_commercial ? "Commercial" : "Show" );
+    TAB_APPEND( t->i_seekpoint, t->seekpoint, s );
+}
+
+/* *pp_title is left NULL when the recording has no breaks */
+static int GetCutList( access_t *p_access, access_sys_t *p_sys, myth_conn_t *p_conn, const myth_seek_index_t *p_index, input_title_t **pp_title )
+{
+    input_title_t *t;
+    myth_socket_t *p_sock;
+
+    myth_reply_t reply = MYTH_REPLY_INIT;
+    myth_reply_t results = MYTH_REPLY_INIT;
+
+    if ( myth_ConnSend( VLC_OBJECT( p_access ), p_conn, &reply, "QUERY_COMMBREAK %d %"PRId64, p_sys->i_chanid, (int64_t) p_sys->i_rec_start ) )
+        goto error;
+
+    *pp_title = NULL;
 
-    input_thread_t *p_input = access_GetParentInput( (access_t *) p_access );
-    if( !p_input )
+    int i_tokens = myth_count_tokens( &reply );
+    int i_rows = atoi( myth_token( &reply, 0) );
+    if ( i_rows <= 0 )
     {
-        msg_Dbg( p_access, "Unable to find parent input thread. Access may not be from video." );
-        //pl_Release( p_access );
+        myth_ReplyClean( &reply );
         return VLC_SUCCESS;
     }
 
-    if ( myth_Send( p_access, fd, &i_len, &psz_params, "QUERY_RECORDINGS Play" ) )
+    /* type first and frame last, split in two on older backends */
+    int i_fields = (i_tokens-1) / i_rows;
+    if ( i_fields < 2 )
+        goto error;
+
+    if ( p_index->i_count == 0 )
     {
-        vlc_object_release( p_input );
-        return VLC_EGENERIC;
+        /* one column per break */
+        p_sock = myth_ConnBegin( p_conn );
+        myth_CmdString( p_sock, "SQL_QUERY" );
+        myth_CmdSep( p_sock );
+        myth_CmdString( p_sock, "SELECT " );
+        for ( int i = 0; i < i_rows; i++ )
+        {
+            if ( i > 0 )
+                myth_CmdString( p_sock, ", " );
+            myth_CmdString( p_sock, "IFNULL((SELECT offset FROM recordedseek WHERE chanid=" );
+            myth_CmdInt( p_sock, p_sys->i_chanid );
+            myth_CmdString( p_sock, " AND UNIX_TIMESTAMP(starttime)=" );
+            myth_CmdInt( p_sock, p_sys->i_rec_start );
+            myth_CmdString( p_sock, " AND mark <= " );
+            myth_CmdInt( p_sock, atoll( myth_token( &reply, 1 + i * i_fields + i_fields - 1 ) ) );
+            myth_CmdString( p_sock, " ORDER BY mark DESC LIMIT 1), 0)" );
+        }
+        if ( myth_ConnExchange( VLC_OBJECT( p_access ), p_conn, &results ) )
+            goto error;
+
+        if ( atoi( myth_token( &results, 0 ) ) < 1 || myth_count_tokens( &results ) < 1 + i_rows )
+            goto error;
     }
 
-    /* Set meta data */
-    int i_tokens = myth_count_tokens( psz_params, i_len );
-    int i_rows = atoi( myth_token(psz_params, i_len, 0) );
-    int i_fields = (i_tokens-1) / i_rows;
+    t = CutTitleNew();
+    if ( !t )
+        goto error;
+
     for ( int i = 0; i < i_rows; i++ )
     {
-        int i_offset = 1 + i * i_fields;
-        char* psz_url;
+        int64_t i_byte = 0, i_time = 0;
 
-        if ( p_sys->myth.version == &myth_version_24 )
-        {
-            psz_url = myth_token( psz_params, i_len, i_offset + 8 );
-        }
-        else if ( p_sys->myth.version == &myth_version_25 || p_sys->myth.version == &myth_version_26 )
+        if ( p_index->i_count > 0 )
         {
-            psz_url = myth_token( psz_params, i_len, i_offset + 10 );
+            /* land on the keyframe starting the break */
+            int i_key = SeekIndexFind( p_index, atoll( myth_token( &reply, 1 + i * i_fields + i_fields - 1 ) ) );
+            if ( i_key >= 0 )
+            {
+                i_byte = p_index->pi_offset[i_key];
+                i_time = SeekIndexTime( p_index, p_index->pi_frame[i_key] );
+            }
         }
         else
         {
-            psz_url = myth_token( psz_params, i_len, i_offset + 11 );
+            i_byte = atoll( myth_token( &results, 1 + i ) );
         }
 
-        input_item_t *p_item = NULL;
-        if (strstr(psz_url, p_sys->url.psz_path))
-        {
-            /* found our program in all the recordings */
-            char psz_datebuf[1000];
-            myth_recording_t recording = ParseRecording( p_sys->myth.version, psz_params, i_len, i_offset );
-            
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("MythTV Backend Version"), "%s", p_sys->myth.version->psz_version );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Myth Protocol"), "%d", p_sys->myth.version->i_version );
+        CutTitleAdd( t, i_byte, i_time, !strcmp( myth_token( &reply, 1 + i * i_fields + 0 ), "4" ) );
+        //msg_Info( p_access, "CUT frame %"PRId64, i_byte );
+    }
+
+    myth_ReplyClean( &results );
+    myth_ReplyClean( &reply );
 
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Title"), "%s", recording.psz_title );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Sub title"), "%s", recording.psz_subtitle );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Description"), "%s", recording.psz_description );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Category"), "%s", recording.psz_genre );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Channel"), "%s", recording.psz_channelName );
+    *pp_title = t;
 
-            strftime( psz_datebuf, sizeof( psz_datebuf ), "%Y-%m-%d %I:%M%p", localtime( &recording.startTime ) );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Recording start"), "%s", psz_datebuf );
+    return VLC_SUCCESS;
 
-            strftime( psz_datebuf, sizeof( psz_datebuf ), "%Y-%m-%d %I:%M%p", localtime( &recording.endTime ) );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Recording end"), "%s", psz_datebuf );
+error:
+    msg_Warn( p_access, "Unable to load the commercial breaks" );
+    myth_ReplyClean( &results );
+    myth_ReplyClean( &reply );
+    return VLC_EGENERIC;
+}
 
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("File size"), "%"PRId64" MB", recording.i_fileSize / 1000000 );
-            input_Control( p_input, INPUT_ADD_INFO, _("MythTV"), _("Base name"), "%s", recording.psz_urlBase );
+/*****************************************************************************
+ * Index cache: the seek index and cut list of a finished recording never
+ * change. They are kept in <cache dir>/myth/<basename>.idx as native arrays
+ * behind a fixed header, so the file can be mapped as is:
+ *   header, cut[i_cuts], frame[i_keyframes], offset[i_keyframes]
+ * An entry only holds for the file size it was written with.
+ *****************************************************************************/
+#define MYTH_INDEX_MAGIC   "MYTHIDX"
+#define MYTH_INDEX_VERSION 1
 
-            p_sys->psz_basename = strdup( recording.psz_urlBase );
+typedef struct
+{
+    char        psz_magic[8];
+    uint32_t    i_version;
+    int32_t     i_fps_1000;
+    uint64_t    i_filesize;
+    uint32_t    i_cuts;
+    uint32_t    i_keyframes;
+} myth_index_header_t;
+
+typedef struct
+{
+    int64_t     i_byte_offset;
+    int64_t     i_time_offset;
+    int32_t     b_commercial;
+    int32_t     i_reserved;
+} myth_index_cut_t;
+
+/* the keyframe index and cut list of a cached recording, *pp_title is NULL
+ * if it has no breaks. The keyframe arrays are used where they are mapped */
+static int IndexCacheLoad( access_t *p_access, access_sys_t *p_sys, myth_seek_index_t *p_index, input_title_t **pp_title )
+{
+    myth_index_header_t header;
+    size_t i_map;
 
-            p_item = input_GetItem( p_input );
-            //input_item_SetDate( p_item, "test" );
+    *pp_title = NULL;
 
-            char* psz_ctitle;
-            asprintf( &psz_ctitle, "%s: %s", recording.psz_title, recording.psz_subtitle );
-            input_Control( p_input, INPUT_SET_NAME, psz_ctitle );
-            free( psz_ctitle );
+    if ( !var_InheritBool( p_access, "myth-index-cache" ) )
+        return VLC_EGENERIC;
 
-            input_item_SetDescription( p_item, strdup( recording.psz_description ) );
+    char *psz_path = CachePath( p_sys, "idx", false );
+    if ( !psz_path )
+        return VLC_EGENERIC;
 
-            //GetCutList( (access_t *) p_access, p_sys, channelid, recstart );
+    int fd = vlc_open( psz_path, O_RDONLY );
+    free( psz_path );
+    if ( fd == -1 )
+        return VLC_EGENERIC;
 
+    uint8_t *p_map = CacheFileMap( fd, &i_map );
+    close( fd );
+    if ( !p_map )
+        return VLC_EGENERIC;
 
+    /* anything that does not add up is asked from the backend again */
+    if ( i_map < sizeof( header ) )
+        goto error;
+    memcpy( &header, p_map, sizeof( header ) );
+    if ( memcmp( header.psz_magic, MYTH_INDEX_MAGIC, sizeof( header.psz_magic ) )
+      || header.i_version != MYTH_INDEX_VERSION
+      || header.i_filesize != p_sys->i_cut_size
+      || header.i_keyframes > INT_MAX / sizeof( int64_t )
+      || header.i_cuts > ( i_map - sizeof( header ) ) / sizeof( myth_index_cut_t ) )
+        goto error;
+
+    size_t i_frames = sizeof( header ) + header.i_cuts * sizeof( myth_index_cut_t );
+    if ( ( i_map - i_frames ) / ( 2 * sizeof( int64_t ) ) < header.i_keyframes )
+        goto error;
+
+    input_title_t *t = header.i_cuts > 0 ? CutTitleNew() : NULL;
+    if ( header.i_cuts > 0 && !t )
+        goto error;
+
+    for ( uint32_t i = 0; i < header.i_cuts; i++ )
+    {
+        myth_index_cut_t cut;
 
-            break;
-        }
+        memcpy( &cut, p_map + sizeof( header ) + i * sizeof( cut ), sizeof( cut ) );
+        CutTitleAdd( t, cut.i_byte_offset, cut.i_time_offset, cut.b_commercial );
     }
 
-    free( psz_params );
-    vlc_object_release( p_input );
+    /* the header and cuts keep the arrays 8 byte aligned */
+    if ( header.i_keyframes > 0 )
+    {
+        p_index->p_map = p_map;
+        p_index->i_map = i_map;
+        p_index->pi_frame = (int64_t *) ( p_map + i_frames );
+        p_index->pi_offset = p_index->pi_frame + header.i_keyframes;
+        p_index->i_count = header.i_keyframes;
+        p_index->i_fps_1000 = header.i_fps_1000;
+    }
+    else
+        CacheFileUnmap( p_map, i_map );
 
+    msg_Dbg( p_access, "%u commercial breaks and %u keyframes from the index cache", header.i_cuts, header.i_keyframes );
+    *pp_title = t;
     return VLC_SUCCESS;
+
+error:
+    msg_Dbg( p_access, "ignoring an invalid index cache" );
+    CacheFileUnmap( p_map, i_map );
+    return VLC_EGENERIC;
 }
 
+static void IndexCacheSave( access_t *p_access, access_sys_t *p_sys, const myth_seek_index_t *p_index, input_title_t *t )
+{
+    myth_index_header_t header;
+    bool b_error = false;
+
+    if ( !var_InheritBool( p_access, "myth-index-cache" ) )
+        return;
+
+    char *psz_path = CachePath( p_sys, "idx", true );
+    char *psz_tmp;
+    if ( !psz_path )
+        return;
+
+    FILE *p_file = CacheFileCreate( psz_path, &psz_tmp );
+    if ( !p_file )
+    {
+        msg_Warn( p_access, "Unable to cache the index in %s", psz_path );
+        free( psz_path );
+        return;
+    }
 
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.psz_magic, MYTH_INDEX_MAGIC, sizeof( header.psz_magic ) );
+    header.i_version = MYTH_INDEX_VERSION;
+    header.i_fps_1000 = p_index->i_fps_1000;
+    header.i_filesize = p_sys->i_cut_size;
+    header.i_cuts = t ? t->i_seekpoint - 1 : 0;     /* not the Start */
+    header.i_keyframes = p_index->i_count;
 
+    b_error |= fwrite( &header, sizeof( header ), 1, p_file ) != 1;
 
-static int parseURL( vlc_url_t *url, const char *path )
+    for ( uint32_t i = 0; i < header.i_cuts; i++ )
+    {
+        seekpoint_t *s = t->seekpoint[i + 1];
+        myth_index_cut_t cut;
+
+        memset( &cut, 0, sizeof( cut ) );
+        cut.i_byte_offset = s->i_byte_offset;
+        cut.i_time_offset = s->i_time_offset;
+        cut.b_commercial = !strcmp( s->psz_name, "Commercial" );
+        b_error |= fwrite( &cut, sizeof( cut ), 1, p_file ) != 1;
+    }
+
+    if ( p_index->i_count > 0 )
+    {
+        b_error |= fwrite( p_index->pi_frame, sizeof( int64_t ), p_index->i_count, p_file ) != (size_t) p_index->i_count;
+        b_error |= fwrite( p_index->pi_offset, sizeof( int64_t ), p_index->i_count, p_file ) != (size_t) p_index->i_count;
+    }
+
+    if ( CacheFileCommit( p_file, psz_tmp, psz_path, b_error ) )
+        msg_Warn( p_access, "Unable to cache the index in %s", psz_path );
+    free( psz_path );
+}
+
+/*****************************************************************************
+ * Cut list: the commercial breaks become chapters once they are known, the
+ * queries run on their own thread so opening does not wait for them
+ *****************************************************************************/
+static void CutListCleanup( void *data )
 {
-    if( path == NULL )
-        return VLC_EGENERIC;
+    access_sys_t *p_sys = data;
 
-    /* *** Parse URL and get server addr/port and path *** */
-    while( *path == '/' )
-        path++;
+    vlc_mutex_lock( &p_sys->lock );
+    myth_conn_t *p_conn = p_sys->p_cut_conn;
+    p_sys->p_cut_conn = NULL;
+    vlc_mutex_unlock( &p_sys->lock );
 
-    vlc_UrlParse( url, path, 0 );
+    myth_PoolRelease( p_conn );
+}
 
-    if( url->psz_host == NULL || *url->psz_host == '\0' )
-        return VLC_EGENERIC;
+static void *CutListThread( void *data )
+{
+    access_t *p_access = data;
+    access_sys_t *p_sys = p_access->p_sys;
 
-    if( url->i_port <= 0 )
-        url->i_port = IPPORT_MYTH; /* default port */
+    myth_seek_index_t index = MYTH_SEEK_INDEX_INIT;
+    input_title_t *t = NULL;
 
-    if( url->psz_path != NULL && url->psz_path[0] == '/' )
-        url->psz_path++;
+    /* a round-trip must not be cut in half, CutListStop() cancels between
+     * them and breaks the one in progress */
+    int canc = vlc_savecancel();
 
-    return VLC_SUCCESS;
+    if ( !IndexCacheLoad( p_access, p_sys, &index, &t ) )
+    {
+        vlc_mutex_lock( &p_sys->lock );
+        p_sys->index = index;
+        vlc_mutex_unlock( &p_sys->lock );
+    }
+    else
+    {
+        /* p_cmd belongs to the prefetch thread */
+        myth_conn_t *p_conn = myth_PoolAcquire( VLC_OBJECT( p_access ), &p_sys->url );
+        if ( p_conn )
+        {
+            int i_ret;
+
+            vlc_mutex_lock( &p_sys->lock );
+            p_sys->p_cut_conn = p_conn;
+            vlc_mutex_unlock( &p_sys->lock );
+
+            vlc_cleanup_push( CutListCleanup, p_sys );
+            vlc_restorecancel( canc );
+            vlc_testcancel();
+            canc = vlc_savecancel();
+
+            /* without an index the breaks are resolved by the backend */
+            SeekIndexLoad( p_access, p_sys, p_conn, &index );
+
+            /* kept for Seek(), freed on close */
+            vlc_mutex_lock( &p_sys->lock );
+            p_sys->index = index;
+            vlc_mutex_unlock( &p_sys->lock );
+
+            vlc_restorecancel( canc );
+            vlc_testcancel();
+            canc = vlc_savecancel();
+
+            i_ret = GetCutList( p_access, p_sys, p_conn, &index, &t );
+            vlc_cleanup_run();
+
+            if ( !i_ret && p_sys->b_cut_final )
+                IndexCacheSave( p_access, p_sys, &index, t );
+        }
+    }
+
+    /* handed to Read() */
+    if ( t )
+    {
+        vlc_mutex_lock( &p_sys->lock );
+        p_sys->p_cut_title = t;
+        vlc_mutex_unlock( &p_sys->lock );
+    }
+
+    vlc_restorecancel( canc );
+
+    return NULL;
+}
+
+static void CutListStart( access_t *p_access, access_sys_t *p_sys )
+{
+    /* breaks are looked up by chanid and start time */
+    if ( !p_sys->psz_basename )
+        return;
+
+    /* only a finished recording keeps the index it has now */
+    p_sys->i_cut_size = p_access->info.i_size;
+    vlc_mutex_lock( &p_sys->lock );
+    p_sys->b_cut_final = time( NULL ) > p_sys->i_rec_end + MYTH_SIZE_GRACE;
+    vlc_mutex_unlock( &p_sys->lock );
+
+    if( vlc_clone( &p_sys->cut_thread, CutListThread, p_access, VLC_THREAD_PRIORITY_LOW ) )
+    {
+        msg_Warn( p_access, "Unable to start cut list thread" );
+        return;
+    }
+
+    p_sys->b_cut_loading = true;
+}
+
+static void CutListStop( access_sys_t *p_sys )
+{
+    if ( !p_sys->b_cut_loading )
+        return;
+
+    vlc_cancel( p_sys->cut_thread );
+
+    /* a backend that stopped answering must not hold up closing */
+    vlc_mutex_lock( &p_sys->lock );
+    if ( p_sys->p_cut_conn )
+    {
+        p_sys->p_cut_conn->b_broken = true;
+        shutdown( p_sys->p_cut_conn->fd, SHUT_RDWR );
+    }
+    vlc_mutex_unlock( &p_sys->lock );
+
+    vlc_join( p_sys->cut_thread, NULL );
+
+    p_sys->b_cut_loading = false;
 }
 
 
@@ -758,14 +3732,51 @@ static int InOpen( vlc_object_t *p_this )
 
     /* Init p_access */
     STANDARD_READ_ACCESS_INIT
-    p_sys->fd_cmd = -1;
+    p_sys->p_cmd = NULL;
+    p_sys->reply = (myth_reply_t) MYTH_REPLY_INIT;
     p_sys->fd_data = -1;
     p_sys->i_data_to_be_read = 0;
-    p_sys->i_filesize_last_updated = 0;
     p_sys->b_eofing = false;
+    p_sys->psz_basename = NULL;
+    p_sys->b_info_loaded = false;
+    StatsInit( &p_sys->stats );
+    myth_TraceOpen( p_this );
+
+    p_sys->i_request_len = MYTH_REQUEST_LEN;
+    p_sys->i_request_threshold = MYTH_REQUEST_LEN / 2;
+    p_sys->i_rtt = 0;
+    p_sys->i_rtt_next = 0;
+    p_sys->i_bandwidth = 0;
+    p_sys->i_bw_time = 0;
+    p_sys->i_bw_bytes = 0;
+
+    vlc_mutex_init( &p_sys->lock );
+    vlc_cond_init( &p_sys->wait );
+    p_sys->b_prefetching = false;
+    p_sys->i_size_update = 0;
+    p_sys->b_size_tracking = false;
+    p_sys->i_rec_end = 0;
+    p_sys->p_cache = NULL;
+    p_sys->p_stripes = NULL;
+    p_sys->i_stripes = 0;
+    p_sys->i_fetch_pos = 0;
+    p_sys->i_transfer_pos = 0;
+    p_sys->i_cache_until = 0;
+    p_sys->b_cut_loading = false;
+    p_sys->i_chanid = 0;
+    p_sys->i_rec_start = 0;
+    p_sys->p_cut_title = NULL;
+    p_sys->i_cut_size = 0;
+    p_sys->index = (myth_seek_index_t) MYTH_SEEK_INDEX_INIT;
+    p_sys->p_cut_conn = NULL;
+    p_sys->b_cut_final = false;
 
     p_sys->i_titles = 0;
 
+    p_sys->p_ring = malloc( MYTH_RING_SIZE );
+    if( !p_sys->p_ring )
+        goto exit_error;
+
     if( parseURL( &p_sys->url, p_access->psz_location ) )
         goto exit_error;
 
@@ -773,10 +3784,18 @@ static int InOpen( vlc_object_t *p_this )
         goto exit_error;
 
     // initialise streaming connection
-    p_sys->fd_data = myth_Connect( p_this, &p_sys->myth, &p_sys->url, true );
+    p_sys->fd_data = myth_Connect( p_this, &p_sys->myth, &p_sys->url, true, false, NULL );
     if( !p_sys->fd_data )
         goto exit_error;
 
+    p_sys->p_cache = DiskCacheOpen( p_access, p_sys );
+    StripesOpen( p_access, p_sys );
+
+    if( PrefetchStart( p_access, p_sys ) )
+        goto exit_error;
+
+    SizeTrackerStart( p_access, p_sys );
+    CutListStart( p_access, p_sys );
 
     var_Create( p_access, "myth-caching", VLC_VAR_INTEGER | VLC_VAR_DOINHERIT );
     
@@ -797,15 +3816,33 @@ exit_error:
 static void Close( vlc_object_t *p_access, access_sys_t *p_sys )
 {
     msg_Info( p_access, "stopping stream" );
+
+    CutListStop( p_sys );
+    SizeTrackerStop( p_sys );
+    PrefetchStop( p_sys );
+    StripesClose( p_sys );
+    DiskCacheClose( p_access, p_sys->p_cache );
     
     if ( p_sys->fd_data != -1 )
         net_Close( p_sys->fd_data );
 
-    if ( p_sys->fd_cmd != -1 )
-        net_Close( p_sys->fd_cmd );
+    myth_PoolRelease( p_sys->p_cmd );
+    myth_ReplyClean( &p_sys->reply );
+    StatsClean( p_access, &p_sys->stats );
+    myth_TraceClose();
 
     /* free memory */
+    free( p_sys->psz_basename );
     vlc_UrlClean( &p_sys->url );
+    free( p_sys->p_ring );
+    for( int i = 0; i < p_sys->i_titles; i++ )
+        vlc_input_title_Delete( p_sys->titles[i] );
+    free( p_sys->titles );
+    if( p_sys->p_cut_title )
+        vlc_input_title_Delete( p_sys->p_cut_title );
+    SeekIndexClean( &p_sys->index );
+    vlc_cond_destroy( &p_sys->wait );
+    vlc_mutex_destroy( &p_sys->lock );
     free( p_sys );
 }
 
@@ -818,201 +3855,371 @@ static void InClose( vlc_object_t *p_this )
 /*****************************************************************************
  * Seek: try to go at the right place
  *****************************************************************************/
-static int _Seek( vlc_object_t *p_access, access_sys_t *p_sys, int64_t i_pos )
+static int Reconnect( vlc_object_t *p_access, access_sys_t *p_sys )
 {
-    if( i_pos < 0 )
-        return VLC_EGENERIC;
-
-    msg_Info( p_access, "seeking to %"PRId64" / %"PRId64, i_pos, ((access_t *)p_access)->info.i_size );
+    msg_Warn( p_access, "reconnecting to the backend" );
 
-    char *psz_params;
-    int i_plen;
+    vlc_mutex_lock( &p_sys->stats.lock );
+    p_sys->stats.counters.i_reconnects++;
+    vlc_mutex_unlock( &p_sys->stats.lock );
 
     // close and reopen
     if ( p_sys->fd_data != -1 )
         net_Close( p_sys->fd_data );
 
-    if ( p_sys->fd_cmd != -1 )
-        net_Close( p_sys->fd_cmd );
+    myth_PoolRelease( p_sys->p_cmd );
 
+    p_sys->fd_data = -1;
+    p_sys->p_cmd = NULL;
     p_sys->i_data_to_be_read = 0;
-    p_sys->i_filesize_last_updated = 0;
 
     if( InitialiseCommandConnection( p_access, p_sys ) )
-        goto exit_error;
+        return VLC_EGENERIC;
 
-    p_sys->fd_data = myth_Connect( p_access, &p_sys->myth, &p_sys->url, true );
+    p_sys->fd_data = myth_Connect( p_access, &p_sys->myth, &p_sys->url, true, false, NULL );
     if( !p_sys->fd_data )
-        goto exit_error;
+    {
+        p_sys->fd_data = -1;
+        return VLC_EGENERIC;
+    }
+
+    return VLC_SUCCESS;
+}
+
+static int _Seek( vlc_object_t *p_access, access_sys_t *p_sys, int64_t i_pos )
+{
+    if( i_pos < 0 )
+        return VLC_EGENERIC;
 
-    if ( p_sys->myth.version == &myth_version_24 )
+    msg_Info( p_access, "seeking to %"PRId64" / %"PRId64, i_pos, ((access_t *)p_access)->info.i_size );
+
+    PrefetchStop( p_sys );
+
+    p_sys->b_eofing = false;
+
+    /* stripes seek their own transfers for every chunk, those that were
+     * lost are opened again */
+    for ( int i = 0; i < p_sys->i_stripes; i++ )
     {
-        if ( myth_Send( p_access, p_sys->fd_cmd, &i_plen, &psz_params, "QUERY_FILETRANSFER %s[]:[]SEEK[]:[]%d[]:[]%d[]:[]0[]:[]0[]:[]0", p_sys->myth.file_transfer_id, (int32_t)(i_pos >> 32), (int32_t)(i_pos)) )
-        {
-            goto exit_error;
-        }
+        myth_stripe_t *p_stripe = &p_sys->p_stripes[i];
+
+        if ( !p_stripe->b_lost )
+            continue;
+
+        msg_Warn( p_access, "reopening connection %d to the backend", i );
+        vlc_mutex_lock( &p_sys->stats.lock );
+        p_sys->stats.counters.i_reconnects++;
+        vlc_mutex_unlock( &p_sys->stats.lock );
+
+        StripeClose( p_stripe );
+        if ( StripeOpen( (access_t *)p_access, p_sys, p_stripe ) )
+            return VLC_EGENERIC;
+        p_stripe->b_lost = false;
     }
-    else
+
+    /* seek within the running FileTransfer, only reconnect if that fails */
+    if ( p_sys->i_stripes == 0
+      && ( DrainDataConnection( p_access, p_sys->fd_data, &p_sys->i_data_to_be_read, p_sys->p_ring, MYTH_RING_SIZE )
+        || SeekFileTransfer( p_access, p_sys->p_cmd, &p_sys->myth, &p_sys->reply, i_pos ) ) )
     {
-        if ( myth_Send( p_access, p_sys->fd_cmd, &i_plen, &psz_params, "QUERY_FILETRANSFER %s[]:[]SEEK[]:[]%"PRId64"[]:[]0[]:[]0", p_sys->myth.file_transfer_id, i_pos) )
+        if ( Reconnect( p_access, p_sys )
+          || SeekFileTransfer( p_access, p_sys->p_cmd, &p_sys->myth, &p_sys->reply, i_pos ) )
         {
-            goto exit_error;
+            return VLC_EGENERIC;
         }
     }
 
-    free( psz_params );
-    return VLC_SUCCESS;
+    p_sys->i_fetch_pos = i_pos;
+    p_sys->i_transfer_pos = i_pos;
 
-exit_error:
-    free( psz_params );
-    InClose( p_access );
+    return PrefetchStart( (access_t *)p_access, p_sys );
+}
 
-    return VLC_EGENERIC;
+/* skip forward within the disk cache range being read or what the prefetch
+ * thread already has, which starts where that range ends */
+static bool SeekBuffered( access_t *p_access, access_sys_t *p_sys, uint64_t i_pos )
+{
+    bool b_done = false;
+
+    if ( !p_sys->b_prefetching || i_pos <= p_access->info.i_pos )
+        return false;
+
+    if ( i_pos <= p_sys->i_cache_until )
+        return true;
+
+    vlc_mutex_lock( &p_sys->lock );
+    uint64_t i_skip = i_pos - __MAX( p_access->info.i_pos, p_sys->i_cache_until );
+    if ( !p_sys->b_ring_error && i_skip <= p_sys->i_ring_fill )
+    {
+        p_sys->i_ring_start = ( p_sys->i_ring_start + i_skip ) % MYTH_RING_SIZE;
+        p_sys->i_ring_fill -= i_skip;
+        vlc_cond_broadcast( &p_sys->wait );
+        b_done = true;
+    }
+    vlc_mutex_unlock( &p_sys->lock );
+
+    return b_done;
 }
 
-static int Seek( access_t *p_access, uint64_t i_pos )
+static int SeekAccess( access_t *p_access, access_sys_t *p_sys, uint64_t i_pos )
 {
-    access_sys_t *p_sys = p_access->p_sys;
+    /* what is on disk is read from there, the backend only sends the rest */
+    p_sys->i_cache_until = DiskCacheExtent( p_sys->p_cache, i_pos );
+    if ( p_sys->i_cache_until > i_pos )
+        msg_Dbg( p_access, "reading %"PRIu64" B from the disk cache", p_sys->i_cache_until - i_pos );
+    else
+        p_sys->i_cache_until = 0;
 
-    int val = _Seek( (vlc_object_t *)p_access, p_access->p_sys, i_pos );
+    int val = _Seek( (vlc_object_t *)p_access, p_sys, __MAX( i_pos, p_sys->i_cache_until ) );
     if( val )
+    {
+        p_sys->i_cache_until = 0;
         return val;
+    }
 
     p_access->info.i_pos = i_pos;
-    p_sys->b_eofing = false;
     p_access->info.b_eof = false;
 
     return VLC_SUCCESS;
 }
 
+static int Seek( access_t *p_access, uint64_t i_pos )
+{
+    access_sys_t *p_sys = p_access->p_sys;
+
+    /* skipping ahead in what is buffered costs nothing, it is only counted */
+    if ( SeekBuffered( p_access, p_sys, i_pos ) )
+    {
+        p_access->info.i_pos = i_pos;
+        p_access->info.b_eof = false;
+
+        vlc_mutex_lock( &p_sys->stats.lock );
+        p_sys->stats.counters.i_skips++;
+        vlc_mutex_unlock( &p_sys->stats.lock );
+        return VLC_SUCCESS;
+    }
+
+    mtime_t i_start = mdate();
+    int i_ret = SeekAccess( p_access, p_sys, i_pos );
+    StatsAddLatency( &p_sys->stats, &p_sys->stats.counters.seek, mdate() - i_start );
+
+    return i_ret;
+}
+
+/* a time goes to the keyframe the index has for it, so the demux starts on
+ * a GOP. Without an index the byte offset it was given is used */
+static int SeekTime( access_t *p_access, access_sys_t *p_sys, mtime_t i_time, uint64_t i_pos )
+{
+    vlc_mutex_lock( &p_sys->lock );
+    int64_t i_offset = SeekIndexOffset( &p_sys->index, i_time );
+    vlc_mutex_unlock( &p_sys->lock );
+
+    if ( i_offset >= 0 )
+    {
+        msg_Dbg( p_access, "keyframe at %"PRId64" for %"PRId64" ms", i_offset, i_time / 1000 );
+        i_pos = i_offset;
+    }
+
+    return Seek( p_access, i_pos );
+}
+
+
+/* last seekpoint from i_first on that starts at or before i_pos, i_first
+ * itself when none does */
+static int FindSeekpoint( input_title_t *t, int i_first, uint64_t i_pos )
+{
+    int i_lo = i_first, i_hi = t->i_seekpoint - 1;
+
+    while ( i_lo < i_hi )
+    {
+        int i_mid = i_lo + ( i_hi - i_lo + 1 ) / 2;
+        if ( (uint64_t) t->seekpoint[i_mid]->i_byte_offset <= i_pos )
+            i_lo = i_mid;
+        else
+            i_hi = i_mid - 1;
+    }
+
+    return i_lo;
+}
+
+/* keep info.i_seekpoint on the chapter holding info.i_pos. Playback only
+ * ever moves into the next chapter, anything else comes from a seek and
+ * is binary searched. The input is told only when the chapter changes. */
+static void UpdateSeekpoint( access_t *p_access, access_sys_t *p_sys )
+{
+    if ( p_sys->i_titles <= 0 )
+        return;
+
+    input_title_t *t = p_sys->titles[p_access->info.i_title];
+    uint64_t i_pos = p_access->info.i_pos;
+    int i = p_access->info.i_seekpoint;
+
+    if ( t->i_seekpoint <= 0 )
+        return;
+
+    if ( i < 0 || i >= t->i_seekpoint || (uint64_t) t->seekpoint[i]->i_byte_offset > i_pos )
+        i = FindSeekpoint( t, 0, i_pos );
+    else if ( i + 1 < t->i_seekpoint && (uint64_t) t->seekpoint[i + 1]->i_byte_offset <= i_pos )
+        i = FindSeekpoint( t, i + 1, i_pos );
+
+    if ( i != p_access->info.i_seekpoint )
+    {
+        p_access->info.i_seekpoint = i;
+        p_access->info.i_update |= INPUT_UPDATE_SEEKPOINT;
+    }
+}
+
+/* hand over what the background threads found, with lock held */
+static void ApplyUpdates( access_t *p_access, access_sys_t *p_sys )
+{
+    if ( p_sys->i_size_update )
+    {
+        if ( p_access->info.i_size != p_sys->i_size_update )
+        {
+            p_access->info.i_size = p_sys->i_size_update;
+            msg_Dbg( p_access, "new file size %"PRId64" position %"PRId64, p_access->info.i_size, p_access->info.i_pos );
+        }
+        p_sys->i_size_update = 0;
+    }
+
+    if ( p_sys->p_cut_title )
+    {
+        TAB_APPEND( p_sys->i_titles, p_sys->titles, p_sys->p_cut_title );
+        p_sys->p_cut_title = NULL;
+        msg_Dbg( p_access, "%d chapters loaded", p_sys->titles[0]->i_seekpoint );
+#ifdef INPUT_UPDATE_TITLE_LIST
+        p_access->info.i_update |= INPUT_UPDATE_TITLE_LIST;
+#endif
+    }
+}
+
+/* serve [i_pos, i_cache_until) from the disk cache, the network is already
+ * fetching what follows. On failure the backend is asked for it instead
+ * and 0 is returned */
+static ssize_t ReadDiskCache( access_t *p_access, access_sys_t *p_sys, uint8_t *p_buffer, size_t i_len )
+{
+    i_len = __MIN( i_len, p_sys->i_cache_until - p_access->info.i_pos );
+
+    ssize_t i_read = DiskCacheRead( p_sys->p_cache, p_access->info.i_pos, p_buffer, i_len );
+    if ( i_read <= 0 )
+    {
+        msg_Warn( p_access, "disk cache read failed, fetching from the backend" );
+        p_sys->i_cache_until = 0;
+        _Seek( (vlc_object_t *)p_access, p_sys, p_access->info.i_pos );
+        return 0;
+    }
+
+    vlc_mutex_lock( &p_sys->stats.lock );
+    p_sys->stats.counters.i_cache_bytes += i_read;
+    vlc_mutex_unlock( &p_sys->stats.lock );
+
+    vlc_mutex_lock( &p_sys->lock );
+    ApplyUpdates( p_access, p_sys );
+    vlc_mutex_unlock( &p_sys->lock );
+
+    p_access->info.i_pos += i_read;
+    UpdateSeekpoint( p_access, p_sys );
+
+    return i_read;
+}
 
 /*****************************************************************************
  * Read:
  *****************************************************************************/
 static ssize_t Read( access_t *p_access, uint8_t *p_buffer, size_t i_len )
 {
-    int i_read;
-    int i_will_receive = 0;
-#ifdef WIN32
-    int i_requestlen = 65536;
-#else
-    int i_requestlen = 131072;
-#endif
-
-    int i_plen;
-    char *psz_params;
+    size_t i_read = 0;
 
     access_sys_t *p_sys = p_access->p_sys;
 
-    assert( p_sys->fd_data != -1 );
-    assert( p_sys->fd_cmd != -1 );
-
     if( p_access->info.b_eof )
         return 0;
 
-    //msg_Dbg( p_access, "Want Read %d", i_len );
+    StatsPublish( p_access, &p_sys->stats );
 
-    /* pipeline reading, request new data when our buffer is half finished */
-    if ( !p_sys->b_eofing && p_sys->i_data_to_be_read <= i_requestlen / 2 )
+    if ( p_access->info.i_pos < p_sys->i_cache_until )
     {
-        //msg_Dbg( p_access, "REQUEST_BLOCK %d", i_requestlen );
-        if( myth_Send( VLC_OBJECT( p_access ), p_sys->fd_cmd, &i_plen, &psz_params, "QUERY_FILETRANSFER %s[]:[]REQUEST_BLOCK[]:[]%d", p_sys->myth.file_transfer_id, i_requestlen ) )
-        {
-            return VLC_EGENERIC;
-        }
-        
-        i_will_receive = atoi( myth_token(psz_params, i_plen, 0) );
-
-        //msg_Dbg( p_access, "i_will_receive %d", i_will_receive );
-        if ( i_will_receive <= 0 )
-        {
-            msg_Dbg( p_access, "SET EOFing" );
-            p_sys->b_eofing = true;
-        }
-        else
-        {
-            p_sys->i_data_to_be_read += i_will_receive;
-        }
-
-        free( psz_params );
+        ssize_t i_cached = ReadDiskCache( p_access, p_sys, p_buffer, i_len );
+        if ( i_cached > 0 )
+            return i_cached;
     }
 
-    /* check if last block now read */
-    if ( p_sys->b_eofing && p_sys->i_data_to_be_read == 0 )
+    /* a failed seek left us without a connection */
+    if( !p_sys->b_prefetching )
     {
-        msg_Dbg( p_access, "SET EOF from eofing" );
         p_access->info.b_eof = true;
         return 0;
     }
 
-    if ( p_sys->psz_basename && mdate() - p_sys->i_filesize_last_updated > 1000000 )
-    {
-        // update the file size every 2 seconds
-        p_sys->i_filesize_last_updated = mdate();
-
-        if ( myth_Send( VLC_OBJECT( p_access ), p_sys->fd_cmd, &i_plen, &psz_params, "QUERY_RECORDING BASENAME %s", p_sys->psz_basename ) )
-        {
-            return VLC_EGENERIC;
-        }
+    //msg_Dbg( p_access, "Want Read %d", i_len );
 
-        if ( strncmp( psz_params, "ERROR", 6 ) )
+    vlc_mutex_lock( &p_sys->lock );
+    mtime_t i_wait = 0;
+    while ( p_sys->i_ring_fill == 0 && !p_sys->b_ring_eof && !p_sys->b_ring_error && !p_sys->b_ring_stale )
+    {
+        if ( !i_wait )
+            i_wait = mdate();
+        if ( !vlc_object_alive( p_access ) )
         {
-            uint64_t i_newsize;
-            if ( p_sys->myth.version == &myth_version_24 )
-            {
-                i_newsize = atoll( myth_token( psz_params, i_plen, 1 + 9 ) );
-            }
-            else if ( p_sys->myth.version == &myth_version_25 || p_sys->myth.version == &myth_version_26 )
-            {
-                i_newsize = atoll( myth_token( psz_params, i_plen, 1 + 11 ) );
-            }
-            else
-            {
-                i_newsize = atoll( myth_token( psz_params, i_plen, 1 + 12 ) );
-            }
-
-            if ( p_access->info.i_size != i_newsize )
-            {
-                p_access->info.i_size = i_newsize;
-                msg_Dbg( p_access, "new file size %"PRId64" position %"PRId64, i_newsize, p_access->info.i_pos );
-            }
+            vlc_mutex_unlock( &p_sys->lock );
+            return 0;
         }
+        vlc_cond_timedwait( &p_sys->wait, &p_sys->lock, mdate() + CLOCK_FREQ / 10 );
+    }
 
-        free( psz_params );
+    /* the pipeline ran dry, the network or the backend is behind */
+    if ( i_wait )
+    {
+        vlc_mutex_lock( &p_sys->stats.lock );
+        p_sys->stats.counters.i_read_waits++;
+        p_sys->stats.counters.i_read_waited += mdate() - i_wait;
+        vlc_mutex_unlock( &p_sys->stats.lock );
     }
 
-    i_read = net_Read( p_access, p_sys->fd_data, NULL, p_buffer, i_len, false );
-    
-    //msg_Dbg( p_access, "i_read %d", i_read );
+    ApplyUpdates( p_access, p_sys );
 
-    if( i_read <= 0 )
+    /* copy out of the ring, possibly in two parts when it wraps */
+    while ( i_read < i_len && p_sys->i_ring_fill > 0 )
     {
-        msg_Dbg( p_access, "SET EOF because i_read nothing" );
-        p_access->info.b_eof = true;
+        size_t i_copy = __MIN( i_len - i_read, p_sys->i_ring_fill );
+        i_copy = __MIN( i_copy, MYTH_RING_SIZE - p_sys->i_ring_start );
+
+        memcpy( p_buffer + i_read, p_sys->p_ring + p_sys->i_ring_start, i_copy );
+        p_sys->i_ring_start = ( p_sys->i_ring_start + i_copy ) % MYTH_RING_SIZE;
+        p_sys->i_ring_fill -= i_copy;
+        i_read += i_copy;
     }
-    else
+
+    if ( i_read == 0 )
     {
-        p_access->info.i_pos += i_read;
-        p_sys->i_data_to_be_read -= i_read;
-        //msg_Dbg( p_access, "i_data_to_be_read %d", p_sys->i_data_to_be_read );
+        if ( p_sys->b_ring_stale )
+        {
+            /* lost during a pause, everything before it was played from the
+             * ring, carry on from here on a new transfer */
+            vlc_mutex_unlock( &p_sys->lock );
+            if ( _Seek( VLC_OBJECT( p_access ), p_sys, p_access->info.i_pos ) )
+                return VLC_EGENERIC;
+            return Read( p_access, p_buffer, i_len );
+        }
 
-        /* update seekpoint to reflect the current position */
-        if ( p_sys->i_titles > 0 )
+        if ( p_sys->b_ring_error )
         {
-            int i;
+            vlc_mutex_unlock( &p_sys->lock );
+            return VLC_EGENERIC;
+        }
 
-            input_title_t *t = p_sys->titles[p_access->info.i_title];
-            for( i = 0; i < t->i_seekpoint; i++ )
-            {
-                if (p_access->info.i_pos <= (uint64_t) t->seekpoint[i]->i_byte_offset)
-                    break;
-            }
+        msg_Dbg( p_access, "SET EOF from prefetch" );
+        p_access->info.b_eof = true;
+    }
 
-            i = (i == 0) ? 0 : i - 1;
+    vlc_cond_broadcast( &p_sys->wait );
+    vlc_mutex_unlock( &p_sys->lock );
 
-            p_access->info.i_seekpoint = i;
-            p_access->info.i_update |= INPUT_UPDATE_SEEKPOINT;
-        }
+    if( i_read > 0 )
+    {
+        p_access->info.i_pos += i_read;
+
+        UpdateSeekpoint( p_access, p_sys );
     }
 
     //msg_Dbg( p_access, "Got Read %d", i_len );
@@ -1042,17 +4249,21 @@ static int Control( access_t *p_access, int i_query, va_list args )
             pb_bool = (bool*)va_arg( args, bool* );
             *pb_bool = true;
             break;
+        /* seeks land on the exact byte, so the demux can find times by
+         * itself, chapters go through the seek index */
         case ACCESS_CAN_FASTSEEK:
             pb_bool = (bool*)va_arg( args, bool* );
-            *pb_bool = false;
+            *pb_bool = true;
             break;
+        /* Read() only takes from the ring, the prefetch thread stops asking
+         * for blocks when it is full and keeps the transfer alive */
         case ACCESS_CAN_PAUSE:
             pb_bool = (bool*)va_arg( args, bool* );
-            *pb_bool = true;    /* FIXME */
+            *pb_bool = true;
             break;
         case ACCESS_CAN_CONTROL_PACE:
             pb_bool = (bool*)va_arg( args, bool* );
-            *pb_bool = true;    /* FIXME */
+            *pb_bool = true;
             break;
 
         /* 
@@ -1069,9 +4280,7 @@ static int Control( access_t *p_access, int i_query, va_list args )
 
         /* */
         case ACCESS_SET_PAUSE_STATE:
-            pb_bool = (bool*)va_arg( args, bool* );
-            if ( !pb_bool )
-              return Seek( p_access, p_access->info.i_pos );
+            /* resuming carries on from the ring, nothing to tear down */
             break;
 
         case ACCESS_SET_PRIVATE_ID_STATE:
@@ -1116,35 +4325,21 @@ static int Control( access_t *p_access, int i_query, va_list args )
             return VLC_EGENERIC;
 
         case ACCESS_SET_SEEKPOINT:
+        {
             i_skp = (int)va_arg( args, int );
-            msg_Err( p_access, "ACCESS_SET_SEEKPOINT %d", i_skp);
-
+            if( p_sys->i_titles <= 0 || i_skp < 0 || i_skp >= p_sys->titles[0]->i_seekpoint )
+                return VLC_EGENERIC;
 
-            // TODO change the way it works with the << & >> buttons on the UI (+1/-1 instead of a number)
-            if( p_sys->i_titles && i_skp < p_sys->titles[0]->i_seekpoint)
-            {
-                //Seek( p_access, (int64_t)p_sys->titles[0]->seekpoint[i_skp]->i_byte_offset);
-
-                /* do the seeking */
-                input_thread_t *p_input = access_GetParentInput( p_access );
-                input_Control( p_input, INPUT_SET_POSITION, (double)p_sys->titles[0]->seekpoint[i_skp]->i_byte_offset / p_access->info.i_size );
-                vlc_object_release( p_input );
-
-                //p_access->info.i_update = 0;
-                //p_access->info.i_size = 0;
-                //p_sys->realpos = p_access->info.i_pos;
-                //p_access->info.i_pos = 0;
-                //p_access->info.b_eof = false;
-                //p_access->info.i_title = 0;
-                //p_access->info.i_seekpoint = 0;
-
-                //p_access->info.i_update |= INPUT_UPDATE_SEEKPOINT;
-                //p_access->info.i_seekpoint = i_skp;
-                return VLC_SUCCESS;
-            }
+            seekpoint_t *s = p_sys->titles[0]->seekpoint[i_skp];
+            msg_Dbg( p_access, "ACCESS_SET_SEEKPOINT %d", i_skp );
 
+            if ( SeekTime( p_access, p_sys, s->i_time_offset, s->i_byte_offset ) )
+                return VLC_EGENERIC;
 
-            return VLC_EGENERIC;
+            p_access->info.i_seekpoint = i_skp;
+            p_access->info.i_update |= INPUT_UPDATE_SEEKPOINT;
+            return VLC_SUCCESS;
+        }
 
         default:
             msg_Warn( p_access, "unimplemented query in control: %d", i_query);
@@ -1158,88 +4353,6 @@ static int Control( access_t *p_access, int i_query, va_list args )
 
 
 
-static void GetCutList( access_t *p_access, access_sys_t *p_sys, char* psz_channel, char* psz_starttime )
-{
-    input_title_t *t;
-    seekpoint_t *s;
-
-    int i_len;
-    char *psz_params;
-
-    
-    /* Menu */
-    t = vlc_input_title_New();
-    t->b_menu = true;
-    t->psz_name = strdup( "Cuts" );
-
-    s = vlc_seekpoint_New();
-    s->i_byte_offset = 0;
-    s->psz_name = strdup( "Start" );
-    TAB_APPEND( t->i_seekpoint, t->seekpoint, s );
-    
-    if ( myth_Send( VLC_OBJECT( p_access ), p_sys->fd_cmd, &i_len, &psz_params, "QUERY_COMMBREAK %s %s", psz_channel, psz_starttime ) )
-    {
-        return;
-    }
-
-    //msg_Info( p_access, "QUERY_COMMBREAK %s %s", psz_channel, psz_starttime );
-    int i_tokens = myth_count_tokens( psz_params, i_len );
-    int i_rows = atoi( myth_token(psz_params, i_len, 0) );
-    int i_fields = (i_tokens-1) / i_rows;
-    for ( int i = 0; i < i_rows; i++ ) {
-        char *psz_results;
-        int i_results;
-        int64_t i_frame = atoi( myth_token( psz_params, i_len, 1 + i * i_fields + 2 ) );
-        int64_t i_byte = 0;
-
-        /* get byte from frame */
-        if ( myth_Send( VLC_OBJECT( p_access ), p_sys->fd_cmd, &i_results, &psz_results, "SQL_QUERY[]:[]SELECT offset FROM recordedseek WHERE chanid=%s AND UNIX_TIMESTAMP(starttime)=%s AND mark <= %"PRId64" ORDER BY mark DESC LIMIT 1", psz_channel, psz_starttime, i_frame ) )
-        {
-            return;
-        }
-        
-        int i_rrows = atoi( myth_token( psz_results, i_results, 0) );
-        if (i_rrows > 0) {
-            i_byte = atoll( myth_token( psz_results, i_results, 1 ) );
-        }
-
-        /* Add the seek points */
-        s = vlc_seekpoint_New();
-        s->i_byte_offset = i_byte;
-        if ( !strcmp( myth_token( psz_params, i_len, 1 + i * i_fields + 0 ), "4") ) {
-            s->psz_name = strdup( "Commercial" );
-        } else {
-            s->psz_name = strdup( "Show" );
-        }
-        TAB_APPEND( t->i_seekpoint, t->seekpoint, s );
-
-        free( psz_results );
-        //msg_Info( p_access, "CUT frame %"PRId64, i_byte );
-    }
-
-    free( psz_params );
-
-    /*
-    s = vlc_seekpoint_New();
-    s->i_byte_offset = 100000000;
-    s->psz_name = strdup( "Commercial" );
-    TAB_APPEND( t->i_seekpoint, t->seekpoint, s );
-
-    s = vlc_seekpoint_New();
-    s->i_byte_offset = 200000000;
-    s->psz_name = strdup( "Segment" );
-    TAB_APPEND( t->i_seekpoint, t->seekpoint, s ); */
-    
-    TAB_APPEND( p_sys->i_titles, p_sys->titles, t );
-
-    
-}
-
-
-
-
-
-
 
 static int UrlsChange( vlc_object_t *p_this, char const *psz_var,
                        vlc_value_t oldval, vlc_value_t newval,
@@ -1272,22 +4385,29 @@ static int SDOpen( vlc_object_t *p_this )
 
     p_sys->i_urls = 0;
     p_sys->ppsz_urls = NULL;
+    p_sys->fd_cmd = 0;
+    p_sys->p_cmd = NULL;
+    p_sys->p_catalog = NULL;
     vlc_mutex_init( &p_sys->lock );
     vlc_cond_init( &p_sys->wait );
     p_sys->b_update = true;
     
     p_sd->p_sys  = p_sys;
 
-    p_sys->items = vlc_array_new( );
+    vlc_dictionary_init( &p_sys->items, 0 );
+    vlc_dictionary_init( &p_sys->slots, 0 );
+    p_sys->i_generation = 0;
 
     /* Give us a name */
     //services_discovery_SetLocalizedName( p_sd, _("MythTV") );
 
     var_Create( p_sd, "mythbackend-url", VLC_VAR_STRING | VLC_VAR_DOINHERIT );
     var_AddCallback( p_sd, "mythbackend-url", UrlsChange, p_sys );
+    myth_TraceOpen( p_this );
     
     if (vlc_clone (&p_sys->thread, SDRun, p_sd, VLC_THREAD_PRIORITY_LOW))
     {
+        myth_TraceClose();
         var_DelCallback( p_sd, "mythbackend-url", UrlsChange, p_sys );
         vlc_cond_destroy( &p_sys->wait );
         vlc_mutex_destroy( &p_sys->lock );
@@ -1314,16 +4434,16 @@ static void SDClose( vlc_object_t *p_this )
 
     if( p_sys->fd_cmd )
     {
+        myth_SocketClean( &p_sys->sock );
         net_Close( p_sys->fd_cmd );
     }
 
-    for( i = 0; i < p_sys->items->i_count; i++ )
-    {
-        input_item_t *p_item = p_sys->items->pp_elems[i];
-        vlc_gc_decref( p_item );
-    }
+    myth_PoolRelease( p_sys->p_cmd );
+    myth_CatalogRelease( p_sys->p_catalog );
+    myth_TraceClose();
 
-    vlc_array_destroy( p_sys->items );
+    vlc_dictionary_clear( &p_sys->slots, NULL, NULL );
+    vlc_dictionary_clear( &p_sys->items, SDDeleteRecording, NULL );
 
     var_DelCallback( p_sd, "mythbackend-url", UrlsChange, p_sys );
     vlc_cond_destroy( &p_sys->wait );
@@ -1336,87 +4456,286 @@ static void SDClose( vlc_object_t *p_this )
     msg_Dbg( p_sd, "SD Close" );
 }
 
-static void SDCreateItem( services_discovery_t *p_sd, int i, int i_fields, char *psz_params, int i_len )
+/* the slot key of a recording, as named by RECORDING_LIST_CHANGE DELETE */
+static void SDSlotKey( char *psz_key, size_t i_size, int i_chanid, int64_t i_start )
 {
-    services_discovery_sys_t *p_sys  = p_sd->p_sys;
+    snprintf( psz_key, i_size, "%d %"PRId64, i_chanid, i_start );
+}
 
-    myth_recording_t recording = ParseRecording( p_sys->myth.version, psz_params, i_len, 1 + i * i_fields + 0);
+/* seconds since the epoch of a UTC "YYYY-MM-DDTHH:MM:SS" time */
+static int64_t SDParseTime( const char *psz_time )
+{
+    int y, m, d, hh, mm, ss;
+
+    if ( sscanf( psz_time, "%d-%d-%dT%d:%d:%d", &y, &m, &d, &hh, &mm, &ss ) != 6 )
+        return -1;
+
+    /* days since 1970-01-01 in the proleptic Gregorian calendar */
+    y -= m <= 2;
+    int64_t i_era = ( y >= 0 ? y : y - 399 ) / 400;
+    int64_t i_yoe = y - i_era * 400;
+    int64_t i_doy = ( 153 * ( m + ( m > 2 ? -3 : 9 ) ) + 2 ) / 5 + d - 1;
+    int64_t i_days = i_era * 146097 + i_yoe * 365 + i_yoe / 4 - i_yoe / 100 + i_doy - 719468;
+
+    return i_days * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+static bool SDItemChanged( const myth_recording_t *p_old, const myth_recording_t *p_new )
+{
+    return strcmp( p_old->psz_title, p_new->psz_title )
+        || strcmp( p_old->psz_subtitle, p_new->psz_subtitle )
+        || strcmp( p_old->psz_description, p_new->psz_description )
+        || strcmp( p_old->psz_genre, p_new->psz_genre )
+        || strcmp( p_old->psz_urlBase, p_new->psz_urlBase )
+        || p_old->startTime != p_new->startTime
+        || p_old->endTime != p_new->endTime;
+}
+
+static void SDSetItemMeta( input_item_t *p_item, const myth_recording_t *p_recording )
+{
+    char *psz_name;
+    if ( asprintf( &psz_name, "%s: %s", p_recording->psz_title, p_recording->psz_subtitle ) != -1 )
+    {
+        input_item_SetName( p_item, psz_name );
+        free( psz_name );
+    }
+
+    input_item_SetDescription( p_item, p_recording->psz_description );
+    input_item_SetGenre( p_item, p_recording->psz_genre );
+    // input_item_SetAlbum( p_item, strdup(psz_ctitle) ); // setting album disables arturl?
+    input_item_SetDuration( p_item, p_recording->duration * 1000000 );
+
+    char psz_datebuf[1000];
+    time_t time = p_recording->startTime;
+    strftime( psz_datebuf, sizeof( psz_datebuf ), "%Y-%m-%d %H:%M", localtime( &time ) );
+    input_item_SetDate( p_item, psz_datebuf );
+    input_item_SetArtist( p_item, psz_datebuf );
+}
+
+static input_item_t *SDCreateItem( services_discovery_t *p_sd, const myth_recording_t *p_recording )
+{
+    services_discovery_sys_t *p_sys  = p_sd->p_sys;
 
     char *psz_url;
-    if( strncmp( recording.psz_urlBase, "myth://", 7 ) )
+    int i_ret;
+    if( strncmp( p_recording->psz_urlBase, "myth://", 7 ) )
     {
         /* convert to fully qualified URL */
-        asprintf( &psz_url, "myth://%s:%d/%s", p_sys->backend_url.psz_host, p_sys->backend_url.i_port, recording.psz_urlBase );
+        i_ret = asprintf( &psz_url, "myth://%s:%d/%s", p_sys->backend_url.psz_host, p_sys->backend_url.i_port, p_recording->psz_urlBase );
     }
     else
     {
-        psz_url = strdup( recording.psz_urlBase );
+        psz_url = strdup( p_recording->psz_urlBase );
+        i_ret = psz_url ? 0 : -1;
     }
 
-    char* psz_arturl;
-    asprintf( &psz_arturl, "%s.png", psz_url );
+    if ( i_ret == -1 )
+        return NULL;
 
-    input_item_t *p_item = NULL;
+    input_item_t *p_item = input_item_NewWithType( psz_url, NULL, 0, NULL, 0,
+                                                   -1, ITEM_TYPE_FILE );
+    if ( p_item )
+    {
+        char* psz_arturl;
+        if ( asprintf( &psz_arturl, "%s.png", psz_url ) != -1 )
+        {
+            input_item_SetArtURL( p_item, psz_arturl );
+            free( psz_arturl );
+        }
 
-    char *psz_name;
-    asprintf( &psz_name, "%s: %s", recording.psz_title, recording.psz_subtitle );
-    p_item = input_item_NewWithType( psz_url, psz_name, 0, NULL, 0,
-                                        -1, ITEM_TYPE_FILE );
-        
-    input_item_SetDescription( p_item, strdup( recording.psz_description ) );
-    input_item_SetGenre( p_item, strdup( recording.psz_genre ) );
-    input_item_SetArtURL( p_item, psz_arturl );
-    // input_item_SetAlbum( p_item, strdup(psz_ctitle) ); // setting album disables arturl?
-    input_item_SetDuration( p_item, recording.duration * 1000000 );
+        SDSetItemMeta( p_item, p_recording );
+        services_discovery_AddItem( p_sd, p_item, NULL );
+    }
 
-    char psz_datebuf[1000];
-    time_t time = recording.startTime;
-    strftime( psz_datebuf, sizeof( psz_datebuf ), "%Y-%m-%d %H:%M", localtime( &time ) );
-    input_item_SetDate( p_item, psz_datebuf );
-    input_item_SetArtist( p_item, psz_datebuf );
+    free( psz_url );
+
+    return p_item;
+}
+
+static void SDDeleteRecording( void *p_data, void *p_obj )
+{
+    sd_recording_t *p_entry = p_data;
+    VLC_UNUSED( p_obj );
+
+    vlc_gc_decref( p_entry->p_item );
+    myth_RecordingDelete( p_entry->p_recording );
+    free( p_entry );
+}
+
+/* add a recording, or update the item and catalog entry it already has */
+static void SDApplyRecording( services_discovery_t *p_sd, const myth_recording_t *p_recording )
+{
+    services_discovery_sys_t *p_sys  = p_sd->p_sys;
+    const char *psz_key = myth_Basename( p_recording->psz_urlBase );
+    char psz_slot[64];
+
+    if ( !*psz_key )
+        return;
+
+    sd_recording_t *p_entry = vlc_dictionary_value_for_key( &p_sys->items, psz_key );
+    if ( p_entry != kVLCDictionaryNotFound )
+    {
+        p_entry->i_generation = p_sys->i_generation;
+
+        bool b_item = SDItemChanged( p_entry->p_recording, p_recording );
+        if ( !b_item && p_entry->p_recording->i_fileSize == p_recording->i_fileSize
+          && p_entry->p_recording->i_chanId == p_recording->i_chanId )
+            return;
+
+        myth_recording_t *p_copy = myth_RecordingDup( p_recording );
+        if ( !p_copy )
+            return;
+
+        SDSlotKey( psz_slot, sizeof( psz_slot ), p_entry->p_recording->i_chanId, p_entry->p_recording->startTime );
+        vlc_dictionary_remove_value_for_key( &p_sys->slots, psz_slot, NULL, NULL );
+        SDSlotKey( psz_slot, sizeof( psz_slot ), p_copy->i_chanId, p_copy->startTime );
+        vlc_dictionary_insert( &p_sys->slots, psz_slot, p_entry );
+
+        if ( b_item )
+            SDSetItemMeta( p_entry->p_item, p_copy );
+
+        myth_RecordingDelete( p_entry->p_recording );
+        p_entry->p_recording = p_copy;
+    }
+    else
+    {
+        p_entry = malloc( sizeof( *p_entry ) );
+        if ( !p_entry )
+            return;
+
+        p_entry->p_recording = myth_RecordingDup( p_recording );
+        p_entry->p_item = p_entry->p_recording ? SDCreateItem( p_sd, p_recording ) : NULL;
+        if ( !p_entry->p_item )
+        {
+            if ( p_entry->p_recording )
+                myth_RecordingDelete( p_entry->p_recording );
+            free( p_entry );
+            return;
+        }
+        p_entry->i_generation = p_sys->i_generation;
+
+        vlc_dictionary_insert( &p_sys->items, psz_key, p_entry );
+        SDSlotKey( psz_slot, sizeof( psz_slot ), p_recording->i_chanId, p_recording->startTime );
+        vlc_dictionary_remove_value_for_key( &p_sys->slots, psz_slot, NULL, NULL );
+        vlc_dictionary_insert( &p_sys->slots, psz_slot, p_entry );
+    }
+
+    if ( p_sys->p_catalog )
+    {
+        vlc_mutex_lock( &myth_catalog_lock );
+        myth_CatalogInsert( p_sys->p_catalog, p_recording );
+        vlc_mutex_unlock( &myth_catalog_lock );
+    }
+}
+
+static void SDRemoveRecording( services_discovery_t *p_sd, sd_recording_t *p_entry )
+{
+    services_discovery_sys_t *p_sys  = p_sd->p_sys;
+    char *psz_key = strdup( myth_Basename( p_entry->p_recording->psz_urlBase ) );
+    char psz_slot[64];
+
+    if ( !psz_key )
+        return;
+
+    if ( p_sys->p_catalog )
+    {
+        vlc_mutex_lock( &myth_catalog_lock );
+        myth_CatalogRemove( p_sys->p_catalog, psz_key );
+        vlc_mutex_unlock( &myth_catalog_lock );
+    }
 
-    services_discovery_AddItem( p_sd, p_item, NULL );
-    //vlc_gc_decref( p_item );
+    services_discovery_RemoveItem( p_sd, p_entry->p_item );
 
-    vlc_array_append( p_sys->items, p_item );
+    SDSlotKey( psz_slot, sizeof( psz_slot ), p_entry->p_recording->i_chanId, p_entry->p_recording->startTime );
+    vlc_dictionary_remove_value_for_key( &p_sys->slots, psz_slot, NULL, NULL );
+    vlc_dictionary_remove_value_for_key( &p_sys->items, psz_key, SDDeleteRecording, NULL );
 
+    free( psz_key );
 }
 
+/* fetch the whole list and apply only what differs from the items we have */
 static int SDRefreshRecordings( services_discovery_t *p_sd )
 {
-    char *psz_params;
-    int i_len;
+    myth_reply_t reply = MYTH_REPLY_INIT;
     services_discovery_sys_t *p_sys  = p_sd->p_sys;
     
     msg_Dbg( p_sd, "SD Refresh Recordings" );
-    
-    for( int i = 0; i < p_sys->items->i_count; i++ )
+
+    if ( myth_ConnSend( VLC_OBJECT( p_sd ), p_sys->p_cmd, &reply, "QUERY_RECORDINGS Play" ) )
     {
-        input_item_t *p_item = p_sys->items->pp_elems[i];
-        services_discovery_RemoveItem( p_sd, p_item );
-        vlc_gc_decref( p_item );
+        myth_ReplyClean( &reply );
+        return VLC_EGENERIC;
     }
 
-    vlc_array_clear( p_sys->items );
+    p_sys->i_generation++;
 
-    if ( myth_Send( VLC_OBJECT( p_sd ), p_sys->fd_cmd, &i_len, &psz_params, "QUERY_RECORDINGS Play" ) )
+    int i_tokens = myth_count_tokens( &reply );
+    int i_rows = atoi( myth_token( &reply, 0 ) );
+    int i_fields = i_rows > 0 ? ( i_tokens - 1 ) / i_rows : 0;
+    for ( int i = 0; i < i_rows; i++ )
     {
-        return VLC_EGENERIC;
+        myth_recording_t recording = ParseRecording( p_sys->myth.version, &reply, 1 + i * i_fields );
+        SDApplyRecording( p_sd, &recording );
     }
 
-    int i_tokens = myth_count_tokens( psz_params, i_len );
-    int i_rows = atoi( myth_token( psz_params, i_len, 0 ) );
-    int i_fields = ( i_tokens - 1 ) / i_rows;
-    for ( int i = 0; i < i_rows; i++ )
+    myth_ReplyClean( &reply );
+
+    /* whatever the refresh did not see is gone from the backend */
+    char **ppsz_keys = vlc_dictionary_all_keys( &p_sys->items );
+    for ( int i = 0; ppsz_keys && ppsz_keys[i]; i++ )
     {
-        SDCreateItem( p_sd, i, i_fields, psz_params, i_len );
+        sd_recording_t *p_entry = vlc_dictionary_value_for_key( &p_sys->items, ppsz_keys[i] );
+        if ( p_entry != kVLCDictionaryNotFound && p_entry->i_generation != p_sys->i_generation )
+            SDRemoveRecording( p_sd, p_entry );
+        free( ppsz_keys[i] );
     }
+    free( ppsz_keys );
+
+    return VLC_SUCCESS;
+}
+
+/* RECORDING_LIST_CHANGE ADD <chanid> <starttime> */
+static int SDRecordingAdded( services_discovery_t *p_sd, const char *psz_slot, myth_reply_t *p_reply )
+{
+    services_discovery_sys_t *p_sys  = p_sd->p_sys;
+
+    if ( myth_ConnSend( VLC_OBJECT( p_sd ), p_sys->p_cmd, p_reply, "QUERY_RECORDING TIMESLOT %s", psz_slot ) )
+        return VLC_EGENERIC;
+
+    if ( !strncmp( myth_token( p_reply, 0 ), "ERROR", 6 ) )
+        return VLC_SUCCESS;
 
-    free( psz_params );
+    myth_recording_t recording = ParseRecording( p_sys->myth.version, p_reply, 1 );
+    SDApplyRecording( p_sd, &recording );
 
     return VLC_SUCCESS;
 }
 
+/* RECORDING_LIST_CHANGE DELETE <chanid> <starttime> */
+static int SDRecordingDeleted( services_discovery_t *p_sd, const char *psz_slot )
+{
+    services_discovery_sys_t *p_sys  = p_sd->p_sys;
+    char psz_time[32];
+    char psz_key[64];
+    int i_chanid;
+
+    if ( sscanf( psz_slot, "%d %31s", &i_chanid, psz_time ) == 2 )
+    {
+        SDSlotKey( psz_key, sizeof( psz_key ), i_chanid, SDParseTime( psz_time ) );
+
+        sd_recording_t *p_entry = vlc_dictionary_value_for_key( &p_sys->slots, psz_key );
+        if ( p_entry != kVLCDictionaryNotFound )
+        {
+            SDRemoveRecording( p_sd, p_entry );
+            return VLC_SUCCESS;
+        }
+    }
+
+    /* older backends name the slot in local time, find out by diffing */
+    msg_Dbg( p_sd, "Deleted recording %s not found, refreshing", psz_slot );
+    return SDRefreshRecordings( p_sd );
+}
+
 
 /*****************************************************************************
  * Run
@@ -1443,16 +4762,25 @@ static void *SDRun( void *data )
 
     parseURL( &p_sys->backend_url, psz_backendurl );
 
-    char *psz_params;
-    int i_len;
+    myth_reply_t reply = MYTH_REPLY_INIT;
 
-    p_sys->fd_cmd = myth_Connect( VLC_OBJECT( p_sd ), &p_sys->myth, &p_sys->backend_url, false );
+    p_sys->fd_cmd = myth_Connect( VLC_OBJECT( p_sd ), &p_sys->myth, &p_sys->backend_url, false, true, &p_sys->sock );
 
     if ( !p_sys->fd_cmd )
     {
         return NULL;
     }
 
+    p_sys->p_cmd = myth_PoolAcquire( VLC_OBJECT( p_sd ), &p_sys->backend_url );
+
+    if ( !p_sys->p_cmd )
+    {
+        return NULL;
+    }
+
+    /* not fatal, access opens just ask the backend themselves */
+    p_sys->p_catalog = myth_CatalogAcquire( &p_sys->backend_url );
+
     if ( SDRefreshRecordings( p_sd ) )
     {
         return NULL;
@@ -1462,37 +4790,46 @@ static void *SDRun( void *data )
     {
         vlc_restorecancel( canc );
 
-        if ( myth_ReadCommand( ( vlc_object_t * ) p_sd, p_sys->fd_cmd, &i_len, &psz_params ) )
+        if ( myth_ReadCommand( ( vlc_object_t * ) p_sd, &p_sys->sock, &reply ) )
         {
+            myth_ReplyClean( &reply );
             return NULL;
         }
         
         canc = vlc_savecancel();
 
-        if ( !strcmp( "BACKEND_MESSAGE", myth_token( psz_params, i_len, 0 ) ) )
+        if ( !strcmp( "BACKEND_MESSAGE", myth_token( &reply, 0 ) ) )
         {
-            msg_Info( ( vlc_object_t * ) p_sd, "BACKEND -> %s ; %s ; %s ; %s", myth_token( psz_params, i_len, 1 ), myth_token( psz_params, i_len, 2 ), myth_token( psz_params, i_len, 3 ), myth_token( psz_params, i_len, 4 ) );
-            char *psz_change = myth_token( psz_params, i_len, 1 );
-            if ( !strncmp( "RECORDING_LIST_CHANGE ADD", psz_change,  24 ) )
-            {
-                char* psz_query;
-                asprintf( &psz_query, "QUERY_RECORDING TIMESLOT%s", psz_change + 25 );
-
-                if ( myth_Send( VLC_OBJECT( p_sd ), p_sys->fd_cmd, &i_len, &psz_params, psz_query  ) )
-                {
-                    return NULL;
-                }
+            msg_Info( ( vlc_object_t * ) p_sd, "BACKEND -> %s ; %s ; %s ; %s", myth_token( &reply, 1 ), myth_token( &reply, 2 ), myth_token( &reply, 3 ), myth_token( &reply, 4 ) );
+            char *psz_change = myth_token( &reply, 1 );
+            int i_ret = VLC_SUCCESS;
 
-                free( psz_query );
-
-                SDCreateItem( p_sd, 0, myth_count_tokens( psz_params, i_len ) - 1, psz_params, i_len );
+            if ( !strncmp( "RECORDING_LIST_CHANGE ADD ", psz_change, 26 ) )
+            {
+                i_ret = SDRecordingAdded( p_sd, psz_change + 26, &reply );
+            }
+            else if ( !strncmp( "RECORDING_LIST_CHANGE DELETE ", psz_change, 29 ) )
+            {
+                i_ret = SDRecordingDeleted( p_sd, psz_change + 29 );
             }
-            else if ( !strncmp( "RECORDING_LIST_CHANGE DELETE", psz_change,  27 ) )
+            else if ( !strcmp( "RECORDING_LIST_CHANGE UPDATE", psz_change ) )
             {
+                /* the updated ProgramInfo follows the message */
+                myth_recording_t recording = ParseRecording( p_sys->myth.version, &reply, 2 );
+                SDApplyRecording( p_sd, &recording );
+            }
+            else if ( !strcmp( "RECORDING_LIST_CHANGE", psz_change ) )
+            {
+                i_ret = SDRefreshRecordings( p_sd );
+            }
 
+            if ( i_ret )
+            {
+                myth_ReplyClean( &reply );
+                return NULL;
             }
 
-            free( psz_params );
+            myth_ReplyClean( &reply );
         }
     }
     
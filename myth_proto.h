@@ -0,0 +1,558 @@
+/*****************************************************************************
+ * myth_proto.h: Myth protocol framing and ProgramInfo decoding
+ *****************************************************************************
+ * Copyright (C) 2001-2006 the VideoLAN team
+ * Copyright (C) 2009 Loune Lam
+ * $Id$
+ *
+ * Authors: Loune Lam <lpgcritter@nasquan.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Nothing in here depends on VLC. Bytes come in through a myth_read_t, so
+ * the parsers run over a socket in myth.c and over a memory buffer in
+ * tools/mythparse.c alike.
+ *****************************************************************************/
+#ifndef MYTH_PROTO_H
+#define MYTH_PROTO_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <time.h>
+
+#ifndef VLC_SUCCESS
+# define VLC_SUCCESS   0
+# define VLC_ENOMEM   -1
+# define VLC_EGENERIC -666
+#endif
+#ifdef __GNUC__
+# define MYTH_MAYBE_UNUSED __attribute__((unused))
+#else
+# define MYTH_MAYBE_UNUSED
+#endif
+#ifndef __MIN
+# define __MIN(a, b) ( ((a) < (b)) ? (a) : (b) )
+# define __MAX(a, b) ( ((a) > (b)) ? (a) : (b) )
+#endif
+
+/* ProgramInfo fields we decode, see myth_version_t.pi_fields */
+enum
+{
+    MYTH_FIELD_TITLE,
+    MYTH_FIELD_SUBTITLE,
+    MYTH_FIELD_DESCRIPTION,
+    MYTH_FIELD_GENRE,
+    MYTH_FIELD_CHANNEL_NAME,
+    MYTH_FIELD_CHANID,
+    MYTH_FIELD_URL,
+    MYTH_FIELD_FILESIZE,
+    MYTH_FIELD_START,
+    MYTH_FIELD_END,
+    MYTH_FIELD_COUNT
+};
+
+#define MYTH_FIELD( f ) ( 1 << MYTH_FIELD_##f )
+#define MYTH_FIELDS_ALL ( ( 1 << MYTH_FIELD_COUNT ) - 1 )
+
+typedef struct _myth_version_t
+{
+    const char *psz_version;
+    const int i_version;
+    const char *psz_token;
+
+    /* position of each MYTH_FIELD_* within a ProgramInfo */
+    const int pi_fields[MYTH_FIELD_COUNT];
+} myth_version_t;
+
+/* a reply read by myth_ReadCommand(), tokens are split on []:[] */
+typedef struct _myth_reply_t
+{
+    char       *psz_data;
+    int         i_len;
+    int         i_alloc;
+
+    int        *pi_tokens;  /* offset of each token in psz_data */
+    int         i_tokens;
+    int         i_tokens_alloc;
+} myth_reply_t;
+
+#define MYTH_REPLY_INIT { NULL, 0, 0, NULL, 0, 0 }
+
+/* buffered I/O over a command socket: one net_Read can bring in several
+ * frames, and a command is built in place behind its length header so it
+ * goes out with a single write */
+#define MYTH_READER_SIZE 16384
+#define MYTH_CMD_SIZE    256
+
+typedef struct _myth_socket_t
+{
+    int         fd;
+    char       *p_buffer;
+    int         i_start;    /* first byte not yet parsed */
+    int         i_end;      /* end of the received bytes */
+
+    char       *p_cmd;      /* command being built, header included */
+    int         i_cmd;
+    int         i_cmd_alloc;
+    bool        b_cmd_error;
+} myth_socket_t;
+
+/* reads at most i_len bytes of fd into p_buf, returns how many, <= 0 on error */
+typedef int (*myth_read_t)( void *p_opaque, int fd, void *p_buf, int i_len );
+
+typedef struct _myth_recording_t
+{
+    char *psz_title;
+    char *psz_subtitle;
+    char *psz_description;
+    char *psz_genre;
+    char *psz_urlBase;
+    char *psz_url;
+
+    char *psz_season;
+    char *psz_episode;
+    char *psz_category;
+    char *psz_chanNum;
+    char *psz_channelCallSign;
+    char *psz_channelName;
+    int i_chanId;
+    int64_t i_fileSize;
+
+    time_t scheduledStartTime;
+    time_t startTime;
+    time_t endTime;
+    int64_t duration;
+} myth_recording_t;
+
+/* ProgramInfo positions of title, subtitle, description, genre, channel,
+ * chanid, url, filesize, start and end */
+static myth_version_t myth_version_24 = { "0.24", 63, "3875641D",  { 0, 1, 2, 3, 7, 4, 8, 9, 23, 24 } };
+static myth_version_t myth_version_25 = { "0.25", 72, "D78EFD6F",  { 0, 1, 2, 5, 9, 6, 10, 11, 25, 26 } };
+static myth_version_t myth_version_26 = { "0.26", 75, "SweetRock", { 0, 1, 2, 5, 9, 6, 10, 11, 25, 26 } };
+static myth_version_t myth_version_27 = { "0.27", 77, "WindMark",  { 0, 1, 2, 6, 10, 7, 11, 12, 26, 27 } };
+static myth_version_t *myth_versions[] MYTH_MAYBE_UNUSED = {
+    &myth_version_24, &myth_version_25, &myth_version_26, &myth_version_27 };
+
+static inline void myth_ReplyClean( myth_reply_t *p_reply )
+{
+    free( p_reply->psz_data );
+    free( p_reply->pi_tokens );
+    *p_reply = (myth_reply_t) MYTH_REPLY_INIT;
+}
+
+static inline int myth_SocketInit( myth_socket_t *p_sock, int fd )
+{
+    p_sock->fd = fd;
+    p_sock->i_start = 0;
+    p_sock->i_end = 0;
+    p_sock->p_buffer = malloc( MYTH_READER_SIZE );
+
+    p_sock->i_cmd = 0;
+    p_sock->i_cmd_alloc = MYTH_CMD_SIZE;
+    p_sock->b_cmd_error = false;
+    p_sock->p_cmd = malloc( MYTH_CMD_SIZE );
+
+    if ( !p_sock->p_buffer || !p_sock->p_cmd )
+    {
+        free( p_sock->p_buffer );
+        free( p_sock->p_cmd );
+        p_sock->p_buffer = NULL;
+        p_sock->p_cmd = NULL;
+        return VLC_ENOMEM;
+    }
+
+    return VLC_SUCCESS;
+}
+
+static inline void myth_SocketClean( myth_socket_t *p_sock )
+{
+    free( p_sock->p_buffer );
+    free( p_sock->p_cmd );
+    p_sock->p_buffer = NULL;
+    p_sock->p_cmd = NULL;
+}
+
+/*****************************************************************************
+ * Command builder: fields are appended after room for the length header
+ *****************************************************************************/
+static inline void myth_CmdReset( myth_socket_t *p_sock )
+{
+    p_sock->i_cmd = 8;
+    p_sock->b_cmd_error = false;
+}
+
+static inline char *myth_CmdReserve( myth_socket_t *p_sock, int i_size )
+{
+    if ( p_sock->i_cmd + i_size > p_sock->i_cmd_alloc )
+    {
+        int i_alloc = __MAX( 2 * p_sock->i_cmd_alloc, p_sock->i_cmd + i_size );
+        char *p_cmd = realloc( p_sock->p_cmd, i_alloc );
+        if ( !p_cmd )
+        {
+            p_sock->b_cmd_error = true;
+            return NULL;
+        }
+        p_sock->p_cmd = p_cmd;
+        p_sock->i_cmd_alloc = i_alloc;
+    }
+
+    return p_sock->p_cmd + p_sock->i_cmd;
+}
+
+static inline void myth_CmdString( myth_socket_t *p_sock, const char *psz )
+{
+    int i_len = strlen( psz );
+    char *p = myth_CmdReserve( p_sock, i_len );
+    if ( !p )
+        return;
+
+    memcpy( p, psz, i_len );
+    p_sock->i_cmd += i_len;
+}
+
+static inline void myth_CmdSep( myth_socket_t *p_sock )
+{
+    myth_CmdString( p_sock, "[]:[]" );
+}
+
+static inline void myth_CmdInt( myth_socket_t *p_sock, int64_t i_value )
+{
+    char *p = myth_CmdReserve( p_sock, 21 );
+    if ( !p )
+        return;
+
+    p_sock->i_cmd += sprintf( p, "%"PRId64, i_value );
+}
+
+static inline void myth_CmdVPrintf( myth_socket_t *p_sock, const char *psz_fmt, va_list args )
+{
+    va_list args_copy;
+    int i_room = p_sock->i_cmd_alloc - p_sock->i_cmd;
+
+    va_copy( args_copy, args );
+    int i_len = vsnprintf( p_sock->p_cmd + p_sock->i_cmd, i_room, psz_fmt, args_copy );
+    va_end( args_copy );
+
+    if ( i_len < 0 )
+    {
+        p_sock->b_cmd_error = true;
+        return;
+    }
+
+    if ( i_len >= i_room )
+    {
+        /* too long for the buffer, grow it and format again */
+        if ( !myth_CmdReserve( p_sock, i_len + 1 ) )
+            return;
+        vsnprintf( p_sock->p_cmd + p_sock->i_cmd, i_len + 1, psz_fmt, args );
+    }
+
+    p_sock->i_cmd += i_len;
+}
+
+/*****************************************************************************
+ * Frame reader: an 8 character length, then the tokens separated by []:[]
+ *****************************************************************************/
+
+/* pull whatever the socket has, at least one byte */
+static inline int myth_SocketFill( myth_socket_t *p_sock, myth_read_t pf_read, void *p_opaque )
+{
+    if ( p_sock->i_start > 0 )
+    {
+        memmove( p_sock->p_buffer, p_sock->p_buffer + p_sock->i_start,
+                 p_sock->i_end - p_sock->i_start );
+        p_sock->i_end -= p_sock->i_start;
+        p_sock->i_start = 0;
+    }
+
+    int i_read = pf_read( p_opaque, p_sock->fd, p_sock->p_buffer + p_sock->i_end,
+                          MYTH_READER_SIZE - p_sock->i_end );
+    if ( i_read <= 0 )
+        return VLC_EGENERIC;
+
+    p_sock->i_end += i_read;
+
+    return VLC_SUCCESS;
+}
+
+/* read one frame into p_reply and split it into tokens */
+static inline int myth_ReadFrame( myth_socket_t *p_sock, myth_reply_t *p_reply, myth_read_t pf_read, void *p_opaque )
+{
+    /* read length */
+    char lenstr[9];
+    int i_Read = 0;
+    int i_TotalRead = 0;
+
+    assert( p_sock->fd != -1 );
+
+    p_reply->i_len = 0;
+    p_reply->i_tokens = 0;
+
+    while( p_sock->i_end - p_sock->i_start < 8 )
+    {
+        if( myth_SocketFill( p_sock, pf_read, p_opaque ) )
+            return VLC_EGENERIC;
+    }
+
+    memcpy( lenstr, p_sock->p_buffer + p_sock->i_start, 8 );
+    lenstr[8] = '\0';
+    p_sock->i_start += 8;
+
+    int len = atoi( lenstr );
+
+    if( len < 0 )
+        return VLC_EGENERIC;
+
+    /* the reply keeps its buffers between calls, only grow them */
+    if( len + 1 > p_reply->i_alloc )
+    {
+        char *psz_data = realloc( p_reply->psz_data, len + 1 );
+        if( !psz_data )
+            return VLC_ENOMEM;
+        p_reply->psz_data = psz_data;
+        p_reply->i_alloc = len + 1;
+    }
+
+    char *psz_line = p_reply->psz_data;
+    psz_line[len] = '\0';
+
+    /* take what is already buffered, then read the rest of a large frame
+     * straight into the reply */
+    i_TotalRead = __MIN( len, p_sock->i_end - p_sock->i_start );
+    memcpy( psz_line, p_sock->p_buffer + p_sock->i_start, i_TotalRead );
+    p_sock->i_start += i_TotalRead;
+    if( p_sock->i_start == p_sock->i_end )
+        p_sock->i_start = p_sock->i_end = 0;
+
+    while( i_TotalRead < len )
+    {
+        if ((i_Read = pf_read( p_opaque, p_sock->fd, psz_line + i_TotalRead, len - i_TotalRead )) <= 0)
+            return VLC_EGENERIC;
+        i_TotalRead += i_Read;
+    }
+
+    /* post process the final string and add \0 to the end of each token sp []:[] becomes \0]:[],
+     * remembering where each token starts */
+    int i_tokens = 0;
+    int i_start = 0;
+    char *cend = psz_line + len;
+    for( char *c = psz_line; ; c++ )
+    {
+        if( c - psz_line == i_start )
+        {
+            if( i_tokens == p_reply->i_tokens_alloc )
+            {
+                int i_alloc = __MAX( 16, 2 * p_reply->i_tokens_alloc );
+                int *pi_tokens = realloc( p_reply->pi_tokens, i_alloc * sizeof( int ) );
+                if( !pi_tokens )
+                    return VLC_ENOMEM;
+                p_reply->pi_tokens = pi_tokens;
+                p_reply->i_tokens_alloc = i_alloc;
+            }
+            p_reply->pi_tokens[i_tokens++] = i_start;
+        }
+
+        if( c >= cend )
+            break;
+
+        if (*c == '['
+            && c+1 < cend && c[1] == ']'
+            && c+2 < cend && c[2] == ':'
+            && c+3 < cend && c[3] == '['
+            && c+4 < cend && c[4] == ']')
+        {
+            *c = '\0';
+            i_start = c + 5 - psz_line;
+            c += 4;
+        }
+    }
+
+    p_reply->i_len = len;
+    p_reply->i_tokens = i_tokens;
+
+    return VLC_SUCCESS;
+}
+
+static inline char* myth_token( myth_reply_t *p_reply, int i_index )
+{
+    if ( i_index < 0 || i_index >= p_reply->i_tokens )
+        return NULL;
+
+    return p_reply->psz_data + p_reply->pi_tokens[i_index];
+}
+
+static inline int myth_count_tokens( myth_reply_t *p_reply )
+{
+    return p_reply->i_tokens;
+}
+
+/* decode the fields in i_mask of the ProgramInfo starting at token i_offset */
+static inline void myth_DecodeRecording( myth_version_t *version, myth_reply_t *p_reply, int i_offset, int i_mask, myth_recording_t *p_recording )
+{
+    for ( int i_field = 0; i_field < MYTH_FIELD_COUNT; i_field++ )
+    {
+        if ( !( i_mask & ( 1 << i_field ) ) )
+            continue;
+
+        char *psz = myth_token( p_reply, i_offset + version->pi_fields[i_field] );
+        if ( !psz )
+            psz = (char *) "";
+
+        switch ( i_field )
+        {
+            case MYTH_FIELD_TITLE:        p_recording->psz_title = psz; break;
+            case MYTH_FIELD_SUBTITLE:     p_recording->psz_subtitle = psz; break;
+            case MYTH_FIELD_DESCRIPTION:  p_recording->psz_description = psz; break;
+            case MYTH_FIELD_GENRE:        p_recording->psz_genre = psz; break;
+            case MYTH_FIELD_CHANNEL_NAME: p_recording->psz_channelName = psz; break;
+            case MYTH_FIELD_CHANID:       p_recording->i_chanId = atoi( psz ); break;
+            case MYTH_FIELD_URL:          p_recording->psz_urlBase = psz; break;
+            case MYTH_FIELD_FILESIZE:     p_recording->i_fileSize = atoll( psz ); break;
+            case MYTH_FIELD_START:        p_recording->startTime = atoll( psz ); break;
+            case MYTH_FIELD_END:          p_recording->endTime = atoll( psz ); break;
+        }
+    }
+}
+
+static inline myth_recording_t ParseRecording( myth_version_t* version, myth_reply_t *p_reply, int i_offset )
+{
+    myth_recording_t recording;
+    memset( &recording, 0, sizeof( recording ) );
+
+    myth_DecodeRecording( version, p_reply, i_offset, MYTH_FIELDS_ALL, &recording );
+
+    recording.duration = recording.endTime - recording.startTime;
+
+    return recording;
+}
+
+/*****************************************************************************
+ * Session traces, written by myth.c with myth-trace set and replayed by
+ * tools/mythfake.c. After the 8 byte MYTH_TRACE_MAGIC each record is a
+ * kind byte and three varints: microseconds since the previous record, the
+ * socket and a length. START, SEND and RECV carry that many bytes, the
+ * frame without its length header for SEND and RECV, the wall clock in
+ * microseconds as a varint for START. DATA only gives the size of a data
+ * socket read, 0 when it failed.
+ *****************************************************************************/
+#define MYTH_TRACE_MAGIC    "MYTHTRC1"
+#define MYTH_TRACE_HEAD_MAX ( 1 + 3 * 10 )
+
+enum
+{
+    MYTH_TRACE_START = 1,   /* a process started recording */
+    MYTH_TRACE_SEND,        /* command frame written */
+    MYTH_TRACE_RECV,        /* reply or event frame read */
+    MYTH_TRACE_DATA,        /* data socket read */
+};
+
+typedef struct _myth_trace_record_t
+{
+    int         i_kind;
+    uint64_t    i_delta;
+    int         fd;
+    uint64_t    i_len;
+    const uint8_t *p_data;  /* NULL for DATA */
+} myth_trace_record_t;
+
+static inline size_t myth_TraceVarint( uint8_t *p, uint64_t i_value )
+{
+    size_t i = 0;
+
+    while ( i_value >= 0x80 )
+    {
+        p[i++] = ( i_value & 0x7f ) | 0x80;
+        i_value >>= 7;
+    }
+    p[i++] = i_value;
+
+    return i;
+}
+
+/* returns how many bytes the varint took, 0 when it is cut short */
+static inline size_t myth_TraceGetVarint( const uint8_t *p, size_t i_size, uint64_t *pi_value )
+{
+    uint64_t i_value = 0;
+
+    for ( size_t i = 0; i < i_size && i < 10; i++ )
+    {
+        i_value |= (uint64_t) ( p[i] & 0x7f ) << ( 7 * i );
+        if ( !( p[i] & 0x80 ) )
+        {
+            *pi_value = i_value;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* the header of a record into p, MYTH_TRACE_HEAD_MAX bytes at most */
+static inline size_t myth_TraceHeader( uint8_t *p, int i_kind, uint64_t i_delta, int fd, uint64_t i_len )
+{
+    size_t i = 0;
+
+    p[i++] = i_kind;
+    i += myth_TraceVarint( p + i, i_delta );
+    i += myth_TraceVarint( p + i, fd );
+    i += myth_TraceVarint( p + i, i_len );
+
+    return i;
+}
+
+/* decode the record at the start of p, returns its whole length, 0 at the
+ * end of the trace or when it is cut short */
+static inline size_t myth_TraceRecord( const uint8_t *p, size_t i_size, myth_trace_record_t *p_rec )
+{
+    uint64_t i_fd;
+    size_t i = 1, i_used;
+
+    if ( i_size < 1 || p[0] < MYTH_TRACE_START || p[0] > MYTH_TRACE_DATA )
+        return 0;
+    p_rec->i_kind = p[0];
+
+    if ( !( i_used = myth_TraceGetVarint( p + i, i_size - i, &p_rec->i_delta ) ) )
+        return 0;
+    i += i_used;
+    if ( !( i_used = myth_TraceGetVarint( p + i, i_size - i, &i_fd ) ) )
+        return 0;
+    i += i_used;
+    if ( !( i_used = myth_TraceGetVarint( p + i, i_size - i, &p_rec->i_len ) ) )
+        return 0;
+    i += i_used;
+    p_rec->fd = i_fd;
+
+    if ( p_rec->i_kind == MYTH_TRACE_DATA )
+    {
+        p_rec->p_data = NULL;
+        return i;
+    }
+
+    if ( p_rec->i_len > i_size - i )
+        return 0;
+    p_rec->p_data = p + i;
+
+    return i + p_rec->i_len;
+}
+
+#endif
@@ -0,0 +1,1047 @@
+/*****************************************************************************
+ * mythbench.c: end-to-end benchmark of the myth access against mythfake
+ *****************************************************************************
+ * Copyright (C) 2013 Loune Lam
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * For each protocol version a mythfake accepting only that version is
+ * started, then a recording is played through libvlc and the plugin:
+ *  - once from start to end, for the time to the Playing event, the time
+ *    to the first data byte sent, and the throughput up to the end
+ *  - once with random seeks, each timed from set_position() to the first
+ *    byte mythfake sends near the new position
+ * The byte-level timings come from the trace mythfake writes with -t, both
+ * sides use CLOCK_MONOTONIC.
+ *
+ * With -r a session recorded with --myth-trace is replayed instead: mythfake
+ * answers as the backend did then, the recording is opened again and the
+ * seeks found in the trace are repeated at the same times, or each as soon
+ * as the previous one is done with -x.
+ *
+ * With -R the plugin reaches mythfake through mythproxy instead, once for
+ * each round-trip time listed, and plays a few scenarios at each:
+ *  - sequential playback, for the throughput and the mean granted
+ *    REQUEST_BLOCK, which shows how far pipelining hides the round-trip
+ *  - the random seeks above
+ *  - scrubbing, positions set in quick succession as a seek bar dragged
+ *    does, timed from the last one to the first byte near its target
+ *  - pause and resume, timed from the resume until the input reads again
+ *****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <vlc/vlc.h>
+
+#include "../myth_proto.h"
+
+#define EVENT_TIMEOUT  (10 * 1000000)
+#define SEEK_TIMEOUT   (5 * 1000000)
+#define SEEK_WINDOW    (2 * 1024 * 1024)    /* demuxers align seeks a little */
+#define SEEK_JUMP      (16 * 1024 * 1024)   /* farther than striped fetching reaches */
+#define SCRUB_STEPS    10
+#define SCRUB_INTERVAL (150 * 1000)
+#define PAUSE_AFTER    (500 * 1000)
+#define PAUSE_TIME     (5 * 1000000)
+
+static const int versions[] = { 63, 72, 75, 77 };
+
+static struct
+{
+    const char *psz_fake;
+    int         i_port;
+    int         i_size_mb;
+    int         i_seeks;
+    int         i_stripes;
+    int         i_version;      /* 0 for all */
+    const char *psz_replay;
+    bool        b_fast;
+    const char *psz_proxy;
+    const char *psz_rtts;       /* NULL for no sweep */
+    const char *psz_impair;     /* more impairments for both connections */
+} opt = { "./mythfake", 16543, 1024, 50, 1, 0, NULL, false, "./mythproxy", NULL, NULL };
+
+/* where the player connects, mythfake or mythproxy in front of it */
+static int i_player_port;
+
+static int64_t Now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*****************************************************************************
+ * mythfake trace, read on a thread and waited for by the benchmark
+ *****************************************************************************/
+typedef struct
+{
+    int64_t     i_time;
+    uint64_t    i_pos;
+} data_event_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  wait;
+    data_event_t   *p_data;     /* "data" events, in order */
+    int             i_data;
+    int             i_alloc;
+    int             i_blocks;   /* REQUEST_BLOCKs answered */
+    uint64_t        i_granted;
+    bool            b_listening;
+    bool            b_eof;
+
+    /* libvlc events */
+    int64_t         i_playing;
+    int64_t         i_end;
+    bool            b_error;
+} trace = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, false, false, 0, 0, false };
+
+static void *TraceThread( void *data )
+{
+    FILE *p_file = data;
+    char psz_line[512];
+
+    while ( fgets( psz_line, sizeof( psz_line ), p_file ) )
+    {
+        int64_t i_time, i_want;
+        int i_id;
+        uint64_t i_pos;
+
+        pthread_mutex_lock( &trace.lock );
+        if ( sscanf( psz_line, "%"SCNd64" data %d %"SCNu64, &i_time, &i_id, &i_pos ) == 3 )
+        {
+            if ( trace.i_data == trace.i_alloc )
+            {
+                trace.i_alloc = trace.i_alloc ? 2 * trace.i_alloc : 256;
+                trace.p_data = realloc( trace.p_data, trace.i_alloc * sizeof( *trace.p_data ) );
+                if ( !trace.p_data )
+                    abort();
+            }
+            trace.p_data[trace.i_data].i_time = i_time;
+            trace.p_data[trace.i_data].i_pos = i_pos;
+            trace.i_data++;
+        }
+        else if ( sscanf( psz_line, "%"SCNd64" block %d %"SCNd64" %"SCNu64, &i_time, &i_id, &i_want, &i_pos ) == 4 )
+        {
+            trace.i_blocks++;
+            trace.i_granted += i_pos;
+        }
+        else if ( strstr( psz_line, " listening " ) )
+        {
+            trace.b_listening = true;
+        }
+        pthread_cond_broadcast( &trace.wait );
+        pthread_mutex_unlock( &trace.lock );
+    }
+
+    pthread_mutex_lock( &trace.lock );
+    trace.b_eof = true;
+    pthread_cond_broadcast( &trace.wait );
+    pthread_mutex_unlock( &trace.lock );
+
+    fclose( p_file );
+
+    return NULL;
+}
+
+static void TraceReset( void )
+{
+    pthread_mutex_lock( &trace.lock );
+    trace.i_data = 0;
+    trace.i_blocks = 0;
+    trace.i_granted = 0;
+    trace.i_playing = 0;
+    trace.i_end = 0;
+    trace.b_error = false;
+    pthread_mutex_unlock( &trace.lock );
+}
+
+static bool TraceWait( int64_t i_deadline )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    int64_t i_real = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + ( i_deadline - Now() );
+
+    ts.tv_sec = i_real / 1000000;
+    ts.tv_nsec = ( i_real % 1000000 ) * 1000;
+
+    return pthread_cond_timedwait( &trace.wait, &trace.lock, &ts ) != ETIMEDOUT
+        || Now() < i_deadline;
+}
+
+/* time of the first data event from i_first on sent at or after i_since and
+ * within SEEK_WINDOW of i_target, 0 on timeout */
+static int64_t WaitData( int i_first, int64_t i_since, int64_t i_target, int64_t i_deadline )
+{
+    int64_t i_time = 0;
+
+    pthread_mutex_lock( &trace.lock );
+    for ( int i = i_first; !i_time && !trace.b_eof && !trace.b_error; )
+    {
+        for ( ; i < trace.i_data && !i_time; i++ )
+        {
+            data_event_t *p = &trace.p_data[i];
+            if ( p->i_time >= i_since
+              && ( i_target < 0 || llabs( (long long) p->i_pos - i_target ) <= SEEK_WINDOW ) )
+                i_time = p->i_time;
+        }
+        if ( !i_time && !TraceWait( i_deadline ) )
+            break;
+    }
+    pthread_mutex_unlock( &trace.lock );
+
+    return i_time;
+}
+
+/*****************************************************************************
+ * mythfake process
+ *****************************************************************************/
+/* a version to serve synthetic recordings with, or 0 to replay */
+static pid_t FakeStart( int i_version )
+{
+    int pi_pipe[2];
+    char psz_port[16], psz_version[16], psz_size[16];
+    pthread_t thread;
+
+    if ( pipe( pi_pipe ) )
+        return -1;
+
+    snprintf( psz_port, sizeof( psz_port ), "%d", opt.i_port );
+    snprintf( psz_version, sizeof( psz_version ), "%d", i_version );
+    snprintf( psz_size, sizeof( psz_size ), "%d", opt.i_size_mb );
+
+    const char *ppsz_argv[] = { opt.psz_fake, "-t", "-p", psz_port, "-V", psz_version,
+                                "-n", "1", "-s", psz_size, NULL };
+    const char *ppsz_replay[] = { opt.psz_fake, "-t", "-p", psz_port, "-r", opt.psz_replay,
+                                  opt.b_fast ? "-x" : NULL, NULL };
+
+    pid_t pid = fork();
+    if ( pid == 0 )
+    {
+        /* stdin would forward our terminal as backend messages */
+        int fd_null = open( "/dev/null", O_RDONLY );
+        dup2( fd_null, STDIN_FILENO );
+        dup2( pi_pipe[1], STDOUT_FILENO );
+        close( pi_pipe[0] );
+        close( pi_pipe[1] );
+        execv( opt.psz_fake, (char **) ( i_version ? ppsz_argv : ppsz_replay ) );
+        perror( "mythbench: exec mythfake" );
+        _exit( 127 );
+    }
+    close( pi_pipe[1] );
+
+    if ( pid < 0 )
+    {
+        close( pi_pipe[0] );
+        return -1;
+    }
+
+    pthread_mutex_lock( &trace.lock );
+    trace.b_listening = false;
+    trace.b_eof = false;
+    pthread_mutex_unlock( &trace.lock );
+
+    pthread_create( &thread, NULL, TraceThread, fdopen( pi_pipe[0], "r" ) );
+    pthread_detach( thread );
+
+    /* wait until it accepts connections */
+    int64_t i_deadline = Now() + EVENT_TIMEOUT;
+    pthread_mutex_lock( &trace.lock );
+    while ( !trace.b_listening && !trace.b_eof && TraceWait( i_deadline ) )
+        ;
+    bool b_ok = trace.b_listening;
+    pthread_mutex_unlock( &trace.lock );
+
+    if ( !b_ok )
+    {
+        kill( pid, SIGTERM );
+        waitpid( pid, NULL, 0 );
+        return -1;
+    }
+
+    return pid;
+}
+
+static void FakeStop( pid_t pid )
+{
+    kill( pid, SIGTERM );
+    waitpid( pid, NULL, 0 );
+
+    /* the trace thread ends with the pipe */
+    pthread_mutex_lock( &trace.lock );
+    while ( !trace.b_eof )
+        pthread_cond_wait( &trace.wait, &trace.lock );
+    pthread_mutex_unlock( &trace.lock );
+}
+
+/*****************************************************************************
+ * mythproxy process
+ *****************************************************************************/
+static bool ProxyReady( int i_port )
+{
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( i_port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    bool b_ready = fd >= 0 && !connect( fd, (struct sockaddr *) &addr, sizeof( addr ) );
+    if ( fd >= 0 )
+        close( fd );
+
+    return b_ready;
+}
+
+/* listens on the port after mythfake's, with the round-trip time added to
+ * both kinds of connection */
+static pid_t ProxyStart( int i_rtt )
+{
+    char psz_port[16], psz_backend[32], psz_impair[256];
+
+    snprintf( psz_port, sizeof( psz_port ), "%d", opt.i_port + 1 );
+    snprintf( psz_backend, sizeof( psz_backend ), "127.0.0.1:%d", opt.i_port );
+    snprintf( psz_impair, sizeof( psz_impair ), "rtt=%d%s%s", i_rtt,
+              opt.psz_impair ? "," : "", opt.psz_impair ? opt.psz_impair : "" );
+
+    const char *ppsz_argv[] = { opt.psz_proxy, "-l", psz_port, "-b", psz_backend,
+                                "-c", psz_impair, "-d", psz_impair, NULL };
+
+    pid_t pid = fork();
+    if ( pid == 0 )
+    {
+        int fd_null = open( "/dev/null", O_RDONLY );
+        dup2( fd_null, STDIN_FILENO );
+        execv( opt.psz_proxy, (char **) ppsz_argv );
+        perror( "mythbench: exec mythproxy" );
+        _exit( 127 );
+    }
+    if ( pid < 0 )
+        return -1;
+
+    /* a probe connection reaches mythfake too, which drops it unannounced */
+    for ( int64_t i_deadline = Now() + EVENT_TIMEOUT; !ProxyReady( opt.i_port + 1 ); usleep( 10000 ) )
+    {
+        if ( Now() > i_deadline || waitpid( pid, NULL, WNOHANG ) == pid )
+        {
+            kill( pid, SIGTERM );
+            waitpid( pid, NULL, 0 );
+            return -1;
+        }
+    }
+
+    return pid;
+}
+
+static void ProxyStop( pid_t pid )
+{
+    kill( pid, SIGTERM );
+    waitpid( pid, NULL, 0 );
+}
+
+/*****************************************************************************
+ * playback
+ *****************************************************************************/
+static void OnEvent( const libvlc_event_t *p_event, void *data )
+{
+    (void) data;
+
+    pthread_mutex_lock( &trace.lock );
+    switch ( p_event->type )
+    {
+        case libvlc_MediaPlayerPlaying:
+            if ( !trace.i_playing )
+                trace.i_playing = Now();
+            break;
+        case libvlc_MediaPlayerEndReached:
+            trace.i_end = Now();
+            break;
+        case libvlc_MediaPlayerEncounteredError:
+            trace.b_error = true;
+            break;
+    }
+    pthread_cond_broadcast( &trace.wait );
+    pthread_mutex_unlock( &trace.lock );
+}
+
+static libvlc_media_player_t *PlayerStart( libvlc_instance_t *p_vlc, const char *psz_path, int64_t *pi_start )
+{
+    char psz_url[256];
+
+    snprintf( psz_url, sizeof( psz_url ), "myth://127.0.0.1:%d%s", i_player_port, psz_path );
+
+    libvlc_media_t *p_media = libvlc_media_new_location( p_vlc, psz_url );
+    if ( !p_media )
+        return NULL;
+    libvlc_media_add_option( p_media, ":demux=ts" );
+
+    libvlc_media_player_t *p_mp = libvlc_media_player_new_from_media( p_media );
+    libvlc_media_release( p_media );
+    if ( !p_mp )
+        return NULL;
+
+    libvlc_event_manager_t *p_em = libvlc_media_player_event_manager( p_mp );
+    libvlc_event_attach( p_em, libvlc_MediaPlayerPlaying, OnEvent, NULL );
+    libvlc_event_attach( p_em, libvlc_MediaPlayerEndReached, OnEvent, NULL );
+    libvlc_event_attach( p_em, libvlc_MediaPlayerEncounteredError, OnEvent, NULL );
+
+    TraceReset();
+    *pi_start = Now();
+    if ( libvlc_media_player_play( p_mp ) )
+    {
+        libvlc_media_player_release( p_mp );
+        return NULL;
+    }
+
+    return p_mp;
+}
+
+static void PlayerStop( libvlc_media_player_t *p_mp )
+{
+    libvlc_media_player_stop( p_mp );
+    libvlc_media_player_release( p_mp );
+}
+
+static int CompareTime( const void *a, const void *b )
+{
+    int64_t i_a = *(const int64_t *) a, i_b = *(const int64_t *) b;
+    return ( i_a > i_b ) - ( i_a < i_b );
+}
+
+/* the recording from start to end, times are 0 when not reached */
+static int PlayThrough( libvlc_instance_t *p_vlc, int64_t *pi_start, int64_t *pi_playing,
+                        int64_t *pi_first, int64_t *pi_end )
+{
+    libvlc_media_player_t *p_mp = PlayerStart( p_vlc, "/bench_0000.ts", pi_start );
+    if ( !p_mp )
+        return -1;
+
+    *pi_first = WaitData( 0, *pi_start, -1, *pi_start + EVENT_TIMEOUT );
+
+    pthread_mutex_lock( &trace.lock );
+    while ( !trace.i_end && !trace.b_error && !trace.b_eof )
+        pthread_cond_wait( &trace.wait, &trace.lock );
+    *pi_playing = trace.i_playing;
+    *pi_end = trace.i_end;
+    pthread_mutex_unlock( &trace.lock );
+
+    PlayerStop( p_mp );
+
+    return 0;
+}
+
+/* opt.i_seeks random seeks, each timed from set_position() to the first byte
+ * near the target. Returns how many were timed, sorted into pi_seek */
+static int SeekRun( libvlc_instance_t *p_vlc, int64_t *pi_seek, int *pi_missed )
+{
+    uint64_t i_size = (uint64_t) opt.i_size_mb * 1024 * 1024;
+    int64_t i_start;
+    int i_seeks = 0;
+
+    libvlc_media_player_t *p_mp = PlayerStart( p_vlc, "/bench_0000.ts", &i_start );
+    if ( !p_mp )
+        return 0;
+
+    WaitData( 0, i_start, -1, i_start + EVENT_TIMEOUT );
+
+    for ( int i = 0; i < opt.i_seeks; i++ )
+    {
+        float f_pos = 0.05f + 0.85f * rand() / (float) RAND_MAX;
+
+        pthread_mutex_lock( &trace.lock );
+        int i_first_event = trace.i_data;
+        bool b_over = trace.i_end || trace.b_error;
+        pthread_mutex_unlock( &trace.lock );
+        if ( b_over )
+            break;
+
+        int64_t i_seek = Now();
+        libvlc_media_player_set_position( p_mp, f_pos );
+
+        int64_t i_data = WaitData( i_first_event, i_seek, (int64_t) ( f_pos * i_size ), i_seek + SEEK_TIMEOUT );
+        if ( i_data )
+            pi_seek[i_seeks++] = i_data - i_seek;
+        else
+            (*pi_missed)++;
+
+        usleep( 100000 );
+    }
+
+    PlayerStop( p_mp );
+
+    qsort( pi_seek, i_seeks, sizeof( *pi_seek ), CompareTime );
+
+    return i_seeks;
+}
+
+static void PrintTime( int64_t i_time )
+{
+    if ( i_time > 0 )
+        printf( " %8.1f", i_time / 1000.0 );
+    else
+        printf( " %8s", "-" );
+}
+
+static void PrintPercentiles( const int64_t *pi_seek, int i_seeks )
+{
+    if ( i_seeks > 0 )
+        printf( " %8.1f %8.1f", pi_seek[( i_seeks - 1 ) * 50 / 100] / 1000.0,
+                                pi_seek[( i_seeks - 1 ) * 99 / 100] / 1000.0 );
+    else
+        printf( " %8s %8s", "-", "-" );
+}
+
+static void PrintRate( int64_t i_first, int64_t i_end )
+{
+    if ( i_first && i_end > i_first )
+        printf( " %8.1f", opt.i_size_mb / ( ( i_end - i_first ) / 1000000.0 ) );
+    else
+        printf( " %8s", "-" );
+}
+
+static int Benchmark( libvlc_instance_t *p_vlc, int i_version )
+{
+    int64_t i_start = 0, i_first = 0, i_playing = 0, i_end = 0;
+
+    pid_t pid = FakeStart( i_version );
+    if ( pid < 0 )
+    {
+        fprintf( stderr, "mythbench: unable to start %s\n", opt.psz_fake );
+        return -1;
+    }
+
+    if ( PlayThrough( p_vlc, &i_start, &i_playing, &i_first, &i_end ) )
+    {
+        FakeStop( pid );
+        return -1;
+    }
+
+    int64_t *pi_seek = calloc( opt.i_seeks, sizeof( *pi_seek ) );
+    int i_seeks = 0, i_missed = 0;
+    if ( pi_seek )
+        i_seeks = SeekRun( p_vlc, pi_seek, &i_missed );
+
+    FakeStop( pid );
+
+    printf( "%-8d", i_version );
+    PrintTime( i_playing ? i_playing - i_start : 0 );
+    PrintTime( i_first ? i_first - i_start : 0 );
+    PrintRate( i_first, i_end );
+    PrintPercentiles( pi_seek, i_seeks );
+    printf( " %6d\n", i_missed );
+    fflush( stdout );
+
+    free( pi_seek );
+
+    return 0;
+}
+
+/*****************************************************************************
+ * scenarios behind mythproxy
+ *****************************************************************************/
+/* positions set every SCRUB_INTERVAL without waiting for data, as dragging
+ * the seek bar does. Timed from the last one to the first byte near it */
+static int64_t ScrubRun( libvlc_instance_t *p_vlc )
+{
+    uint64_t i_size = (uint64_t) opt.i_size_mb * 1024 * 1024;
+    int64_t i_start, i_seek = 0, i_data = 0;
+    float f_pos = 0;
+    int i_first_event = 0;
+
+    libvlc_media_player_t *p_mp = PlayerStart( p_vlc, "/bench_0000.ts", &i_start );
+    if ( !p_mp )
+        return 0;
+
+    if ( WaitData( 0, i_start, -1, i_start + EVENT_TIMEOUT ) )
+    {
+        for ( int i = 0; i < SCRUB_STEPS; i++ )
+        {
+            f_pos = 0.1f + 0.8f * i / ( SCRUB_STEPS - 1 );
+
+            pthread_mutex_lock( &trace.lock );
+            i_first_event = trace.i_data;
+            pthread_mutex_unlock( &trace.lock );
+
+            i_seek = Now();
+            libvlc_media_player_set_position( p_mp, f_pos );
+            if ( i < SCRUB_STEPS - 1 )
+                usleep( SCRUB_INTERVAL );
+        }
+        i_data = WaitData( i_first_event, i_seek, (int64_t) ( f_pos * i_size ), i_seek + SEEK_TIMEOUT );
+    }
+
+    PlayerStop( p_mp );
+
+    return i_data ? i_data - i_seek : 0;
+}
+
+/* paused for PAUSE_TIME, timed from the resume until the position moves. The
+ * null packets carry no clock, so it moves with the bytes read */
+static int64_t PauseRun( libvlc_instance_t *p_vlc )
+{
+    int64_t i_start, i_resumed = 0;
+
+    libvlc_media_player_t *p_mp = PlayerStart( p_vlc, "/bench_0000.ts", &i_start );
+    if ( !p_mp )
+        return 0;
+
+    if ( WaitData( 0, i_start, -1, i_start + EVENT_TIMEOUT ) )
+    {
+        usleep( PAUSE_AFTER );
+        libvlc_media_player_set_pause( p_mp, 1 );
+        usleep( PAUSE_TIME );
+
+        pthread_mutex_lock( &trace.lock );
+        bool b_over = trace.i_end || trace.b_error;
+        pthread_mutex_unlock( &trace.lock );
+
+        float f_pos = libvlc_media_player_get_position( p_mp );
+        int64_t i_resume = Now();
+        libvlc_media_player_set_pause( p_mp, 0 );
+
+        while ( !b_over && Now() < i_resume + SEEK_TIMEOUT )
+        {
+            if ( libvlc_media_player_get_position( p_mp ) != f_pos )
+            {
+                i_resumed = Now() - i_resume;
+                break;
+            }
+            usleep( 1000 );
+        }
+    }
+
+    PlayerStop( p_mp );
+
+    return i_resumed;
+}
+
+static int NetworkBenchmark( libvlc_instance_t *p_vlc, int i_version, int i_rtt )
+{
+    int64_t i_start = 0, i_first = 0, i_playing = 0, i_end = 0;
+
+    pid_t pid = FakeStart( i_version );
+    if ( pid < 0 )
+    {
+        fprintf( stderr, "mythbench: unable to start %s\n", opt.psz_fake );
+        return -1;
+    }
+    pid_t pid_proxy = ProxyStart( i_rtt );
+    if ( pid_proxy < 0 )
+    {
+        fprintf( stderr, "mythbench: unable to start %s\n", opt.psz_proxy );
+        FakeStop( pid );
+        return -1;
+    }
+
+    if ( PlayThrough( p_vlc, &i_start, &i_playing, &i_first, &i_end ) )
+    {
+        ProxyStop( pid_proxy );
+        FakeStop( pid );
+        return -1;
+    }
+
+    pthread_mutex_lock( &trace.lock );
+    int i_blocks = trace.i_blocks;
+    uint64_t i_granted = trace.i_granted;
+    pthread_mutex_unlock( &trace.lock );
+
+    int64_t *pi_seek = calloc( opt.i_seeks, sizeof( *pi_seek ) );
+    int i_seeks = 0, i_missed = 0;
+    if ( pi_seek )
+        i_seeks = SeekRun( p_vlc, pi_seek, &i_missed );
+
+    int64_t i_scrub = ScrubRun( p_vlc );
+    int64_t i_resume = PauseRun( p_vlc );
+
+    ProxyStop( pid_proxy );
+    FakeStop( pid );
+
+    printf( "%-8d", i_rtt );
+    PrintRate( i_first, i_end );
+    if ( i_blocks > 0 )
+        printf( " %9.1f", i_granted / 1024.0 / i_blocks );
+    else
+        printf( " %9s", "-" );
+    PrintPercentiles( pi_seek, i_seeks );
+    PrintTime( i_scrub );
+    PrintTime( i_resume );
+    printf( " %6d\n", i_missed );
+    fflush( stdout );
+
+    free( pi_seek );
+
+    return 0;
+}
+
+/*****************************************************************************
+ * replay of a recorded session
+ *****************************************************************************/
+typedef struct
+{
+    int64_t     i_time;         /* since the recording was opened, us */
+    uint64_t    i_pos;
+} seek_t;
+
+static struct
+{
+    char        psz_path[256];  /* of the recording on the backend */
+    uint64_t    i_size;
+    int64_t     i_length;       /* of the session from the open, us */
+    seek_t     *p_seeks;
+    int         i_seeks;
+} session;
+
+/* the i-th []:[] separated field of a frame */
+static void Field( const uint8_t *p, size_t i_len, int i, char *psz_out, size_t i_out )
+{
+    size_t i_start = 0;
+
+    for ( ; i > 0; i-- )
+    {
+        const uint8_t *p_sep = memmem( p + i_start, i_len - i_start, "[]:[]", 5 );
+        i_start = p_sep ? (size_t) ( p_sep - p ) + 5 : i_len;
+    }
+
+    const uint8_t *p_end = memmem( p + i_start, i_len - i_start, "[]:[]", 5 );
+    size_t i_field = ( p_end ? (size_t) ( p_end - p ) : i_len ) - i_start;
+
+    if ( i_field >= i_out )
+        i_field = i_out - 1;
+    memcpy( psz_out, p + i_start, i_field );
+    psz_out[i_field] = '\0';
+}
+
+/* the recording the session opened first, and the seeks made to it. Seeks
+ * close to where the reading was are the stripes' own, they are left out */
+static int SessionLoad( const char *psz_trace )
+{
+    FILE *p_file = fopen( psz_trace, "rb" );
+    if ( !p_file )
+        return -1;
+
+    uint8_t *p_trace = NULL;
+    size_t i_size = 0, i_alloc = 0;
+    do
+    {
+        i_alloc = i_alloc ? 2 * i_alloc : 1 << 20;
+        if ( !( p_trace = realloc( p_trace, i_alloc ) ) )
+            abort();
+        i_size += fread( p_trace + i_size, 1, i_alloc - i_size, p_file );
+    }
+    while ( i_size == i_alloc );
+    fclose( p_file );
+
+    if ( i_size < 8 || memcmp( p_trace, MYTH_TRACE_MAGIC, 8 ) )
+    {
+        free( p_trace );
+        return -1;
+    }
+
+    myth_trace_record_t rec;
+    int64_t i_time = 0, i_open = -1;
+    int i_ann_fd = -1, i_alloc_seeks = 0, i_version = 0;
+    uint64_t i_reached = 0;
+    char psz_field[256];
+
+    for ( size_t i_pos = 8, i_len; ( i_len = myth_TraceRecord( p_trace + i_pos, i_size - i_pos, &rec ) ); i_pos += i_len )
+    {
+        i_time += rec.i_delta;
+
+        if ( rec.i_kind == MYTH_TRACE_SEND && rec.i_len > 19 && !memcmp( rec.p_data, "MYTH_PROTO_VERSION ", 19 ) )
+            sscanf( (const char *) rec.p_data + 19, "%d", &i_version );
+
+        if ( i_open < 0 )
+        {
+            /* ANN FileTransfer <host> ...[]:[]<path>[]:[]<group>, then its reply */
+            if ( rec.i_kind == MYTH_TRACE_SEND && rec.i_len > 17 && !memcmp( rec.p_data, "ANN FileTransfer ", 17 ) )
+            {
+                Field( rec.p_data, rec.i_len, 1, session.psz_path, sizeof( session.psz_path ) );
+                i_ann_fd = rec.fd;
+            }
+            else if ( rec.i_kind == MYTH_TRACE_RECV && rec.fd == i_ann_fd )
+            {
+                Field( rec.p_data, rec.i_len, 2, psz_field, sizeof( psz_field ) );
+                session.i_size = strtoull( psz_field, NULL, 10 );
+                if ( i_version == 63 )
+                {
+                    Field( rec.p_data, rec.i_len, 3, psz_field, sizeof( psz_field ) );
+                    session.i_size = session.i_size << 32 | strtoull( psz_field, NULL, 10 );
+                }
+                i_open = i_time;
+            }
+            continue;
+        }
+
+        if ( rec.i_kind == MYTH_TRACE_DATA )
+            i_reached += rec.i_len;
+
+        /* QUERY_FILETRANSFER <id>[]:[]SEEK[]:[]<pos>[]:[]... */
+        if ( rec.i_kind == MYTH_TRACE_SEND && rec.i_len > 19 && !memcmp( rec.p_data, "QUERY_FILETRANSFER ", 19 ) )
+        {
+            Field( rec.p_data, rec.i_len, 1, psz_field, sizeof( psz_field ) );
+            if ( strcmp( psz_field, "SEEK" ) )
+                continue;
+
+            Field( rec.p_data, rec.i_len, 2, psz_field, sizeof( psz_field ) );
+            uint64_t i_seek = strtoull( psz_field, NULL, 10 );
+            if ( i_version == 63 )
+            {
+                Field( rec.p_data, rec.i_len, 3, psz_field, sizeof( psz_field ) );
+                i_seek = i_seek << 32 | strtoull( psz_field, NULL, 10 );
+            }
+
+            if ( llabs( (long long) ( i_seek - i_reached ) ) > SEEK_JUMP )
+            {
+                if ( session.i_seeks == i_alloc_seeks )
+                {
+                    i_alloc_seeks = i_alloc_seeks ? 2 * i_alloc_seeks : 64;
+                    if ( !( session.p_seeks = realloc( session.p_seeks, i_alloc_seeks * sizeof( seek_t ) ) ) )
+                        abort();
+                }
+                session.p_seeks[session.i_seeks].i_time = i_time - i_open;
+                session.p_seeks[session.i_seeks].i_pos = i_seek;
+                session.i_seeks++;
+            }
+            i_reached = i_seek;
+        }
+    }
+    session.i_length = i_open >= 0 ? i_time - i_open : 0;
+
+    free( p_trace );
+
+    return i_open >= 0 && session.i_size > 0 ? 0 : -1;
+}
+
+static int Replay( libvlc_instance_t *p_vlc )
+{
+    int64_t i_start, i_first, i_playing;
+
+    pid_t pid = FakeStart( 0 );
+    if ( pid < 0 )
+    {
+        fprintf( stderr, "mythbench: unable to start %s\n", opt.psz_fake );
+        return -1;
+    }
+
+    libvlc_media_player_t *p_mp = PlayerStart( p_vlc, session.psz_path, &i_start );
+    if ( !p_mp )
+    {
+        FakeStop( pid );
+        return -1;
+    }
+
+    i_first = WaitData( 0, i_start, -1, i_start + EVENT_TIMEOUT );
+
+    int64_t *pi_seek = calloc( session.i_seeks + 1, sizeof( *pi_seek ) );
+    int i_seeks = 0, i_missed = 0;
+
+    for ( int i = 0; pi_seek && i < session.i_seeks; i++ )
+    {
+        if ( !opt.b_fast )
+        {
+            int64_t i_wait = i_start + session.p_seeks[i].i_time - Now();
+            if ( i_wait > 0 )
+                usleep( i_wait );
+        }
+
+        pthread_mutex_lock( &trace.lock );
+        int i_first_event = trace.i_data;
+        bool b_over = trace.i_end || trace.b_error;
+        pthread_mutex_unlock( &trace.lock );
+        if ( b_over )
+            break;
+
+        int64_t i_seek = Now();
+        libvlc_media_player_set_position( p_mp, session.p_seeks[i].i_pos / (float) session.i_size );
+
+        int64_t i_data = WaitData( i_first_event, i_seek, session.p_seeks[i].i_pos, i_seek + SEEK_TIMEOUT );
+        if ( i_data )
+            pi_seek[i_seeks++] = i_data - i_seek;
+        else
+            i_missed++;
+    }
+
+    /* play out the rest of the session */
+    if ( !opt.b_fast )
+    {
+        int64_t i_wait = i_start + session.i_length - Now();
+        if ( i_wait > 0 )
+            usleep( i_wait );
+    }
+
+    pthread_mutex_lock( &trace.lock );
+    i_playing = trace.i_playing;
+    pthread_mutex_unlock( &trace.lock );
+
+    PlayerStop( p_mp );
+    FakeStop( pid );
+
+    qsort( pi_seek, i_seeks, sizeof( *pi_seek ), CompareTime );
+
+    printf( "%-8s", "replay" );
+    PrintTime( i_playing ? i_playing - i_start : 0 );
+    PrintTime( i_first ? i_first - i_start : 0 );
+    printf( " %8s", "-" );
+    PrintPercentiles( pi_seek, i_seeks );
+    printf( " %6d\n", i_missed );
+    fflush( stdout );
+
+    free( pi_seek );
+
+    return 0;
+}
+
+static void Usage( const char *psz_name )
+{
+    fprintf( stderr,
+        "usage: %s [-f mythfake] [-p port] [-s size MB] [-k seeks] [-c connections] [-V protocol]\n"
+        "          [-r trace [-x]] [-R rtt,... [-P mythproxy] [-I impairments]]\n"
+        "  -f  path of mythfake, ./mythfake by default\n"
+        "  -p  port for mythfake, 16543 by default\n"
+        "  -s  size of the recording played in MB, 1024 by default\n"
+        "  -k  number of random seeks, 50 by default\n"
+        "  -c  myth-stripes, 1 by default\n"
+        "  -V  only this protocol version (63, 72, 75 or 77), all by default\n"
+        "  -r  replay a session recorded with --myth-trace instead\n"
+        "  -x  replay as fast as possible rather than with the recorded timing\n"
+        "  -R  play scenarios through mythproxy at each of these round-trip times in ms\n"
+        "  -P  path of mythproxy, ./mythproxy by default\n"
+        "  -I  more mythproxy impairments for both connections, e.g. jitter=5,bw=100000\n"
+        "Set VLC_PLUGIN_PATH when the myth access is not installed with VLC.\n",
+        psz_name );
+}
+
+int main( int argc, char **argv )
+{
+    int i_opt;
+    char psz_stripes[32];
+
+    while ( ( i_opt = getopt( argc, argv, "f:p:s:k:c:V:r:xR:P:I:h" ) ) != -1 )
+    {
+        switch ( i_opt )
+        {
+            case 'f': opt.psz_fake = optarg; break;
+            case 'p': opt.i_port = atoi( optarg ); break;
+            case 's': opt.i_size_mb = atoi( optarg ); break;
+            case 'k': opt.i_seeks = atoi( optarg ); break;
+            case 'c': opt.i_stripes = atoi( optarg ); break;
+            case 'V': opt.i_version = atoi( optarg ); break;
+            case 'r': opt.psz_replay = optarg; break;
+            case 'x': opt.b_fast = true; break;
+            case 'R': opt.psz_rtts = optarg; break;
+            case 'P': opt.psz_proxy = optarg; break;
+            case 'I': opt.psz_impair = optarg; break;
+            default:
+                Usage( argv[0] );
+                return 1;
+        }
+    }
+
+    if ( opt.psz_replay && SessionLoad( opt.psz_replay ) )
+    {
+        fprintf( stderr, "mythbench: no recording was opened in %s\n", opt.psz_replay );
+        return 1;
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+    srand( 1 );
+    i_player_port = opt.psz_rtts && !opt.psz_replay ? opt.i_port + 1 : opt.i_port;
+
+    /* negotiate every time, and keep every byte coming from the network */
+    snprintf( psz_stripes, sizeof( psz_stripes ), "--myth-stripes=%d", opt.i_stripes );
+    const char *ppsz_args[] = {
+        "--quiet", "--no-video", "--aout=dummy",
+        "--no-myth-version-cache", "--no-myth-index-cache", "--no-myth-disk-cache",
+        psz_stripes,
+    };
+
+    libvlc_instance_t *p_vlc = libvlc_new( sizeof( ppsz_args ) / sizeof( ppsz_args[0] ), ppsz_args );
+    if ( !p_vlc )
+    {
+        fprintf( stderr, "mythbench: unable to start libvlc with the myth access\n" );
+        return 1;
+    }
+
+    int i_ret = 0;
+    if ( opt.psz_rtts && !opt.psz_replay )
+    {
+        int i_version = opt.i_version ? opt.i_version : versions[sizeof( versions ) / sizeof( versions[0] ) - 1];
+
+        printf( "protocol %d, %d MB\n", i_version, opt.i_size_mb );
+        printf( "%-8s %8s %9s %8s %8s %8s %8s %6s\n", "rtt ms", "MB/s", "block KiB",
+                "seek p50", "seek p99", "scrub ms", "resume", "missed" );
+
+        for ( const char *psz = opt.psz_rtts; *psz; )
+        {
+            char *psz_end;
+            int i_rtt = strtol( psz, &psz_end, 10 );
+            if ( psz_end == psz )
+                break;
+            psz = *psz_end == ',' ? psz_end + 1 : psz_end;
+
+            if ( NetworkBenchmark( p_vlc, i_version, i_rtt ) )
+            {
+                fprintf( stderr, "mythbench: round-trip time %d ms failed\n", i_rtt );
+                i_ret = 1;
+            }
+        }
+
+        libvlc_release( p_vlc );
+
+        return i_ret;
+    }
+
+    printf( "%-8s %8s %8s %8s %8s %8s %6s\n", "proto", "open ms", "ttfb ms", "MB/s", "seek p50", "seek p99", "missed" );
+
+    if ( opt.psz_replay )
+    {
+        printf( "%d seeks in %.1f s of %s\n", session.i_seeks, session.i_length / 1000000.0, session.psz_path );
+        i_ret = Replay( p_vlc ) != 0;
+    }
+    for ( size_t i = 0; !opt.psz_replay && i < sizeof( versions ) / sizeof( versions[0] ); i++ )
+    {
+        if ( opt.i_version && opt.i_version != versions[i] )
+            continue;
+        if ( Benchmark( p_vlc, versions[i] ) )
+        {
+            fprintf( stderr, "mythbench: protocol %d failed\n", versions[i] );
+            i_ret = 1;
+        }
+    }
+
+    libvlc_release( p_vlc );
+
+    return i_ret;
+}
@@ -0,0 +1,1220 @@
+/*****************************************************************************
+ * mythfake.c: stand-in MythTV backend for benchmarking the myth access
+ *****************************************************************************
+ * Copyright (C) 2013 Loune Lam
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Speaks the part of the Myth protocol myth.c uses and serves a library of
+ * synthetic recordings. Each recording is a stream of MPEG-TS null packets,
+ * generated on the fly, so any size costs no disk or memory.
+ *
+ * With -t every protocol event is written to stdout as
+ *   <monotonic us> <event> <arguments>
+ * which is what mythbench measures latencies from. Lines typed on stdin are
+ * sent to the event connections as BACKEND_MESSAGEs.
+ *
+ * REQUEST_BLOCK writes the granted data before it replies, as mythbackend
+ * does. With -a it replies at once and the data follows from a thread.
+ *
+ * With -r it replays a session recorded by the plugin with myth-trace
+ * instead: replies come from the trace after the delay they took then, and
+ * each granted block is sent at the rate it came in at, or all at once
+ * with -x. The data itself is not in the trace, null packets stand in.
+ *****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../myth_proto.h"
+
+#define SEP "[]:[]"
+#define TS_PACKET 188
+#define MAX_TRANSFERS 256
+
+/* the protocol versions myth.c knows, with the same ProgramInfo positions of
+ * title, subtitle, description, genre, channel, chanid, url, filesize,
+ * start and end */
+typedef struct
+{
+    int         i_version;
+    const char *psz_token;
+    int         i_fields;       /* ProgramInfo length */
+    int         pi_fields[10];
+} fake_version_t;
+
+static const fake_version_t fake_versions[] = {
+    { 63, "3875641D",  41, { 0, 1, 2, 3, 7, 4, 8, 9, 23, 24 } },
+    { 72, "D78EFD6F",  44, { 0, 1, 2, 5, 9, 6, 10, 11, 25, 26 } },
+    { 75, "SweetRock", 44, { 0, 1, 2, 5, 9, 6, 10, 11, 25, 26 } },
+    { 77, "WindMark",  44, { 0, 1, 2, 6, 10, 7, 11, 12, 26, 27 } },
+};
+#define VERSION_COUNT ( sizeof( fake_versions ) / sizeof( fake_versions[0] ) )
+
+static struct
+{
+    int         i_port;
+    int         i_version;      /* only one accepted, 0 for any */
+    int         i_recordings;
+    uint64_t    i_size;
+    int         i_event_interval;
+    bool        b_trace;
+    const char *psz_replay;
+    bool        b_fast;         /* replay without the recorded delays */
+    bool        b_async;        /* answer REQUEST_BLOCK before sending the data */
+} opt = { 6543, 0, 10, 256 * 1024 * 1024, 0, false, NULL, false, false };
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void Trace( const char *psz_fmt, ... )
+{
+    struct timespec ts;
+    va_list args;
+
+    if ( !opt.b_trace )
+        return;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    pthread_mutex_lock( &trace_lock );
+    printf( "%"PRId64" ", (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+    va_start( args, psz_fmt );
+    vprintf( psz_fmt, args );
+    va_end( args );
+    putchar( '\n' );
+    fflush( stdout );
+    pthread_mutex_unlock( &trace_lock );
+}
+
+/*****************************************************************************
+ * Connections and framing: an 8 character length, then the payload
+ *****************************************************************************/
+typedef struct _fake_conn_t
+{
+    int         fd;
+    pthread_mutex_t write_lock;     /* replies and injected events interleave */
+    const fake_version_t *version;
+    bool        b_events;
+    struct _fake_conn_t *p_next;
+} fake_conn_t;
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static fake_conn_t *conns = NULL;
+
+static int WriteAll( int fd, const void *p_data, size_t i_len )
+{
+    const char *p = p_data;
+
+    while ( i_len > 0 )
+    {
+        ssize_t i_ret = send( fd, p, i_len, MSG_NOSIGNAL );
+        if ( i_ret < 0 && errno == EINTR )
+            continue;
+        if ( i_ret <= 0 )
+            return -1;
+        p += i_ret;
+        i_len -= i_ret;
+    }
+
+    return 0;
+}
+
+static int ReadAll( int fd, void *p_data, size_t i_len )
+{
+    char *p = p_data;
+
+    while ( i_len > 0 )
+    {
+        ssize_t i_ret = recv( fd, p, i_len, 0 );
+        if ( i_ret < 0 && errno == EINTR )
+            continue;
+        if ( i_ret <= 0 )
+            return -1;
+        p += i_ret;
+        i_len -= i_ret;
+    }
+
+    return 0;
+}
+
+static char *ReadFrame( int fd )
+{
+    char psz_len[9];
+
+    if ( ReadAll( fd, psz_len, 8 ) )
+        return NULL;
+    psz_len[8] = '\0';
+
+    int i_len = atoi( psz_len );
+    if ( i_len < 0 )
+        return NULL;
+
+    char *psz = malloc( i_len + 1 );
+    if ( !psz || ReadAll( fd, psz, i_len ) )
+    {
+        free( psz );
+        return NULL;
+    }
+    psz[i_len] = '\0';
+
+    return psz;
+}
+
+static int SendFrame( fake_conn_t *p_conn, const char *psz_data, size_t i_len )
+{
+    char psz_len[9];
+    int i_ret;
+
+    snprintf( psz_len, sizeof( psz_len ), "%-8zu", i_len );
+
+    pthread_mutex_lock( &p_conn->write_lock );
+    i_ret = WriteAll( p_conn->fd, psz_len, 8 ) || WriteAll( p_conn->fd, psz_data, i_len );
+    pthread_mutex_unlock( &p_conn->write_lock );
+
+    return i_ret;
+}
+
+/* a reply grown with Append() and sent with SendReply() */
+typedef struct
+{
+    char   *psz;
+    size_t  i_len;
+    size_t  i_alloc;
+} reply_t;
+
+static void Append( reply_t *p_reply, const char *psz_fmt, ... )
+{
+    va_list args;
+
+    for ( ;; )
+    {
+        size_t i_room = p_reply->i_alloc - p_reply->i_len;
+
+        va_start( args, psz_fmt );
+        int i_ret = vsnprintf( p_reply->psz ? p_reply->psz + p_reply->i_len : NULL, i_room, psz_fmt, args );
+        va_end( args );
+
+        if ( i_ret < 0 )
+            return;
+        if ( (size_t) i_ret < i_room )
+        {
+            p_reply->i_len += i_ret;
+            return;
+        }
+
+        size_t i_alloc = p_reply->i_alloc ? p_reply->i_alloc : 4096;
+        while ( i_alloc - p_reply->i_len <= (size_t) i_ret )
+            i_alloc *= 2;
+        char *psz = realloc( p_reply->psz, i_alloc );
+        if ( !psz )
+            abort();
+        p_reply->psz = psz;
+        p_reply->i_alloc = i_alloc;
+    }
+}
+
+static int SendReply( fake_conn_t *p_conn, reply_t *p_reply )
+{
+    int i_ret = SendFrame( p_conn, p_reply->psz ? p_reply->psz : "", p_reply->i_len );
+
+    free( p_reply->psz );
+    memset( p_reply, 0, sizeof( *p_reply ) );
+
+    return i_ret;
+}
+
+/* split psz on []:[] in place, returns the number of tokens */
+static int Tokenize( char *psz, char **ppsz_tokens, int i_max )
+{
+    int i_count = 0;
+
+    while ( i_count < i_max )
+    {
+        ppsz_tokens[i_count++] = psz;
+        psz = strstr( psz, SEP );
+        if ( !psz )
+            break;
+        *psz = '\0';
+        psz += strlen( SEP );
+    }
+
+    return i_count;
+}
+
+/*****************************************************************************
+ * Replay: the command and reply pairs of a trace, taken in order. Commands
+ * on a FileTransfer are matched by verb, the transfer ids differ, anything
+ * else by its text, or by its first field when the text differs.
+ *****************************************************************************/
+#define REPLAY_MAX_FD 65536
+
+typedef struct
+{
+    char       *psz_cmd;
+    char       *psz_reply;      /* NULL when none came */
+    int         fd;
+    int64_t     i_sent;         /* trace time, us */
+    int64_t     i_latency;
+    int64_t     i_rate;         /* B/s the block came in at, REQUEST_BLOCK only */
+    bool        b_used;
+} exchange_t;
+
+typedef struct
+{
+    int         fd;
+    int64_t     i_time;
+    uint64_t    i_len;
+} data_read_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    exchange_t *p_exchanges;
+    int         i_exchanges;
+} replay = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static void *Grow( void *p, int i_count, int *pi_alloc, size_t i_size )
+{
+    if ( i_count < *pi_alloc )
+        return p;
+
+    *pi_alloc = *pi_alloc ? 2 * *pi_alloc : 256;
+    p = realloc( p, *pi_alloc * i_size );
+    if ( !p )
+        abort();
+
+    return p;
+}
+
+/* the i-th []:[] separated field of psz, copied to psz_out */
+static const char *Field( const char *psz, int i, char *psz_out, size_t i_out )
+{
+    for ( ; i > 0 && psz; i-- )
+    {
+        psz = strstr( psz, SEP );
+        if ( psz )
+            psz += strlen( SEP );
+    }
+
+    if ( !psz )
+        psz = "";
+    size_t i_len = strcspn( psz, "[" );
+    if ( i_len >= i_out )
+        i_len = i_out - 1;
+    memcpy( psz_out, psz, i_len );
+    psz_out[i_len] = '\0';
+
+    return psz_out;
+}
+
+/* what matches commands that differ in their text */
+static const char *Verb( const char *psz_cmd, char *psz_out, size_t i_out )
+{
+    return Field( psz_cmd, strncmp( psz_cmd, "QUERY_FILETRANSFER ", 19 ) ? 0 : 1, psz_out, i_out );
+}
+
+/* how fast each granted block came in: the bytes read on its data socket
+ * after the reply, up to the whole grant, follow the earlier blocks */
+static void ReplayRates( data_read_t *p_reads, int i_reads )
+{
+    for ( int i = 0; i < replay.i_exchanges; i++ )
+    {
+        exchange_t *p_ann = &replay.p_exchanges[i];
+        char psz_id[32];
+
+        if ( strncmp( p_ann->psz_cmd, "ANN FileTransfer ", 17 ) || !p_ann->psz_reply )
+            continue;
+        Field( p_ann->psz_reply, 1, psz_id, sizeof( psz_id ) );
+
+        /* the data socket of the transfer, from its announce to its reuse */
+        int i_read = 0;
+        uint64_t i_granted = 0, i_received = 0;
+        int64_t i_done = p_ann->i_sent;
+
+        while ( i_read < i_reads && p_reads[i_read].i_time < p_ann->i_sent )
+            i_read++;
+
+        for ( int j = i + 1; j < replay.i_exchanges; j++ )
+        {
+            exchange_t *p_ex = &replay.p_exchanges[j];
+            char psz_cmd_id[32], psz_verb[32];
+
+            if ( p_ex->fd == p_ann->fd )
+                break;
+            if ( strncmp( p_ex->psz_cmd, "QUERY_FILETRANSFER ", 19 ) || !p_ex->psz_reply )
+                continue;
+            if ( strcmp( Field( p_ex->psz_cmd + 19, 0, psz_cmd_id, sizeof( psz_cmd_id ) ), psz_id )
+              || strcmp( Verb( p_ex->psz_cmd, psz_verb, sizeof( psz_verb ) ), "REQUEST_BLOCK" ) )
+                continue;
+
+            uint64_t i_grant = strtoull( p_ex->psz_reply, NULL, 10 );
+            int64_t i_start = p_ex->i_sent + p_ex->i_latency;
+            if ( i_start < i_done )
+                i_start = i_done;
+
+            i_granted += i_grant;
+            for ( ; i_received < i_granted && i_read < i_reads; i_read++ )
+            {
+                if ( p_reads[i_read].fd != p_ann->fd )
+                    continue;
+                i_received += p_reads[i_read].i_len;
+                i_done = p_reads[i_read].i_time;
+            }
+
+            if ( i_grant > 0 && i_received >= i_granted && i_done > i_start )
+                p_ex->i_rate = i_grant * 1000000 / ( i_done - i_start );
+        }
+    }
+}
+
+static int ReplayLoad( const char *psz_path )
+{
+    FILE *p_file = fopen( psz_path, "rb" );
+    uint8_t *p_trace = NULL;
+    size_t i_size = 0, i_alloc = 0, i_ret;
+
+    if ( !p_file )
+        return -1;
+    do
+    {
+        i_alloc = i_alloc ? 2 * i_alloc : 1 << 20;
+        p_trace = realloc( p_trace, i_alloc );
+        if ( !p_trace )
+            abort();
+        i_ret = fread( p_trace + i_size, 1, i_alloc - i_size, p_file );
+        i_size += i_ret;
+    }
+    while ( i_size == i_alloc );
+    fclose( p_file );
+
+    if ( i_size < 8 || memcmp( p_trace, MYTH_TRACE_MAGIC, 8 ) )
+    {
+        free( p_trace );
+        return -1;
+    }
+
+    static int pi_pending[REPLAY_MAX_FD];
+    data_read_t *p_reads = NULL;
+    int i_reads = 0, i_reads_alloc = 0, i_exchanges_alloc = 0;
+    int64_t i_time = 0;
+    myth_trace_record_t rec;
+
+    for ( int i = 0; i < REPLAY_MAX_FD; i++ )
+        pi_pending[i] = -1;
+
+    for ( size_t i_pos = 8, i_len; ( i_len = myth_TraceRecord( p_trace + i_pos, i_size - i_pos, &rec ) ); i_pos += i_len )
+    {
+        i_time += rec.i_delta;
+        if ( rec.fd < 0 || rec.fd >= REPLAY_MAX_FD )
+            continue;
+
+        if ( rec.i_kind == MYTH_TRACE_SEND )
+        {
+            replay.p_exchanges = Grow( replay.p_exchanges, replay.i_exchanges, &i_exchanges_alloc, sizeof( exchange_t ) );
+            exchange_t *p_ex = &replay.p_exchanges[replay.i_exchanges];
+            memset( p_ex, 0, sizeof( *p_ex ) );
+            p_ex->psz_cmd = strndup( (const char *) rec.p_data, rec.i_len );
+            p_ex->fd = rec.fd;
+            p_ex->i_sent = i_time;
+            pi_pending[rec.fd] = replay.i_exchanges++;
+        }
+        else if ( rec.i_kind == MYTH_TRACE_RECV && pi_pending[rec.fd] >= 0
+               && ( rec.i_len < 15 || memcmp( rec.p_data, "BACKEND_MESSAGE", 15 ) ) )
+        {
+            exchange_t *p_ex = &replay.p_exchanges[pi_pending[rec.fd]];
+            p_ex->psz_reply = strndup( (const char *) rec.p_data, rec.i_len );
+            p_ex->i_latency = i_time - p_ex->i_sent;
+            pi_pending[rec.fd] = -1;
+        }
+        else if ( rec.i_kind == MYTH_TRACE_DATA && rec.i_len > 0 )
+        {
+            p_reads = Grow( p_reads, i_reads, &i_reads_alloc, sizeof( data_read_t ) );
+            p_reads[i_reads].fd = rec.fd;
+            p_reads[i_reads].i_time = i_time;
+            p_reads[i_reads].i_len = rec.i_len;
+            i_reads++;
+        }
+    }
+
+    ReplayRates( p_reads, i_reads );
+    free( p_reads );
+    free( p_trace );
+
+    /* the backend only spoke the version it accepted */
+    for ( int i = 0; i < replay.i_exchanges && !opt.i_version; i++ )
+    {
+        exchange_t *p_ex = &replay.p_exchanges[i];
+        if ( p_ex->psz_reply && !strncmp( p_ex->psz_reply, "ACCEPT", 6 ) )
+            sscanf( p_ex->psz_cmd, "MYTH_PROTO_VERSION %d", &opt.i_version );
+    }
+
+    return replay.i_exchanges > 0 ? 0 : -1;
+}
+
+/* the recorded exchange for psz_cmd, after its delay. One already used is
+ * taken again when the client asks more than it did then */
+static exchange_t *ReplayTake( const char *psz_cmd )
+{
+    exchange_t *p_found = NULL, *p_verb = NULL, *p_again = NULL;
+    char psz_verb[64], psz_other[64];
+
+    if ( !replay.i_exchanges )
+        return NULL;
+
+    Verb( psz_cmd, psz_verb, sizeof( psz_verb ) );
+    bool b_transfer = !strncmp( psz_cmd, "QUERY_FILETRANSFER ", 19 );
+
+    pthread_mutex_lock( &replay.lock );
+    for ( int i = 0; i < replay.i_exchanges && !p_found; i++ )
+    {
+        exchange_t *p_ex = &replay.p_exchanges[i];
+        bool b_exact = !b_transfer && !strcmp( p_ex->psz_cmd, psz_cmd );
+
+        if ( !b_exact && strcmp( Verb( p_ex->psz_cmd, psz_other, sizeof( psz_other ) ), psz_verb ) )
+            continue;
+        if ( ( b_transfer != !strncmp( p_ex->psz_cmd, "QUERY_FILETRANSFER ", 19 ) ) )
+            continue;
+
+        if ( p_ex->b_used )
+            p_again = p_ex;
+        else if ( b_exact || b_transfer )
+            p_found = p_ex;
+        else if ( !p_verb )
+            p_verb = p_ex;
+    }
+    if ( !p_found )
+        p_found = p_verb ? p_verb : p_again;
+    if ( p_found )
+        p_found->b_used = true;
+    pthread_mutex_unlock( &replay.lock );
+
+    if ( p_found && !opt.b_fast && p_found->i_latency > 0 )
+        usleep( p_found->i_latency );
+
+    return p_found;
+}
+
+/*****************************************************************************
+ * The library: recording i is bench_<i>.ts on chanid 1000 + i
+ *****************************************************************************/
+#define START_BASE 1380000000
+
+static int RecordingFind( const char *psz_basename )
+{
+    int i;
+    char c;
+
+    if ( sscanf( psz_basename, "bench_%d.t%c", &i, &c ) != 2 || i < 0 || i >= opt.i_recordings )
+        return -1;
+
+    return i;
+}
+
+static void AppendRecording( reply_t *p_reply, const fake_version_t *version, int i_rec )
+{
+    int64_t i_start = START_BASE + (int64_t) i_rec * 3600;
+
+    for ( int i = 0; i < version->i_fields; i++ )
+    {
+        if ( i > 0 )
+            Append( p_reply, SEP );
+
+        if ( i == version->pi_fields[0] )
+            Append( p_reply, "Benchmark %d", i_rec );
+        else if ( i == version->pi_fields[1] )
+            Append( p_reply, "Synthetic" );
+        else if ( i == version->pi_fields[2] )
+            Append( p_reply, "MPEG-TS null packets served by mythfake" );
+        else if ( i == version->pi_fields[3] )
+            Append( p_reply, "Test" );
+        else if ( i == version->pi_fields[4] )
+            Append( p_reply, "Fake %d", i_rec );
+        else if ( i == version->pi_fields[5] )
+            Append( p_reply, "%d", 1000 + i_rec );
+        else if ( i == version->pi_fields[6] )
+            Append( p_reply, "myth://127.0.0.1:%d/bench_%04d.ts", opt.i_port, i_rec );
+        else if ( i == version->pi_fields[7] )
+            Append( p_reply, "%"PRIu64, opt.i_size );
+        else if ( i == version->pi_fields[8] )
+            Append( p_reply, "%"PRId64, i_start );
+        else if ( i == version->pi_fields[9] )
+            Append( p_reply, "%"PRId64, i_start + 1800 );
+        else
+            Append( p_reply, "0" );
+    }
+}
+
+/* byte i_pos of every recording, a null packet is 47 1F FF 10 then FF */
+static void FillData( uint8_t *p_buf, uint64_t i_pos, size_t i_len )
+{
+    static const uint8_t header[4] = { 0x47, 0x1F, 0xFF, 0x10 };
+
+    for ( size_t i = 0; i < i_len; i++ )
+    {
+        unsigned i_off = ( i_pos + i ) % TS_PACKET;
+        p_buf[i] = i_off < 4 ? header[i_off] : 0xFF;
+    }
+}
+
+/*****************************************************************************
+ * FileTransfers: like mythbackend, REQUEST_BLOCK writes the granted data to
+ * the data socket before it replies, so a client that does not read while a
+ * request is outstanding stalls once the socket buffers are full. With -a
+ * the reply comes at once and a thread of the transfer writes the data.
+ *****************************************************************************/
+typedef struct
+{
+    int         i_id;
+    int         fd;
+    uint64_t    i_pos;
+    uint64_t    i_pending;      /* granted, not written yet, with -a */
+    uint64_t    i_size;
+    int64_t     i_rate;         /* B/s to send at, 0 for as fast as possible */
+    bool        b_first;        /* nothing written since the last seek */
+    bool        b_closed;
+    int         i_refs;         /* commands using it, protected by transfers_lock */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  wait;
+    pthread_t   thread;
+} fake_transfer_t;
+
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t transfers_wait = PTHREAD_COND_INITIALIZER;
+static fake_transfer_t *transfers[MAX_TRANSFERS];
+static int transfer_next_id = 1;
+
+/* write i_len bytes of the recording from i_pos, at i_rate B/s if set */
+static int TransferSend( fake_transfer_t *p_ft, uint64_t i_pos, uint64_t i_len, int64_t i_rate )
+{
+    uint8_t buf[65536];
+
+    while ( i_len > 0 )
+    {
+        size_t i_chunk = i_len < sizeof( buf ) ? i_len : sizeof( buf );
+
+        FillData( buf, i_pos, i_chunk );
+        if ( WriteAll( p_ft->fd, buf, i_chunk ) )
+            return -1;
+        if ( i_rate > 0 )
+            usleep( i_chunk * 1000000 / i_rate );
+
+        i_pos += i_chunk;
+        i_len -= i_chunk;
+    }
+
+    return 0;
+}
+
+static void *TransferThread( void *data )
+{
+    fake_transfer_t *p_ft = data;
+
+    pthread_mutex_lock( &p_ft->lock );
+    for ( ;; )
+    {
+        while ( p_ft->i_pending == 0 && !p_ft->b_closed )
+            pthread_cond_wait( &p_ft->wait, &p_ft->lock );
+        if ( p_ft->b_closed )
+            break;
+
+        size_t i_len = p_ft->i_pending < 65536 ? p_ft->i_pending : 65536;
+        uint64_t i_pos = p_ft->i_pos;
+        int64_t i_rate = p_ft->i_rate;
+        bool b_first = p_ft->b_first;
+        p_ft->b_first = false;
+        pthread_mutex_unlock( &p_ft->lock );
+
+        if ( b_first )
+            Trace( "data %d %"PRIu64, p_ft->i_id, i_pos );
+
+        int i_ret = TransferSend( p_ft, i_pos, i_len, i_rate );
+
+        pthread_mutex_lock( &p_ft->lock );
+        if ( i_ret )
+            break;
+        p_ft->i_pos += i_len;
+        p_ft->i_pending -= i_len;
+        pthread_cond_broadcast( &p_ft->wait );
+    }
+    p_ft->b_closed = true;
+    pthread_cond_broadcast( &p_ft->wait );
+    pthread_mutex_unlock( &p_ft->lock );
+
+    return NULL;
+}
+
+static fake_transfer_t *TransferNew( int fd, uint64_t i_size )
+{
+    fake_transfer_t *p_ft = calloc( 1, sizeof( *p_ft ) );
+    if ( !p_ft )
+        return NULL;
+
+    p_ft->fd = fd;
+    p_ft->i_size = i_size;
+    p_ft->b_first = true;
+    pthread_mutex_init( &p_ft->lock, NULL );
+    pthread_cond_init( &p_ft->wait, NULL );
+
+    pthread_mutex_lock( &transfers_lock );
+    for ( int i = 0; i < MAX_TRANSFERS; i++ )
+    {
+        if ( !transfers[i] )
+        {
+            p_ft->i_id = transfer_next_id++;
+            transfers[i] = p_ft;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &transfers_lock );
+
+    if ( !p_ft->i_id )
+    {
+        free( p_ft );
+        return NULL;
+    }
+
+    if ( opt.b_async && pthread_create( &p_ft->thread, NULL, TransferThread, p_ft ) )
+    {
+        pthread_mutex_lock( &transfers_lock );
+        for ( int i = 0; i < MAX_TRANSFERS; i++ )
+            if ( transfers[i] == p_ft )
+                transfers[i] = NULL;
+        pthread_mutex_unlock( &transfers_lock );
+        free( p_ft );
+        return NULL;
+    }
+
+    return p_ft;
+}
+
+static void TransferDelete( fake_transfer_t *p_ft )
+{
+    pthread_mutex_lock( &transfers_lock );
+    for ( int i = 0; i < MAX_TRANSFERS; i++ )
+        if ( transfers[i] == p_ft )
+            transfers[i] = NULL;
+    pthread_mutex_unlock( &transfers_lock );
+
+    pthread_mutex_lock( &p_ft->lock );
+    p_ft->b_closed = true;
+    pthread_cond_broadcast( &p_ft->wait );
+    pthread_mutex_unlock( &p_ft->lock );
+
+    /* ends a write in progress, then the commands still using it */
+    shutdown( p_ft->fd, SHUT_RDWR );
+    pthread_mutex_lock( &transfers_lock );
+    while ( p_ft->i_refs > 0 )
+        pthread_cond_wait( &transfers_wait, &transfers_lock );
+    pthread_mutex_unlock( &transfers_lock );
+
+    if ( opt.b_async )
+        pthread_join( p_ft->thread, NULL );
+    pthread_cond_destroy( &p_ft->wait );
+    pthread_mutex_destroy( &p_ft->lock );
+    free( p_ft );
+}
+
+/* transfers are deleted by the data connection owning them, which is not
+ * the one asking, so a command holds a reference until TransferRelease() */
+static fake_transfer_t *TransferFind( int i_id )
+{
+    fake_transfer_t *p_ft = NULL;
+
+    pthread_mutex_lock( &transfers_lock );
+    for ( int i = 0; i < MAX_TRANSFERS && !p_ft; i++ )
+        if ( transfers[i] && transfers[i]->i_id == i_id )
+            p_ft = transfers[i];
+    if ( p_ft )
+        p_ft->i_refs++;
+    pthread_mutex_unlock( &transfers_lock );
+
+    return p_ft;
+}
+
+static void TransferRelease( fake_transfer_t *p_ft )
+{
+    pthread_mutex_lock( &transfers_lock );
+    if ( --p_ft->i_refs == 0 )
+        pthread_cond_broadcast( &transfers_wait );
+    pthread_mutex_unlock( &transfers_lock );
+}
+
+static void QueryFileTransfer( fake_conn_t *p_conn, reply_t *p_reply, char **ppsz, int i_tokens, const exchange_t *p_ex )
+{
+    bool b_24 = p_conn->version->i_version == 63;
+
+    fake_transfer_t *p_ft = TransferFind( atoi( ppsz[0] + strlen( "QUERY_FILETRANSFER " ) ) );
+    if ( !p_ft || i_tokens < 2 )
+    {
+        Append( p_reply, "ERROR" SEP "unknown transfer" );
+    }
+    else if ( !strcmp( ppsz[1], "IS_OPEN" ) )
+    {
+        Append( p_reply, "%d", !p_ft->b_closed );
+    }
+    else if ( !strcmp( ppsz[1], "DONE" ) )
+    {
+        Append( p_reply, "OK" );
+    }
+    else if ( !strcmp( ppsz[1], "REQUEST_BLOCK" ) && i_tokens >= 3 )
+    {
+        int64_t i_want = atoll( ppsz[2] );
+
+        pthread_mutex_lock( &p_ft->lock );
+        uint64_t i_end = p_ft->i_pos + p_ft->i_pending;
+        uint64_t i_grant = i_end >= p_ft->i_size || i_want <= 0 ? 0 : p_ft->i_size - i_end;
+        if ( i_grant > (uint64_t) i_want )
+            i_grant = i_want;
+        if ( p_ex && !opt.b_fast )
+            p_ft->i_rate = p_ex->i_rate;
+
+        if ( opt.b_async )
+        {
+            p_ft->i_pending += i_grant;
+            pthread_cond_broadcast( &p_ft->wait );
+            pthread_mutex_unlock( &p_ft->lock );
+        }
+        else
+        {
+            uint64_t i_pos = p_ft->i_pos;
+            int64_t i_rate = p_ft->i_rate;
+            bool b_first = p_ft->b_first && i_grant > 0;
+            if ( b_first )
+                p_ft->b_first = false;
+            p_ft->i_pos += i_grant;
+            pthread_mutex_unlock( &p_ft->lock );
+
+            if ( b_first )
+                Trace( "data %d %"PRIu64, p_ft->i_id, i_pos );
+            if ( TransferSend( p_ft, i_pos, i_grant, i_rate ) )
+            {
+                pthread_mutex_lock( &p_ft->lock );
+                p_ft->b_closed = true;
+                pthread_mutex_unlock( &p_ft->lock );
+            }
+        }
+
+        Trace( "block %d %"PRId64" %"PRIu64, p_ft->i_id, i_want, i_grant );
+        Append( p_reply, "%"PRIu64, i_grant );
+    }
+    else if ( !strcmp( ppsz[1], "SEEK" ) && i_tokens >= ( b_24 ? 4 : 3 ) )
+    {
+        uint64_t i_pos = b_24 ? ( (uint64_t) atoll( ppsz[2] ) << 32 ) | (uint32_t) atoll( ppsz[3] )
+                              : (uint64_t) atoll( ppsz[2] );
+
+        /* the client drains what it was granted before seeking, only
+         * with -a can some of it still be on its way */
+        pthread_mutex_lock( &p_ft->lock );
+        while ( p_ft->i_pending > 0 && !p_ft->b_closed )
+            pthread_cond_wait( &p_ft->wait, &p_ft->lock );
+        p_ft->i_pos = i_pos < p_ft->i_size ? i_pos : p_ft->i_size;
+        p_ft->b_first = true;
+        pthread_mutex_unlock( &p_ft->lock );
+
+        Trace( "seek %d %"PRIu64, p_ft->i_id, i_pos );
+        if ( b_24 )
+            Append( p_reply, "%"PRIu32 SEP "%"PRIu32, (uint32_t) ( i_pos >> 32 ), (uint32_t) i_pos );
+        else
+            Append( p_reply, "%"PRIu64, i_pos );
+    }
+    else
+    {
+        Append( p_reply, "ERROR" SEP "unknown command" );
+    }
+
+    if ( p_ft )
+        TransferRelease( p_ft );
+}
+
+/*****************************************************************************
+ * Commands of a Playback connection
+ *****************************************************************************/
+static int Command( fake_conn_t *p_conn, char *psz_cmd )
+{
+    reply_t reply = { NULL, 0, 0 };
+    char *ppsz[16];
+    int i_rec, i_chanid;
+    char c;
+
+    /* replayed as recorded, except what a FileTransfer has to work out */
+    exchange_t *p_ex = ReplayTake( psz_cmd );
+    if ( p_ex && p_ex->psz_reply && strncmp( psz_cmd, "QUERY_FILETRANSFER ", 19 ) )
+    {
+        Trace( "command %.40s", psz_cmd );
+        return SendFrame( p_conn, p_ex->psz_reply, strlen( p_ex->psz_reply ) );
+    }
+
+    int i_tokens = Tokenize( psz_cmd, ppsz, 16 );
+
+    if ( !strncmp( ppsz[0], "QUERY_FILETRANSFER ", 19 ) )
+    {
+        QueryFileTransfer( p_conn, &reply, ppsz, i_tokens, p_ex );
+    }
+    else if ( !strcmp( ppsz[0], "QUERY_FILE_EXISTS" ) && i_tokens >= 2 )
+    {
+        const char *psz_base = strrchr( ppsz[1], '/' );
+        i_rec = RecordingFind( psz_base ? psz_base + 1 : ppsz[1] );
+        if ( i_rec < 0 )
+            Append( &reply, "0" );
+        else
+            Append( &reply, "1" SEP "/var/lib/mythtv/recordings/bench_%04d.ts", i_rec );
+    }
+    else if ( !strcmp( ppsz[0], "QUERY_RECORDINGS Play" ) )
+    {
+        Append( &reply, "%d", opt.i_recordings );
+        for ( i_rec = 0; i_rec < opt.i_recordings; i_rec++ )
+        {
+            Append( &reply, SEP );
+            AppendRecording( &reply, p_conn->version, i_rec );
+        }
+    }
+    else if ( !strncmp( ppsz[0], "QUERY_RECORDING BASENAME ", 25 ) )
+    {
+        i_rec = RecordingFind( ppsz[0] + 25 );
+        if ( i_rec < 0 )
+            Append( &reply, "ERROR" );
+        else
+        {
+            Append( &reply, "OK" SEP );
+            AppendRecording( &reply, p_conn->version, i_rec );
+        }
+    }
+    else if ( sscanf( ppsz[0], "QUERY_RECORDING TIMESLOT %d %c", &i_chanid, &c ) == 2
+           && i_chanid >= 1000 && i_chanid < 1000 + opt.i_recordings )
+    {
+        Append( &reply, "OK" SEP );
+        AppendRecording( &reply, p_conn->version, i_chanid - 1000 );
+    }
+    else if ( !strncmp( ppsz[0], "QUERY_COMMBREAK ", 16 ) || !strcmp( ppsz[0], "SQL_QUERY" ) )
+    {
+        /* no commercial breaks and no seek index */
+        Append( &reply, "0" );
+    }
+    else if ( !strcmp( ppsz[0], "DONE" ) )
+    {
+        return -1;
+    }
+    else
+    {
+        Append( &reply, "ERROR" SEP "unknown command" );
+    }
+
+    Trace( "command %.40s", ppsz[0] );
+
+    return SendReply( p_conn, &reply );
+}
+
+static void ConnRemove( fake_conn_t *p_conn )
+{
+    pthread_mutex_lock( &conns_lock );
+    for ( fake_conn_t **pp = &conns; *pp; pp = &(*pp)->p_next )
+    {
+        if ( *pp == p_conn )
+        {
+            *pp = p_conn->p_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &conns_lock );
+}
+
+static void *ConnThread( void *data )
+{
+    fake_conn_t *p_conn = data;
+    fake_transfer_t *p_ft = NULL;
+    reply_t reply = { NULL, 0, 0 };
+    char *ppsz[8];
+    char *psz;
+    int i_tokens;
+
+    /* MYTH_PROTO_VERSION <version> <token> */
+    psz = ReadFrame( p_conn->fd );
+    if ( !psz )
+        goto exit;
+
+    int i_version = 0;
+    char psz_token[32] = "";
+    sscanf( psz, "MYTH_PROTO_VERSION %d %31s", &i_version, psz_token );
+    ReplayTake( psz );
+    free( psz );
+
+    for ( size_t i = 0; i < VERSION_COUNT; i++ )
+    {
+        if ( fake_versions[i].i_version == i_version && !strcmp( fake_versions[i].psz_token, psz_token )
+          && ( !opt.i_version || opt.i_version == i_version ) )
+            p_conn->version = &fake_versions[i];
+    }
+
+    Trace( "version %d %s", i_version, p_conn->version ? "accept" : "reject" );
+    if ( !p_conn->version )
+    {
+        Append( &reply, "REJECT" SEP "%d", opt.i_version ? opt.i_version : fake_versions[VERSION_COUNT - 1].i_version );
+        SendReply( p_conn, &reply );
+        goto exit;
+    }
+    Append( &reply, "ACCEPT" SEP "%d", i_version );
+    if ( SendReply( p_conn, &reply ) )
+        goto exit;
+
+    /* ANN Playback <host> <events> or ANN FileTransfer <host> ...[]:[]<url>[]:[]<group> */
+    psz = ReadFrame( p_conn->fd );
+    if ( !psz )
+        goto exit;
+    exchange_t *p_ex = ReplayTake( psz );
+    i_tokens = Tokenize( psz, ppsz, 8 );
+
+    if ( !strncmp( ppsz[0], "ANN Playback ", 13 ) )
+    {
+        const char *psz_events = strrchr( ppsz[0], ' ' );
+        p_conn->b_events = psz_events && atoi( psz_events + 1 ) != 0;
+        Append( &reply, "OK" );
+    }
+    else if ( !strncmp( ppsz[0], "ANN FileTransfer ", 17 ) && i_tokens >= 2 )
+    {
+        const char *psz_base = strrchr( ppsz[1], '/' );
+        uint64_t i_size = opt.i_size;
+        char psz_field[32];
+
+        /* a replayed recording has the size it had then */
+        if ( p_ex && p_ex->psz_reply && !strncmp( p_ex->psz_reply, "OK", 2 ) )
+        {
+            if ( p_conn->version->i_version == 63 )
+                i_size = strtoull( Field( p_ex->psz_reply, 2, psz_field, sizeof( psz_field ) ), NULL, 10 ) << 32
+                       | strtoull( Field( p_ex->psz_reply, 3, psz_field, sizeof( psz_field ) ), NULL, 10 );
+            else
+                i_size = strtoull( Field( p_ex->psz_reply, 2, psz_field, sizeof( psz_field ) ), NULL, 10 );
+            p_ft = TransferNew( p_conn->fd, i_size );
+        }
+        else if ( RecordingFind( psz_base ? psz_base + 1 : ppsz[1] ) >= 0 )
+            p_ft = TransferNew( p_conn->fd, i_size );
+
+        if ( !p_ft )
+            Append( &reply, "ERROR" );
+        else if ( p_conn->version->i_version == 63 )
+            Append( &reply, "OK" SEP "%d" SEP "%"PRIu32 SEP "%"PRIu32, p_ft->i_id,
+                    (uint32_t) ( i_size >> 32 ), (uint32_t) i_size );
+        else
+            Append( &reply, "OK" SEP "%d" SEP "%"PRIu64, p_ft->i_id, i_size );
+
+        Trace( "transfer %d %s", p_ft ? p_ft->i_id : 0, psz_base ? psz_base + 1 : ppsz[1] );
+    }
+    else
+    {
+        Append( &reply, "ERROR" SEP "announce first" );
+    }
+    free( psz );
+    if ( SendReply( p_conn, &reply ) )
+        goto exit;
+
+    if ( p_ft )
+    {
+        /* a data socket, only its transfer writes to it now */
+        char c;
+        while ( recv( p_conn->fd, &c, 1, 0 ) > 0 )
+            ;
+        TransferDelete( p_ft );
+        goto exit;
+    }
+
+    while ( ( psz = ReadFrame( p_conn->fd ) ) != NULL )
+    {
+        int i_ret = Command( p_conn, psz );
+        free( psz );
+        if ( i_ret )
+            break;
+    }
+
+exit:
+    ConnRemove( p_conn );
+    close( p_conn->fd );
+    pthread_mutex_destroy( &p_conn->write_lock );
+    free( p_conn );
+
+    return NULL;
+}
+
+/*****************************************************************************
+ * BACKEND_MESSAGEs to the connections that asked for events
+ *****************************************************************************/
+static void Broadcast( const char *psz_message )
+{
+    char *psz_frame;
+
+    if ( asprintf( &psz_frame, "BACKEND_MESSAGE" SEP "%s" SEP "empty", psz_message ) == -1 )
+        return;
+
+    Trace( "event %s", psz_message );
+
+    pthread_mutex_lock( &conns_lock );
+    for ( fake_conn_t *p_conn = conns; p_conn; p_conn = p_conn->p_next )
+        if ( p_conn->b_events )
+            SendFrame( p_conn, psz_frame, strlen( psz_frame ) );
+    pthread_mutex_unlock( &conns_lock );
+
+    free( psz_frame );
+}
+
+static void *EventThread( void *data )
+{
+    (void) data;
+
+    for ( ;; )
+    {
+        sleep( opt.i_event_interval );
+        Broadcast( "RECORDING_LIST_CHANGE" );
+    }
+
+    return NULL;
+}
+
+static void *StdinThread( void *data )
+{
+    char psz_line[4096];
+
+    (void) data;
+
+    while ( fgets( psz_line, sizeof( psz_line ), stdin ) )
+    {
+        psz_line[strcspn( psz_line, "\r\n" )] = '\0';
+        if ( *psz_line )
+            Broadcast( psz_line );
+    }
+
+    return NULL;
+}
+
+static void Usage( const char *psz_name )
+{
+    fprintf( stderr,
+        "usage: %s [-p port] [-V protocol] [-n recordings] [-s size MB] [-e seconds] [-t] [-a] [-r trace [-x]]\n"
+        "  -p  port to listen on, 6543 by default\n"
+        "  -V  only accept this protocol version (63, 72, 75 or 77), any by default\n"
+        "  -n  number of recordings, bench_0000.ts and on, 10 by default\n"
+        "  -s  size of each recording in MB, 256 by default\n"
+        "  -e  send RECORDING_LIST_CHANGE every so many seconds\n"
+        "  -t  trace protocol events to stdout\n"
+        "  -a  answer REQUEST_BLOCK before sending the data, unlike mythbackend\n"
+        "  -r  replay a session recorded with --myth-trace\n"
+        "  -x  replay without the recorded delays\n"
+        "Lines on stdin are sent to event connections as BACKEND_MESSAGEs.\n",
+        psz_name );
+}
+
+int main( int argc, char **argv )
+{
+    int i_opt;
+
+    while ( ( i_opt = getopt( argc, argv, "p:V:n:s:e:tar:xh" ) ) != -1 )
+    {
+        switch ( i_opt )
+        {
+            case 'p': opt.i_port = atoi( optarg ); break;
+            case 'V': opt.i_version = atoi( optarg ); break;
+            case 'n': opt.i_recordings = atoi( optarg ); break;
+            case 's': opt.i_size = (uint64_t) atoll( optarg ) * 1024 * 1024; break;
+            case 'e': opt.i_event_interval = atoi( optarg ); break;
+            case 't': opt.b_trace = true; break;
+            case 'a': opt.b_async = true; break;
+            case 'r': opt.psz_replay = optarg; break;
+            case 'x': opt.b_fast = true; break;
+            default:
+                Usage( argv[0] );
+                return 1;
+        }
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+
+    if ( opt.psz_replay && ReplayLoad( opt.psz_replay ) )
+    {
+        fprintf( stderr, "mythfake: %s is not a session trace\n", opt.psz_replay );
+        return 1;
+    }
+
+    int fd_listen = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( opt.i_port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    setsockopt( fd_listen, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof( int ) );
+    if ( fd_listen < 0 || bind( fd_listen, (struct sockaddr *) &addr, sizeof( addr ) )
+      || listen( fd_listen, 64 ) )
+    {
+        perror( "mythfake: listen" );
+        return 1;
+    }
+
+    pthread_t thread;
+    if ( opt.i_event_interval > 0 )
+        pthread_create( &thread, NULL, EventThread, NULL );
+    pthread_create( &thread, NULL, StdinThread, NULL );
+
+    Trace( "listening %d", opt.i_port );
+
+    for ( ;; )
+    {
+        int fd = accept( fd_listen, NULL, NULL );
+        if ( fd < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            perror( "mythfake: accept" );
+            return 1;
+        }
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof( int ) );
+
+        fake_conn_t *p_conn = calloc( 1, sizeof( *p_conn ) );
+        if ( !p_conn )
+        {
+            close( fd );
+            continue;
+        }
+        p_conn->fd = fd;
+        pthread_mutex_init( &p_conn->write_lock, NULL );
+
+        pthread_mutex_lock( &conns_lock );
+        p_conn->p_next = conns;
+        conns = p_conn;
+        pthread_mutex_unlock( &conns_lock );
+
+        if ( pthread_create( &thread, NULL, ConnThread, p_conn ) )
+        {
+            ConnRemove( p_conn );
+            close( fd );
+            free( p_conn );
+            continue;
+        }
+        pthread_detach( thread );
+    }
+}
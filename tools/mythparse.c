@@ -0,0 +1,260 @@
+/*****************************************************************************
+ * mythparse.c: microbenchmark of the Myth protocol parsers
+ *****************************************************************************
+ * Copyright (C) 2013 Loune Lam
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Feeds synthetic QUERY_RECORDINGS replies from memory through the same
+ * myth_ReadFrame() and ParseRecording() myth.c uses, for every protocol
+ * version and list size, and reports the time and allocations per row.
+ *****************************************************************************/
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* count what the parsers allocate */
+static unsigned long i_allocs;
+
+static void *CountMalloc( size_t i_size )
+{
+    i_allocs++;
+    return malloc( i_size );
+}
+
+static void *CountRealloc( void *p, size_t i_size )
+{
+    i_allocs++;
+    return realloc( p, i_size );
+}
+
+#define malloc CountMalloc
+#define realloc CountRealloc
+#include "../myth_proto.h"
+#undef malloc
+#undef realloc
+
+/* ProgramInfo length of each version */
+static const int pi_program_fields[] = { 41, 44, 44, 44 };
+
+static int64_t Now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*****************************************************************************
+ * synthetic replies
+ *****************************************************************************/
+typedef struct
+{
+    char   *p;
+    size_t  i_len;
+    size_t  i_alloc;
+} buffer_t;
+
+static void Append( buffer_t *p_buf, const char *psz_fmt, ... )
+{
+    va_list args;
+
+    for ( ;; )
+    {
+        size_t i_room = p_buf->i_alloc - p_buf->i_len;
+
+        va_start( args, psz_fmt );
+        int i_ret = vsnprintf( p_buf->p ? p_buf->p + p_buf->i_len : NULL, i_room, psz_fmt, args );
+        va_end( args );
+
+        if ( i_ret < 0 )
+            abort();
+        if ( (size_t) i_ret < i_room )
+        {
+            p_buf->i_len += i_ret;
+            return;
+        }
+
+        p_buf->i_alloc = p_buf->i_alloc ? 2 * p_buf->i_alloc : 65536;
+        while ( p_buf->i_alloc - p_buf->i_len <= (size_t) i_ret )
+            p_buf->i_alloc *= 2;
+        p_buf->p = realloc( p_buf->p, p_buf->i_alloc );
+        if ( !p_buf->p )
+            abort();
+    }
+}
+
+/* a whole frame, length header included, with rows looking like a real
+ * library: text fields of typical length, numbers elsewhere */
+static buffer_t BuildReply( const myth_version_t *version, int i_program_fields, int i_rows )
+{
+    buffer_t buf = { NULL, 0, 0 };
+
+    Append( &buf, "%-8d%d", 0, i_rows );
+    for ( int i_row = 0; i_row < i_rows; i_row++ )
+    {
+        for ( int i = 0; i < i_program_fields; i++ )
+        {
+            Append( &buf, "[]:[]" );
+            if ( i == version->pi_fields[MYTH_FIELD_TITLE] )
+                Append( &buf, "Some Programme Title %d", i_row % 97 );
+            else if ( i == version->pi_fields[MYTH_FIELD_SUBTITLE] )
+                Append( &buf, "Episode Subtitle Number %d", i_row );
+            else if ( i == version->pi_fields[MYTH_FIELD_DESCRIPTION] )
+                Append( &buf, "A description of the programme, about as long as the ones "
+                              "the listings provide, with a few details of episode %d.", i_row );
+            else if ( i == version->pi_fields[MYTH_FIELD_GENRE] )
+                Append( &buf, "Documentary" );
+            else if ( i == version->pi_fields[MYTH_FIELD_CHANNEL_NAME] )
+                Append( &buf, "Channel %d HD", i_row % 40 );
+            else if ( i == version->pi_fields[MYTH_FIELD_CHANID] )
+                Append( &buf, "%d", 1000 + i_row % 40 );
+            else if ( i == version->pi_fields[MYTH_FIELD_URL] )
+                Append( &buf, "myth://192.168.1.10:6543/%d_20131026%06d.mpg", 1000 + i_row % 40, i_row );
+            else if ( i == version->pi_fields[MYTH_FIELD_FILESIZE] )
+                Append( &buf, "%d", 1500000000 + i_row );
+            else if ( i == version->pi_fields[MYTH_FIELD_START] )
+                Append( &buf, "%d", 1380000000 + i_row * 1800 );
+            else if ( i == version->pi_fields[MYTH_FIELD_END] )
+                Append( &buf, "%d", 1380001800 + i_row * 1800 );
+            else
+                Append( &buf, "%d", i % 7 ? i * 3 : 0 );
+        }
+    }
+
+    char psz_len[9];
+    snprintf( psz_len, sizeof( psz_len ), "%-8zu", buf.i_len - 8 );
+    memcpy( buf.p, psz_len, 8 );
+
+    return buf;
+}
+
+/* a socket over a memory buffer, handing out at most a TCP segment burst */
+typedef struct
+{
+    const char *p;
+    size_t      i_len;
+    size_t      i_pos;
+} memory_t;
+
+static int MemoryRead( void *p_opaque, int fd, void *p_buf, int i_len )
+{
+    memory_t *p_mem = p_opaque;
+    size_t i_copy = p_mem->i_len - p_mem->i_pos;
+
+    (void) fd;
+    if ( i_copy > (size_t) i_len )
+        i_copy = i_len;
+    if ( i_copy > 65536 )
+        i_copy = 65536;
+
+    memcpy( p_buf, p_mem->p + p_mem->i_pos, i_copy );
+    p_mem->i_pos += i_copy;
+
+    return i_copy;
+}
+
+/*****************************************************************************
+ * benchmark
+ *****************************************************************************/
+static int64_t i_sink;
+
+static void Benchmark( int i_version, int i_rows, int i_min_rows )
+{
+    const myth_version_t *version = myth_versions[i_version];
+    buffer_t buf = BuildReply( version, pi_program_fields[i_version], i_rows );
+    myth_socket_t sock;
+    int64_t i_read_best = INT64_MAX, i_parse_best = INT64_MAX;
+    unsigned long i_read_allocs = 0, i_parse_allocs = 0;
+    int i_iterations = __MAX( 3, i_min_rows / i_rows );
+
+    if ( myth_SocketInit( &sock, 0 ) )
+        abort();
+
+    for ( int i = 0; i < i_iterations; i++ )
+    {
+        memory_t mem = { buf.p, buf.i_len, 0 };
+        myth_reply_t reply = MYTH_REPLY_INIT;
+
+        sock.i_start = sock.i_end = 0;
+
+        i_allocs = 0;
+        int64_t i_start = Now();
+        if ( myth_ReadFrame( &sock, &reply, MemoryRead, &mem ) )
+            abort();
+        int64_t i_read = Now();
+        i_read_allocs = i_allocs;
+
+        /* the way SDRefreshRecordings() walks the list */
+        int i_count = atoi( myth_token( &reply, 0 ) );
+        int i_fields = i_count > 0 ? ( myth_count_tokens( &reply ) - 1 ) / i_count : 0;
+        for ( int i_row = 0; i_row < i_count; i_row++ )
+        {
+            myth_recording_t recording = ParseRecording( (myth_version_t *) version, &reply, 1 + i_row * i_fields );
+            i_sink += recording.i_fileSize + recording.duration;
+        }
+        int64_t i_parsed = Now();
+        i_parse_allocs = i_allocs - i_read_allocs;
+
+        i_read_best = __MIN( i_read_best, i_read - i_start );
+        i_parse_best = __MIN( i_parse_best, i_parsed - i_read );
+
+        myth_ReplyClean( &reply );
+    }
+
+    printf( "%-6s %8d %10.1f %10.1f %10.1f %12.3f %12.3f\n", version->psz_version, i_rows,
+            (double) buf.i_len / i_rows,
+            (double) i_read_best / i_rows, (double) i_parse_best / i_rows,
+            (double) i_read_allocs / i_rows, (double) i_parse_allocs / i_rows );
+
+    myth_SocketClean( &sock );
+    free( buf.p );
+}
+
+int main( int argc, char **argv )
+{
+    int i_max_rows = 100000, i_min_rows = 1000000;
+    int i_opt;
+
+    while ( ( i_opt = getopt( argc, argv, "n:m:h" ) ) != -1 )
+    {
+        switch ( i_opt )
+        {
+            case 'n': i_max_rows = atoi( optarg ); break;
+            case 'm': i_min_rows = atoi( optarg ); break;
+            default:
+                fprintf( stderr,
+                    "usage: %s [-n max rows] [-m min rows timed]\n"
+                    "  -n  largest list, 100000 by default, sizes go up by 10 from 100\n"
+                    "  -m  rows parsed per measurement at least, 1000000 by default\n",
+                    argv[0] );
+                return 1;
+        }
+    }
+
+    printf( "%-6s %8s %10s %10s %10s %12s %12s\n", "proto", "rows", "B/row",
+            "read ns", "parse ns", "read alloc", "parse alloc" );
+
+    for ( size_t i = 0; i < sizeof( myth_versions ) / sizeof( myth_versions[0] ); i++ )
+        for ( int i_rows = 100; i_rows <= i_max_rows; i_rows *= 10 )
+            Benchmark( i, i_rows, i_min_rows );
+
+    return i_sink == 42;
+}
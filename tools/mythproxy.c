@@ -0,0 +1,566 @@
+/*****************************************************************************
+ * mythproxy.c: TCP proxy adding latency, jitter, bandwidth caps and stalls
+ *****************************************************************************
+ * Copyright (C) 2013 Loune Lam
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Sits between the plugin and a backend, mythfake or a real one, and makes
+ * the link look like a remote site. Command and data connections get their
+ * own impairments: a connection is a data one once the client announces a
+ * FileTransfer on it, until then it is treated as a command connection.
+ *
+ * Each direction of a connection has a reader queueing what arrives with
+ * the time it is due, and a writer sending it then, so the added delay does
+ * not limit throughput the way a stop and wait relay would. The queue is
+ * bounded by a window, the bandwidth delay product unless win= is given,
+ * and a full one pushes back on the sender like a full TCP window.
+ *****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define CHUNK_SIZE  16384
+#define WINDOW_MIN  ( 64 * 1024 )     /* floor of the bandwidth delay product */
+#define WINDOW_FREE ( 256 * 1024 )    /* without a bandwidth cap */
+#define SNIFF_BYTES 4096                /* where ANN FileTransfer must show up */
+
+/* what is done to one kind of connection */
+typedef struct
+{
+    int64_t     i_delay;        /* one way, us */
+    int64_t     i_jitter;       /* one way, +- us */
+    int64_t     i_rate;         /* B/s each way, 0 for unlimited */
+    int64_t     i_stall_every;  /* us between stalls, 0 for none */
+    int64_t     i_stall;        /* us */
+    int64_t     i_window;       /* B in flight each way, 0 for the default */
+} impairment_t;
+
+static struct
+{
+    int             i_port;
+    const char     *psz_backend;
+    int             i_backend_port;
+    impairment_t    command;
+    impairment_t    data;
+    unsigned        i_seed;
+    bool            b_verbose;
+} opt = { 6544, "127.0.0.1", 6543, { 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0 }, 1, false };
+
+static int64_t i_epoch;
+
+static int64_t Now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void SleepUntil( int64_t i_time )
+{
+    int64_t i_wait = i_time - Now();
+    if ( i_wait > 0 )
+        usleep( i_wait );
+}
+
+/* rtt=ms,jitter=ms,bw=kbit/s,stall=every ms:ms,win=KiB */
+static int ParseImpairment( const char *psz_spec, impairment_t *p_imp )
+{
+    char *psz_dup = strdup( psz_spec ), *psz_save = NULL;
+    int i_ret = 0;
+
+    if ( !psz_dup )
+        return -1;
+
+    for ( char *psz = strtok_r( psz_dup, ",", &psz_save ); psz; psz = strtok_r( NULL, ",", &psz_save ) )
+    {
+        double f_a, f_b;
+
+        if ( sscanf( psz, "rtt=%lf", &f_a ) == 1 )
+            p_imp->i_delay = f_a * 1000 / 2;
+        else if ( sscanf( psz, "jitter=%lf", &f_a ) == 1 )
+            p_imp->i_jitter = f_a * 1000;
+        else if ( sscanf( psz, "bw=%lf", &f_a ) == 1 )
+            p_imp->i_rate = f_a * 1000 / 8;
+        else if ( sscanf( psz, "stall=%lf:%lf", &f_a, &f_b ) == 2 )
+        {
+            p_imp->i_stall_every = f_a * 1000;
+            p_imp->i_stall = f_b * 1000;
+        }
+        else if ( sscanf( psz, "win=%lf", &f_a ) == 1 && f_a > 0 )
+            p_imp->i_window = f_a * 1024;
+        else
+        {
+            fprintf( stderr, "mythproxy: unknown impairment %s\n", psz );
+            i_ret = -1;
+        }
+    }
+
+    free( psz_dup );
+
+    return i_ret;
+}
+
+/*****************************************************************************
+ * One direction of a connection
+ *****************************************************************************/
+typedef struct _chunk_t
+{
+    int64_t     i_due;
+    size_t      i_len;          /* 0 at the end of the stream */
+    struct _chunk_t *p_next;
+    uint8_t     p_data[];
+} chunk_t;
+
+typedef struct _proxy_conn_t proxy_conn_t;
+
+typedef struct
+{
+    proxy_conn_t *p_conn;
+    int         fd_in;
+    int         fd_out;
+    bool        b_upstream;     /* client to backend */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  wait;
+    chunk_t    *p_first;
+    chunk_t   **pp_last;
+    size_t      i_queued;
+
+    int64_t     i_last_due;     /* chunks leave in order */
+    int64_t     i_link_free;    /* when the capped link is done with the last one */
+    unsigned    i_seed;
+
+    pthread_t   reader;
+    pthread_t   writer;
+} pipe_t;
+
+struct _proxy_conn_t
+{
+    int         i_id;
+    int         fd_client;
+    int         fd_backend;
+    bool        b_data;         /* announced a FileTransfer */
+    pipe_t      up;
+    pipe_t      down;
+
+    pthread_mutex_t lock;
+    int         i_done;         /* directions finished */
+};
+
+static const impairment_t *ConnImpairment( proxy_conn_t *p_conn )
+{
+    pthread_mutex_lock( &p_conn->lock );
+    bool b_data = p_conn->b_data;
+    pthread_mutex_unlock( &p_conn->lock );
+
+    return b_data ? &opt.data : &opt.command;
+}
+
+/* when a chunk arriving now may leave */
+static int64_t PipeDue( pipe_t *p_pipe, size_t i_len )
+{
+    const impairment_t *p_imp = ConnImpairment( p_pipe->p_conn );
+    int64_t i_due = Now() + p_imp->i_delay;
+
+    if ( p_imp->i_jitter > 0 )
+        i_due += (int64_t) ( rand_r( &p_pipe->i_seed ) % ( 2 * p_imp->i_jitter + 1 ) ) - p_imp->i_jitter;
+
+    /* the cap delays by the time the bytes take on the link */
+    if ( p_imp->i_rate > 0 )
+    {
+        int64_t i_start = p_pipe->i_link_free > i_due ? p_pipe->i_link_free : i_due;
+        p_pipe->i_link_free = i_start + (int64_t) i_len * 1000000 / p_imp->i_rate;
+        i_due = p_pipe->i_link_free;
+    }
+
+    if ( i_due < p_pipe->i_last_due )
+        i_due = p_pipe->i_last_due;
+    p_pipe->i_last_due = i_due;
+
+    return i_due;
+}
+
+/* past a stall window the writer waits for its end */
+static void PipeStall( pipe_t *p_pipe )
+{
+    const impairment_t *p_imp = ConnImpairment( p_pipe->p_conn );
+
+    if ( p_imp->i_stall_every <= 0 || p_imp->i_stall <= 0 )
+        return;
+
+    int64_t i_now = Now() - i_epoch;
+    int64_t i_phase = i_now % ( p_imp->i_stall_every + p_imp->i_stall );
+    if ( i_phase >= p_imp->i_stall_every )
+        SleepUntil( i_epoch + i_now - i_phase + p_imp->i_stall_every + p_imp->i_stall );
+}
+
+/* what may be queued before the reader stops taking more, about what a
+ * TCP window of the link would hold in flight */
+static size_t PipeWindow( pipe_t *p_pipe )
+{
+    const impairment_t *p_imp = ConnImpairment( p_pipe->p_conn );
+
+    if ( p_imp->i_window > 0 )
+        return p_imp->i_window;
+    if ( p_imp->i_rate <= 0 )
+        return WINDOW_FREE;
+
+    int64_t i_bdp = p_imp->i_rate * 2 * p_imp->i_delay / 1000000;
+    return i_bdp > WINDOW_MIN ? i_bdp : WINDOW_MIN;
+}
+
+static void PipePush( pipe_t *p_pipe, chunk_t *p_chunk )
+{
+    pthread_mutex_lock( &p_pipe->lock );
+    while ( p_chunk->i_len > 0 && p_pipe->i_queued >= PipeWindow( p_pipe ) )
+        pthread_cond_wait( &p_pipe->wait, &p_pipe->lock );
+
+    p_chunk->p_next = NULL;
+    *p_pipe->pp_last = p_chunk;
+    p_pipe->pp_last = &p_chunk->p_next;
+    p_pipe->i_queued += p_chunk->i_len;
+    pthread_cond_broadcast( &p_pipe->wait );
+    pthread_mutex_unlock( &p_pipe->lock );
+}
+
+static chunk_t *PipePop( pipe_t *p_pipe )
+{
+    pthread_mutex_lock( &p_pipe->lock );
+    while ( !p_pipe->p_first )
+        pthread_cond_wait( &p_pipe->wait, &p_pipe->lock );
+
+    chunk_t *p_chunk = p_pipe->p_first;
+    p_pipe->p_first = p_chunk->p_next;
+    if ( !p_pipe->p_first )
+        p_pipe->pp_last = &p_pipe->p_first;
+    p_pipe->i_queued -= p_chunk->i_len;
+    pthread_cond_broadcast( &p_pipe->wait );
+    pthread_mutex_unlock( &p_pipe->lock );
+
+    return p_chunk;
+}
+
+static void *ReaderThread( void *data )
+{
+    pipe_t *p_pipe = data;
+    proxy_conn_t *p_conn = p_pipe->p_conn;
+    size_t i_sniffed = 0;
+    char psz_sniff[SNIFF_BYTES + 1];
+
+    for ( ;; )
+    {
+        chunk_t *p_chunk = malloc( sizeof( *p_chunk ) + CHUNK_SIZE );
+        if ( !p_chunk )
+            abort();
+
+        ssize_t i_read = recv( p_pipe->fd_in, p_chunk->p_data, CHUNK_SIZE, 0 );
+        if ( i_read < 0 && errno == EINTR )
+        {
+            free( p_chunk );
+            continue;
+        }
+        p_chunk->i_len = i_read > 0 ? i_read : 0;
+
+        /* the client tells what the connection is for in its first frames */
+        if ( p_pipe->b_upstream && i_sniffed < SNIFF_BYTES && i_read > 0 )
+        {
+            size_t i_copy = SNIFF_BYTES - i_sniffed < (size_t) i_read ? SNIFF_BYTES - i_sniffed : (size_t) i_read;
+            memcpy( psz_sniff + i_sniffed, p_chunk->p_data, i_copy );
+            i_sniffed += i_copy;
+            psz_sniff[i_sniffed] = '\0';
+
+            if ( memmem( psz_sniff, i_sniffed, "ANN FileTransfer ", 17 ) )
+            {
+                pthread_mutex_lock( &p_conn->lock );
+                if ( !p_conn->b_data && opt.b_verbose )
+                    fprintf( stderr, "mythproxy: connection %d is a data connection\n", p_conn->i_id );
+                p_conn->b_data = true;
+                pthread_mutex_unlock( &p_conn->lock );
+                i_sniffed = SNIFF_BYTES;
+            }
+        }
+
+        p_chunk->i_due = PipeDue( p_pipe, p_chunk->i_len );
+        PipePush( p_pipe, p_chunk );
+
+        if ( i_read <= 0 )
+            break;
+    }
+
+    return NULL;
+}
+
+static void *WriterThread( void *data )
+{
+    pipe_t *p_pipe = data;
+    bool b_failed = false;
+
+    for ( ;; )
+    {
+        chunk_t *p_chunk = PipePop( p_pipe );
+        size_t i_len = p_chunk->i_len;
+
+        if ( i_len > 0 && !b_failed )
+        {
+            SleepUntil( p_chunk->i_due );
+            PipeStall( p_pipe );
+
+            for ( size_t i_sent = 0; i_sent < i_len; )
+            {
+                ssize_t i_ret = send( p_pipe->fd_out, p_chunk->p_data + i_sent, i_len - i_sent, MSG_NOSIGNAL );
+                if ( i_ret < 0 && errno == EINTR )
+                    continue;
+                if ( i_ret <= 0 )
+                {
+                    /* keep draining so the reader never blocks on a full queue */
+                    b_failed = true;
+                    shutdown( p_pipe->fd_in, SHUT_RD );
+                    break;
+                }
+                i_sent += i_ret;
+            }
+        }
+        free( p_chunk );
+
+        if ( i_len == 0 )
+            break;
+    }
+
+    /* the end of the stream is delayed like the data before it */
+    shutdown( p_pipe->fd_out, SHUT_WR );
+
+    return NULL;
+}
+
+/*****************************************************************************
+ * Connections
+ *****************************************************************************/
+static void PipeInit( pipe_t *p_pipe, proxy_conn_t *p_conn, int fd_in, int fd_out, bool b_upstream )
+{
+    p_pipe->p_conn = p_conn;
+    p_pipe->fd_in = fd_in;
+    p_pipe->fd_out = fd_out;
+    p_pipe->b_upstream = b_upstream;
+    pthread_mutex_init( &p_pipe->lock, NULL );
+    pthread_cond_init( &p_pipe->wait, NULL );
+    p_pipe->p_first = NULL;
+    p_pipe->pp_last = &p_pipe->p_first;
+    p_pipe->i_queued = 0;
+    p_pipe->i_last_due = 0;
+    p_pipe->i_link_free = 0;
+    p_pipe->i_seed = opt.i_seed + 2 * p_conn->i_id + b_upstream;
+}
+
+static void PipeClean( pipe_t *p_pipe )
+{
+    pthread_cond_destroy( &p_pipe->wait );
+    pthread_mutex_destroy( &p_pipe->lock );
+}
+
+static void *ConnThread( void *data )
+{
+    proxy_conn_t *p_conn = data;
+
+    PipeInit( &p_conn->up, p_conn, p_conn->fd_client, p_conn->fd_backend, true );
+    PipeInit( &p_conn->down, p_conn, p_conn->fd_backend, p_conn->fd_client, false );
+
+    pthread_create( &p_conn->up.reader, NULL, ReaderThread, &p_conn->up );
+    pthread_create( &p_conn->up.writer, NULL, WriterThread, &p_conn->up );
+    pthread_create( &p_conn->down.reader, NULL, ReaderThread, &p_conn->down );
+    pthread_create( &p_conn->down.writer, NULL, WriterThread, &p_conn->down );
+
+    pthread_join( p_conn->up.reader, NULL );
+    pthread_join( p_conn->up.writer, NULL );
+    pthread_join( p_conn->down.reader, NULL );
+    pthread_join( p_conn->down.writer, NULL );
+
+    if ( opt.b_verbose )
+        fprintf( stderr, "mythproxy: connection %d closed\n", p_conn->i_id );
+
+    close( p_conn->fd_client );
+    close( p_conn->fd_backend );
+    PipeClean( &p_conn->up );
+    PipeClean( &p_conn->down );
+    pthread_mutex_destroy( &p_conn->lock );
+    free( p_conn );
+
+    return NULL;
+}
+
+static int ConnectBackend( void )
+{
+    struct addrinfo hints, *p_res;
+    char psz_port[16];
+    int fd = -1;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf( psz_port, sizeof( psz_port ), "%d", opt.i_backend_port );
+
+    if ( getaddrinfo( opt.psz_backend, psz_port, &hints, &p_res ) )
+        return -1;
+
+    for ( struct addrinfo *p = p_res; p && fd < 0; p = p->ai_next )
+    {
+        fd = socket( p->ai_family, p->ai_socktype, p->ai_protocol );
+        if ( fd >= 0 && connect( fd, p->ai_addr, p->ai_addrlen ) )
+        {
+            close( fd );
+            fd = -1;
+        }
+    }
+    freeaddrinfo( p_res );
+
+    if ( fd >= 0 )
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof( int ) );
+
+    return fd;
+}
+
+static void Usage( const char *psz_name )
+{
+    fprintf( stderr,
+        "usage: %s [-l port] [-b host:port] [-c impairments] [-d impairments] [-s seed] [-v]\n"
+        "  -l  port to listen on, 6544 by default\n"
+        "  -b  backend to forward to, 127.0.0.1:6543 by default\n"
+        "  -c  impairments of command connections\n"
+        "  -d  impairments of data connections\n"
+        "  -s  seed of the jitter, 1 by default\n"
+        "  -v  log connections to stderr\n"
+        "Impairments are comma separated, all off by default:\n"
+        "  rtt=<ms>           round-trip time added, half in each direction\n"
+        "  jitter=<ms>        up to this much more or less delay, order is kept\n"
+        "  bw=<kbit/s>        bandwidth cap in each direction\n"
+        "  stall=<ms>:<ms>    after so long, hold all traffic for so long, repeatedly\n"
+        "  win=<KiB>          bytes in flight in each direction, by default bw times\n"
+        "                     rtt but at least 64, or 256 without a bandwidth cap\n"
+        "e.g. %s -c rtt=80,jitter=10 -d rtt=80,jitter=10,bw=20000,stall=30000:1500\n",
+        psz_name, psz_name );
+}
+
+int main( int argc, char **argv )
+{
+    int i_opt;
+    char *psz_colon;
+
+    while ( ( i_opt = getopt( argc, argv, "l:b:c:d:s:vh" ) ) != -1 )
+    {
+        switch ( i_opt )
+        {
+            case 'l': opt.i_port = atoi( optarg ); break;
+            case 'b':
+                opt.psz_backend = optarg;
+                psz_colon = strrchr( optarg, ':' );
+                if ( psz_colon )
+                {
+                    *psz_colon = '\0';
+                    opt.i_backend_port = atoi( psz_colon + 1 );
+                }
+                break;
+            case 'c':
+                if ( ParseImpairment( optarg, &opt.command ) )
+                    return 1;
+                break;
+            case 'd':
+                if ( ParseImpairment( optarg, &opt.data ) )
+                    return 1;
+                break;
+            case 's': opt.i_seed = strtoul( optarg, NULL, 10 ); break;
+            case 'v': opt.b_verbose = true; break;
+            default:
+                Usage( argv[0] );
+                return 1;
+        }
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+    i_epoch = Now();
+
+    int fd_listen = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( opt.i_port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    setsockopt( fd_listen, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof( int ) );
+    if ( fd_listen < 0 || bind( fd_listen, (struct sockaddr *) &addr, sizeof( addr ) )
+      || listen( fd_listen, 64 ) )
+    {
+        perror( "mythproxy: listen" );
+        return 1;
+    }
+
+    for ( int i_id = 1; ; i_id++ )
+    {
+        int fd = accept( fd_listen, NULL, NULL );
+        if ( fd < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            perror( "mythproxy: accept" );
+            return 1;
+        }
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof( int ) );
+
+        int fd_backend = ConnectBackend();
+        proxy_conn_t *p_conn = fd_backend >= 0 ? calloc( 1, sizeof( *p_conn ) ) : NULL;
+        if ( !p_conn )
+        {
+            if ( fd_backend >= 0 )
+                close( fd_backend );
+            else
+                fprintf( stderr, "mythproxy: unable to reach %s:%d\n", opt.psz_backend, opt.i_backend_port );
+            close( fd );
+            continue;
+        }
+
+        p_conn->i_id = i_id;
+        p_conn->fd_client = fd;
+        p_conn->fd_backend = fd_backend;
+        pthread_mutex_init( &p_conn->lock, NULL );
+
+        if ( opt.b_verbose )
+            fprintf( stderr, "mythproxy: connection %d opened\n", i_id );
+
+        pthread_t thread;
+        if ( pthread_create( &thread, NULL, ConnThread, p_conn ) )
+        {
+            pthread_mutex_destroy( &p_conn->lock );
+            close( fd );
+            close( fd_backend );
+            free( p_conn );
+            continue;
+        }
+        pthread_detach( thread );
+    }
+}